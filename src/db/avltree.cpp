@@ -9,14 +9,15 @@
  */
 
 #include "avltree.h"
+#include "chunkedforeach.h"
 #include "server/jsvm.h"
 #include "kernel/exception.h"
 #include "util/log.h"
 
+#include <algorithm>
+
 namespace Db
 {
-    std::hash<AvlTree::Key> AvlTree::m_keyHashFunction = std::hash<AvlTree::Key>();
-
     AvlTree::AvlTree()
         : Interface()
         , m_deleteDisposer(m_nodes)
@@ -26,35 +27,39 @@ namespace Db
 
     std::string AvlTree::get(const CommandHandler::Arguments &arguments)
     {
+        HotKeys::sample(this, arguments[1] /* key */);
+
         Node findMe(arguments[1]);
 
         // get shared lock
-        boost::shared_lock<boost::shared_mutex> lock(m_access);
+        SharedLock lock(m_access);
 
         Tree::const_iterator found = m_tree->find(findMe);
         if (found == m_tree->end()) {
             return CommandHandler::REPLY_NIL;
         }
-        return CommandHandler::toReplyString(found->get().value);
+        Value buffer;
+        return CommandHandler::toReplyString(read(found->get(), buffer));
     }
 
     std::string AvlTree::set(const CommandHandler::Arguments &arguments)
     {
+        HotKeys::sample(this, arguments[1] /* key */);
+
         // get exclusive lock
-        boost::upgrade_lock<boost::shared_mutex> lock(m_access);
-        boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
+        ExclusiveLock lock(m_access);
 
         Node findMe(arguments[1]);
         Tree::iterator found = m_tree->find(findMe);
         if (found != m_tree->end()) {
+            release(found->get());
             found->get().value = arguments[2] /* value */;
+            changed(arguments[1] /* key */, found->get());
             return CommandHandler::REPLY_OK;
         }
 
-        m_nodes.push_back(Node(Node::Data(arguments[1] /* key */,
-                                          arguments[2] /* value */)));
-        m_nodes.back().get().listIterator = --m_nodes.end();
-        m_tree->insert_unique(m_nodes.back());
+        changed(arguments[1] /* key */,
+                insert(arguments[1] /* key */, arguments[2] /* value */).get());
 
         return CommandHandler::REPLY_OK;
     }
@@ -62,45 +67,449 @@ namespace Db
     std::string AvlTree::del(const CommandHandler::Arguments &arguments)
     {
         // get exclusive lock
-        boost::upgrade_lock<boost::shared_mutex> lock(m_access);
-        boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
+        ExclusiveLock lock(m_access);
 
         Node findMe(arguments[1]);
-        Tree::const_iterator found = m_tree->find(findMe);
+        Tree::iterator found = m_tree->find(findMe);
         if (found == m_tree->end()) {
             return CommandHandler::REPLY_FALSE;
         }
+        release(found->get());
         m_tree->erase_and_dispose(found, m_deleteDisposer);
+        deleted(arguments[1] /* key */);
+
+        return CommandHandler::REPLY_TRUE;
+    }
+
+    std::string AvlTree::foreach(const CommandHandler::Arguments &arguments,
+                                 CommandHandler &handler)
+    {
+        ForeachOptions options;
+        if (!parseForeachOptions(arguments, options)) {
+            return REPLY_ERROR_SYNTAX;
+        }
+        // Inside MULTI/EXEC lock is held for the whole batch anyway
+        if (!options.atomic && !BatchLock::owns(m_access)) {
+            return ChunkedForeach<AvlTree>::start(*this, arguments[1] /* script */,
+                                                  options, handler);
+        }
+
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        const KeyFilter &filter = options.filter;
+
+        Batch batch;
+        batch.reserve(m_nodes.size());
+        for (Tree::iterator i = m_tree->lower_bound(filter.lowerBound(), KeyCompare());
+             (i != m_tree->end()) && !filter.isAfter(i->get().key); ++i) {
+            Node::Data &data = i->get();
+            if (!filter.matches(data.key)) {
+                continue;
+            }
+            batch.push_back(std::make_pair(&data.key, &data));
+        }
+
+        try {
+            apply(arguments[1] /* script */, batch, options.threads);
+        } catch (const Exception &e) {
+            LOG(error) << e.getMessage();
+            LOG(error) << "Will not continue";
+            return CommandHandler::REPLY_ERROR;
+        }
 
         return CommandHandler::REPLY_TRUE;
     }
 
-    std::string AvlTree::foreach(const CommandHandler::Arguments &arguments)
+    std::string AvlTree::reduce(const CommandHandler::Arguments &arguments)
     {
-        JsVm vm(arguments[1]);
+        if ((arguments.size() < 2 /* script */) || (arguments.size() > 3)) {
+            return REPLY_ERROR_SYNTAX;
+        }
+
+        JsVm vm(arguments[1] /* script */);
+        if (!vm.init() ||
+            !vm.setAccumulator((arguments.size() == 3) ? arguments[2] : std::string())) {
+            return CommandHandler::REPLY_ERROR;
+        }
+
+        // get shared lock
+        SharedLock lock(m_access);
+
+        try {
+            Value buffer;
+            for (const Node &node : m_nodes) {
+                const Node::Data &data = node.get();
+                vm.reduce(data.key, read(data, buffer));
+            }
+        } catch (const Exception &e) {
+            LOG(error) << e.getMessage();
+            LOG(error) << "Will not continue";
+            return CommandHandler::REPLY_ERROR;
+        }
+
+        return vm.accumulatorReply();
+    }
+
+    std::string AvlTree::eval(const std::string &code,
+                              const std::vector<Key> &keys,
+                              const std::vector<std::string> &args)
+    {
+        JsVm vm(code);
         if (!vm.init()) {
             return CommandHandler::REPLY_ERROR;
         }
 
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        JsVm::Writes writes;
+        std::string reply;
+        try {
+            std::vector<const Value *> values;
+            values.reserve(keys.size());
+            for (const Key &key : keys) {
+                Node findMe(key);
+                Tree::iterator found = m_tree->find(findMe);
+                values.push_back((found != m_tree->end()) ? &load(found->get()) : nullptr);
+            }
+
+            reply = vm.eval(keys, values, args, writes);
+        } catch (const Exception &e) {
+            LOG(error) << e.getMessage();
+            return CommandHandler::REPLY_ERROR;
+        }
+
+        for (JsVm::Write &write : writes) {
+            const Key &key = keys[write.index];
+            Node findMe(key);
+            Tree::iterator found = m_tree->find(findMe);
+
+            if (write.deleted) {
+                if (found != m_tree->end()) {
+                    release(found->get());
+                    m_tree->erase_and_dispose(found, m_deleteDisposer);
+                    deleted(key);
+                }
+                continue;
+            }
+            if (found == m_tree->end()) {
+                changed(key, insert(key, write.value).get());
+                continue;
+            }
+            release(found->get());
+            found->get().value.swap(write.value);
+            changed(key, found->get());
+        }
+
+        return reply;
+    }
+
+    void AvlTree::foreachBegin(ForeachCursor &cursor, const KeyFilter &filter)
+    {
+        cursor.started = false;
+        cursor.filter = filter;
+    }
+
+    bool AvlTree::foreachChunk(const std::string &code, size_t threads,
+                               ForeachCursor &cursor, size_t limit)
+    {
+        const KeyFilter &filter = cursor.filter;
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Tree::iterator i = cursor.started
+                         ? m_tree->upper_bound(cursor.key, KeyCompare())
+                         : m_tree->lower_bound(filter.lowerBound(), KeyCompare());
+
+        Batch batch;
+        batch.reserve(std::min(limit, m_nodes.size()));
+        /**
+         * Not matched nodes are counted too, to limit time under lock.
+         */
+        for (size_t n = 0; (i != m_tree->end()) && (n < limit); ++i, ++n) {
+            Node::Data &data = i->get();
+            if (filter.isAfter(data.key)) {
+                i = m_tree->end();
+                break;
+            }
+
+            cursor.key = data.key;
+            cursor.started = true;
+
+            if (filter.matches(data.key)) {
+                batch.push_back(std::make_pair(&data.key, &data));
+            }
+        }
+        apply(code, batch, threads);
+
+        return (i != m_tree->end());
+    }
+
+    std::string AvlTree::append(const CommandHandler::Arguments &arguments)
+    {
+        const Value &tail = arguments[2];
+        // Reject too big tail before taking the lock
+        if (tail.size() > MAX_VALUE_SIZE) {
+            return REPLY_ERROR_VALUE_TOO_BIG;
+        }
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Node findMe(arguments[1]);
+        Tree::iterator found = m_tree->find(findMe);
+        if (found == m_tree->end()) {
+            found = m_tree->iterator_to(insert(arguments[1] /* key */, Value()));
+        } else if ((found->get().size() + tail.size()) > MAX_VALUE_SIZE) {
+            return REPLY_ERROR_VALUE_TOO_BIG;
+        }
+        Value &value = load(found->get());
+        appendTail(value, tail);
+        changed(arguments[1] /* key */, found->get());
+
+        return CommandHandler::toIntegerReplyString(value.size());
+    }
+
+    std::string AvlTree::getRange(const CommandHandler::Arguments &arguments)
+    {
+        long long start, end;
+        if (!CommandHandler::toInteger(arguments[2], start) ||
+            !CommandHandler::toInteger(arguments[3], end)) {
+            return REPLY_ERROR_NOT_INTEGER;
+        }
+
+        Node findMe(arguments[1]);
+
+        // get shared lock
+        SharedLock lock(m_access);
+
+        Tree::const_iterator found = m_tree->find(findMe);
+        if (found == m_tree->end()) {
+            return CommandHandler::toReplyString(std::string());
+        }
+        Value buffer;
+        return rangeReply(read(found->get(), buffer), start, end);
+    }
+
+    std::string AvlTree::setRange(const CommandHandler::Arguments &arguments)
+    {
+        long long offset;
+        if (!CommandHandler::toInteger(arguments[2], offset) || (offset < 0)) {
+            return REPLY_ERROR_NOT_INTEGER;
+        }
+        const Value &chunk = arguments[3];
+        if ((offset + chunk.size()) > MAX_VALUE_SIZE) {
+            return REPLY_ERROR_VALUE_TOO_BIG;
+        }
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Node findMe(arguments[1]);
+        Tree::iterator found = m_tree->find(findMe);
+        if (found == m_tree->end()) {
+            // Do not create empty key, like redis does
+            if (chunk.empty()) {
+                return CommandHandler::toIntegerReplyString(0);
+            }
+            found = m_tree->iterator_to(insert(arguments[1] /* key */, Value()));
+        }
+        Value &value = load(found->get());
+        writeRange(value, offset, chunk);
+        changed(arguments[1] /* key */, found->get());
+
+        return CommandHandler::toIntegerReplyString(value.size());
+    }
+
+    std::string AvlTree::length(const CommandHandler::Arguments &arguments)
+    {
+        Node findMe(arguments[1]);
+
+        // get shared lock
+        SharedLock lock(m_access);
+
+        Tree::const_iterator found = m_tree->find(findMe);
+        if (found == m_tree->end()) {
+            return CommandHandler::toIntegerReplyString(0);
+        }
+        return CommandHandler::toIntegerReplyString(found->get().size());
+    }
+
+    std::string AvlTree::getVersioned(const CommandHandler::Arguments &arguments)
+    {
+        Node findMe(arguments[1]);
+
+        // get shared lock
+        SharedLock lock(m_access);
+
+        Tree::const_iterator found = m_tree->find(findMe);
+        if (found == m_tree->end()) {
+            return CommandHandler::REPLY_NIL;
+        }
+        Value buffer;
+        return versionedReply(found->get(), read(found->get(), buffer));
+    }
+
+    std::string AvlTree::compareAndSet(const CommandHandler::Arguments &arguments)
+    {
+        long long version;
+        if (!CommandHandler::toInteger(arguments[2], version) || (version < 0)) {
+            return REPLY_ERROR_NOT_INTEGER;
+        }
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Node findMe(arguments[1]);
+        Tree::iterator found = m_tree->find(findMe);
+        if (found == m_tree->end()) {
+            if (version) {
+                return CommandHandler::REPLY_FALSE;
+            }
+            Node::Data &data = insert(arguments[1] /* key */, arguments[3] /* value */).get();
+            changed(arguments[1] /* key */, data);
+            return CommandHandler::toIntegerReplyString(data.version);
+        }
+
+        Node::Data &data = found->get();
+        if (data.version != (Version)version) {
+            return CommandHandler::REPLY_FALSE;
+        }
+        release(data);
+        data.value = arguments[3] /* value */;
+        changed(arguments[1] /* key */, data);
+
+        return CommandHandler::toIntegerReplyString(data.version);
+    }
+
+    AvlTree::Version AvlTree::versionOf(const Key &key)
+    {
+        Node findMe(key);
+
+        // get shared lock
+        SharedLock lock(m_access);
+
+        Tree::const_iterator found = m_tree->find(findMe);
+        if (found == m_tree->end()) {
+            return 0;
+        }
+        return found->get().version;
+    }
+
+    size_t AvlTree::size()
+    {
+        // get shared lock
+        SharedLock lock(m_access);
+
+        return m_tree->size();
+    }
+
+    void AvlTree::flush()
+    {
+        /**
+         * Order is important: tree must be destroyed before nodes,
+         * since it unlinks them.
+         */
+        Nodes nodes;
+        std::unique_ptr<Tree> tree(new Tree);
 
         // get exclusive lock
-        boost::upgrade_lock<boost::shared_mutex> lock(m_access);
-        // XXX: support non-atomic mode
-        boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
+        ExclusiveLock lock(m_access);
+
+        m_nodes.swap(nodes);
+        m_tree.swap(tree);
+        m_tier.releaseAll();
+        flushed();
+    }
+
+    void AvlTree::dump(SnapshotWriter &writer)
+    {
+        writer.writeLength(m_tree->size());
+        Value buffer;
+        for (const Node &node : *m_tree) {
+            writer.writeEntry(node.get().key, read(node.get(), buffer));
+        }
+    }
+
+    void AvlTree::restore(Entries &entries)
+    {
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        for (Entries::value_type &entry : entries) {
+            Node findMe(entry.first);
+            Tree::iterator found = m_tree->find(findMe);
+            if (found == m_tree->end()) {
+                found = m_tree->iterator_to(insert(entry.first, Value()));
+            }
+            release(found->get());
+            found->get().value.swap(entry.second);
+            stamp(found->get());
+        }
+    }
 
+    void AvlTree::replay(const std::vector<Journal::Record> &records)
+    {
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        for (const Journal::Record &record : records) {
+            if (record.type == 'F') {
+                // Tree must be cleared before nodes, since it unlinks them
+                m_tree->clear();
+                m_nodes.clear();
+                m_tier.releaseAll();
+                continue;
+            }
+
+            Key key(record.key, record.keySize);
+            Node findMe(key);
+            Tree::iterator found = m_tree->find(findMe);
+
+            if (record.type == 'D') {
+                if (found != m_tree->end()) {
+                    release(found->get());
+                    m_tree->erase_and_dispose(found, m_deleteDisposer);
+                }
+                continue;
+            }
+            if (found == m_tree->end()) {
+                found = m_tree->iterator_to(insert(key, Value()));
+            }
+            release(found->get());
+            found->get().value.assign(record.value, record.valueSize);
+            stamp(found->get());
+        }
+    }
+
+    void AvlTree::forEachEntry(const std::function<bool(const Key &key, Entry &entry)> &callback)
+    {
         for (Node &node : m_nodes) {
-            std::string &key = node.get().key;
-            std::string &value = node.get().value;
-
-            try {
-                value = vm.call(key, value);
-            } catch (const Exception &e) {
-                LOG(error) << e.getMessage();
-                LOG(error) << "Will not continue";
-                return CommandHandler::REPLY_ERROR;
+            if (!callback(node.get().key, node.get())) {
+                return;
             }
         }
+    }
 
-        return CommandHandler::REPLY_TRUE;
+    AvlTree::Entry *AvlTree::findEntry(const Key &key)
+    {
+        Node findMe(key);
+        Tree::iterator found = m_tree->find(findMe);
+        if (found == m_tree->end()) {
+            return nullptr;
+        }
+        return &found->get();
+    }
+
+    AvlTree::Node &AvlTree::insert(const Key &key, const Value &value)
+    {
+        m_nodes.push_back(Node(Node::Data(key, value)));
+        m_nodes.back().get().listIterator = --m_nodes.end();
+        m_tree->insert_unique(m_nodes.back());
+
+        return m_nodes.back();
     }
 }
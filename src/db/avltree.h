@@ -12,13 +12,14 @@
 #pragma once
 
 #include "db/interface.h"
+#include "db/snapshot.h"
 
 #include <boost/intrusive/avl_set_hook.hpp>
 #include <boost/intrusive/avltree.hpp>
-#include <boost/thread/pthread/shared_mutex.hpp>
 #include <memory>
 #include <utility>
 #include <list>
+#include <functional>
 #include <string>
 
 
@@ -27,6 +28,8 @@ namespace Db
     /**
      * @brief Avl tree using boost::intrusive
      *
+     * Ordered by key.
+     *
      * Thread-safe (TODO: improve thread-safe support)
      */
     class AvlTree : public Interface
@@ -37,11 +40,77 @@ namespace Db
         std::string get(const CommandHandler::Arguments &arguments);
         std::string set(const CommandHandler::Arguments &arguments);
         std::string del(const CommandHandler::Arguments &arguments);
-        std::string foreach(const CommandHandler::Arguments &arguments);
+        std::string foreach(const CommandHandler::Arguments &arguments,
+                            CommandHandler &handler);
+        std::string reduce(const CommandHandler::Arguments &arguments);
+        std::string eval(const std::string &code,
+                         const std::vector<Key> &keys,
+                         const std::vector<std::string> &args);
 
-    private:
-        static std::hash<Key> m_keyHashFunction;
+        std::string append(const CommandHandler::Arguments &arguments);
+        std::string getRange(const CommandHandler::Arguments &arguments);
+        std::string setRange(const CommandHandler::Arguments &arguments);
+        std::string length(const CommandHandler::Arguments &arguments);
+
+        std::string getVersioned(const CommandHandler::Arguments &arguments);
+        std::string compareAndSet(const CommandHandler::Arguments &arguments);
+
+        /**
+         * Version of entry with @key, 0 if there is no such entry
+         */
+        Version versionOf(const Key &key);
+        /**
+         * Number of entries
+         */
+        size_t size();
+        /**
+         * Drop all entries.
+         * Entries are swapped out under lock, and freed after it released.
+         */
+        void flush();
+
+        /**
+         * Write all entries, caller must hold lock (see Snapshot)
+         */
+        void dump(SnapshotWriter &writer);
+        /**
+         * Insert decoded entries of dump(), existing entries are overwritten.
+         * Values are swapped out of @entries.
+         */
+        void restore(Entries &entries);
+        /**
+         * Apply modifications read from journal (see Journal::replay())
+         */
+        void replay(const std::vector<Journal::Record> &records);
+
+        /**
+         * Access to entries for TierCompactor, caller must hold lock.
+         * Iteration stops when @callback returns false.
+         */
+        void forEachEntry(const std::function<bool(const Key &key, Entry &entry)> &callback);
+        /**
+         * Return nullptr if there is no such entry
+         */
+        Entry *findEntry(const Key &key);
+
+        /**
+         * Non-atomic foreach() (see ChunkedForeach)
+         *
+         * Position is key of last processed node, since tree is ordered
+         * by it. Nodes that was added during the pass are processed only
+         * if they are after the position.
+         */
+        struct ForeachCursor
+        {
+            Key key;
+            bool started;
+            KeyFilter filter;
+        };
+        void foreachBegin(ForeachCursor &cursor, const KeyFilter &filter);
+        bool foreachChunk(const std::string &code, size_t threads,
+                          ForeachCursor &cursor, size_t limit);
 
+    private:
         class Node;
         typedef std::list<Node> Nodes;
         Nodes m_nodes;
@@ -53,28 +122,24 @@ namespace Db
             : public boost::intrusive::avl_set_member_hook< boost::intrusive::optimize_size<true> >
         {
         public:
-            struct Data
+            struct Data : public Entry
             {
-                size_t internalKey;
                 /**
                  * Position of element in m_nodes
                  * Need for erasing from list.
                  */
                 Nodes::iterator listIterator;
                 Key key;
-                Value value;
 
                 Data(Key key, Value value)
-                    : internalKey(m_keyHashFunction(key))
+                    : Entry(value)
                     , key(key)
-                    , value(value)
                 {}
                 /**
                  * Avoid extra std::string::string()
                  */
                 Data(Key key)
-                    : internalKey(m_keyHashFunction(key))
-                    , key(key)
+                    : key(key)
                 {}
             };
 
@@ -92,14 +157,17 @@ namespace Db
                 return m_data;
             }
 
+            /**
+             * Ordered by key, to support seeks (i.e. for filters of foreach())
+             */
             friend bool operator <(const Node &left, const Node &right)
             {
-                return (left.m_data.internalKey < right.m_data.internalKey);
+                return (left.m_data.key < right.m_data.key);
             }
 
             friend bool operator ==(const Node &left, const Node &right)
             {
-                return (left.m_data.internalKey == right.m_data.internalKey);
+                return (left.m_data.key == right.m_data.key);
             }
 
         private:
@@ -122,13 +190,29 @@ namespace Db
         };
         DeleteDisposer m_deleteDisposer;
 
+        /**
+         * For seeks by key, without creating Node
+         */
+        struct KeyCompare
+        {
+            bool operator() (const Key &left, const Node &right) const
+            {
+                return (left < right.get().key);
+            }
+            bool operator() (const Node &left, const Key &right) const
+            {
+                return (left.get().key < right);
+            }
+        };
+
         typedef boost::intrusive::member_hook< Node, boost::intrusive::avl_set_member_hook<>, &Node::member_hook > MemberHook;
         typedef boost::intrusive::avltree< Node, MemberHook > Tree;
         std::unique_ptr<Tree> m_tree;
 
         /**
-         * TODO: maybe move to ThreadSafe wrapper
+         * Must be called under exclusive lock.
+         * Entry is not stamped, caller must do this (see changed()).
          */
-        boost::shared_mutex m_access;
+        Node &insert(const Key &key, const Value &value);
     };
 }
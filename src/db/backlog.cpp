@@ -0,0 +1,73 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "backlog.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace Db
+{
+    Backlog::Backlog()
+        : m_end(0)
+        , m_used(0)
+    {
+    }
+
+    void Backlog::resize(size_t size)
+    {
+        m_buffer.assign(size, 0);
+        m_used = 0;
+    }
+
+    void Backlog::append(const char *data, size_t size)
+    {
+        const size_t capacity = m_buffer.size();
+        m_end += size;
+        if (!capacity) {
+            return;
+        }
+
+        // Only tail fits
+        if (size > capacity) {
+            data += (size - capacity);
+            size = capacity;
+        }
+
+        size_t position = ((m_end - size) % capacity);
+        size_t first = std::min(size, capacity - position);
+        memcpy(&m_buffer[position], data, first);
+        memcpy(&m_buffer[0], data + first, size - first);
+
+        m_used = std::min(capacity, m_used + size);
+    }
+
+    bool Backlog::read(uint64_t offset, std::string &data, size_t max) const
+    {
+        if ((offset < begin()) || (offset > m_end)) {
+            return false;
+        }
+
+        const size_t capacity = m_buffer.size();
+        size_t size = std::min<uint64_t>(max, m_end - offset);
+        data.resize(size);
+        if (!size) {
+            return true;
+        }
+
+        size_t position = (offset % capacity);
+        size_t first = std::min(size, capacity - position);
+        memcpy(&data[0], &m_buffer[position], first);
+        memcpy(&data[first], &m_buffer[0], size - first);
+        return true;
+    }
+}
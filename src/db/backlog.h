@@ -0,0 +1,76 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+
+namespace Db
+{
+    /**
+     * @brief Circular buffer of last bytes of stream (i.e. of Journal)
+     *
+     * Bytes are addressed by offset in the whole stream, so reader can
+     * continue from its offset while it is still in the buffer.
+     *
+     * Not thread-safe.
+     */
+    class Backlog : boost::noncopyable
+    {
+    public:
+        Backlog();
+
+        /**
+         * Drops all data
+         */
+        void resize(size_t size);
+        size_t size() const
+        {
+            return m_buffer.size();
+        }
+
+        void append(const char *data, size_t size);
+
+        /**
+         * Offset of first byte that is still in buffer
+         */
+        uint64_t begin() const
+        {
+            return (m_end - m_used);
+        }
+        /**
+         * Offset after last appended byte
+         */
+        uint64_t end() const
+        {
+            return m_end;
+        }
+
+        /**
+         * Copy up to @max bytes starting from @offset into @data.
+         * Return false if @offset is not in buffer (overwritten already,
+         * or not appended yet).
+         */
+        bool read(uint64_t offset, std::string &data, size_t max) const;
+
+    private:
+        std::vector<char> m_buffer;
+        uint64_t m_end;
+        /**
+         * Number of valid bytes in buffer
+         */
+        size_t m_used;
+    };
+}
@@ -0,0 +1,107 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include "kernel/commandhandler.h"
+#include "kernel/exception.h"
+#include "db/interface.h"
+#include "util/log.h"
+
+#include <boost/noncopyable.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+
+
+namespace Db
+{
+    /**
+     * @brief Non-atomic foreach() of engine
+     *
+     * Entries are processed by chunks, lock of engine is held only while
+     * one chunk is processed, and between chunks connection yields to its
+     * event loop (see CommandHandler::post()), so other commands are not
+     * blocked for the whole pass.
+     *
+     * Engine must provide:
+     * - ForeachCursor, position of the pass, that survives modifications
+     *   of engine between chunks
+     * - foreachBegin(cursor, filter)
+     * - foreachChunk(code, threads, cursor, limit), return false if there
+     *   is no more entries, throws Exception on script errors
+     *
+     * Reply is sent with CommandHandler::finish()
+     */
+    template <class Engine>
+    class ChunkedForeach
+        : public std::enable_shared_from_this< ChunkedForeach<Engine> >
+        , boost::noncopyable
+    {
+    public:
+        /**
+         * Return reply for command (i.e. REPLY_DEFERRED)
+         */
+        static std::string start(Engine &engine, const std::string &code,
+                                 const Interface::ForeachOptions &options,
+                                 CommandHandler &handler)
+        {
+            std::shared_ptr<ChunkedForeach> foreach(
+                new ChunkedForeach(engine, code, options, handler));
+
+            engine.foreachBegin(foreach->m_cursor, options.filter);
+            foreach->run();
+
+            return CommandHandler::REPLY_DEFERRED;
+        }
+
+    private:
+        Engine &m_engine;
+        /**
+         * Copy, since arguments of command are not available after
+         * command returned.
+         */
+        std::string m_code;
+        Interface::ForeachOptions m_options;
+        CommandHandler &m_handler;
+        typename Engine::ForeachCursor m_cursor;
+
+        ChunkedForeach(Engine &engine, const std::string &code,
+                       const Interface::ForeachOptions &options,
+                       CommandHandler &handler)
+            : m_engine(engine)
+            , m_code(code)
+            , m_options(options)
+            , m_handler(handler)
+        {}
+
+        void run()
+        {
+            bool more;
+
+            try {
+                more = m_engine.foreachChunk(m_code, m_options.threads,
+                                             m_cursor, m_options.chunkSize);
+            } catch (const Exception &e) {
+                LOG(error) << e.getMessage();
+                LOG(error) << "Will not continue";
+                m_handler.finish(CommandHandler::REPLY_ERROR);
+                return;
+            }
+
+            if (!more) {
+                m_handler.finish(CommandHandler::REPLY_TRUE);
+                return;
+            }
+            m_handler.post(std::bind(&ChunkedForeach::run, this->shared_from_this()));
+        }
+    };
+}
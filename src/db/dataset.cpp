@@ -0,0 +1,293 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "dataset.h"
+#include "util/log.h"
+
+#include <limits>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+namespace Db
+{
+    const char DatasetHeader::MAGIC[8] = { 'B', 'C', 'D', 'S', 'E', 'T', '0', '1' };
+
+    DatasetBuilder::DatasetBuilder()
+        : m_fd(-1)
+        , m_failed(false)
+        , m_offset(0)
+        , m_entries(0)
+    {
+        m_buffer.reserve(BUFFER_SIZE);
+    }
+
+    DatasetBuilder::~DatasetBuilder()
+    {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    bool DatasetBuilder::open(const std::string &path)
+    {
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0) {
+            LOG(error) << "Can't open " << path << ": " << strerror(errno);
+            return false;
+        }
+
+        // Header is rewritten by finish()
+        DatasetHeader header = DatasetHeader();
+        write(&header, sizeof(header));
+        return true;
+    }
+
+    bool DatasetBuilder::add(const std::string &key, const std::string &value)
+    {
+        if ((key.size() > std::numeric_limits<uint32_t>::max()) ||
+            (value.size() > std::numeric_limits<uint32_t>::max())) {
+            LOG(error) << "Key or value is too big";
+            return false;
+        }
+
+        Record record = { Dataset::hash(key.data(), key.size()), m_offset };
+        m_records.push_back(record);
+
+        uint32_t sizes[2] = { (uint32_t)key.size(), (uint32_t)value.size() };
+        write(sizes, sizeof(sizes));
+        write(key.data(), key.size());
+        write(value.data(), value.size());
+
+        return !m_failed;
+    }
+
+    bool DatasetBuilder::finish()
+    {
+        // Index is aligned, to read it from mapping directly
+        static const char padding[sizeof(uint64_t)] = {};
+        write(padding, (sizeof(uint64_t) - (m_offset % sizeof(uint64_t))) % sizeof(uint64_t));
+        if (!flush()) {
+            return false;
+        }
+
+        uint64_t buckets = 1;
+        while (buckets < (m_records.size() * 2)) {
+            buckets <<= 1;
+        }
+        const uint64_t mask = (buckets - 1);
+
+        std::vector<uint64_t> index(buckets, 0);
+        std::vector<uint64_t> hashes(buckets, 0);
+        std::string key, existing;
+        for (const Record &record : m_records) {
+            uint64_t bucket = (record.hash & mask);
+            for (; index[bucket]; bucket = ((bucket + 1) & mask)) {
+                if (hashes[bucket] != record.hash) {
+                    continue;
+                }
+                // Full compare only on collision of hashes
+                if (!readKey(record.offset, key) ||
+                    !readKey(index[bucket], existing)) {
+                    return false;
+                }
+                if (key == existing) {
+                    break;
+                }
+            }
+            if (!index[bucket]) {
+                ++m_entries;
+            }
+            index[bucket] = record.offset;
+            hashes[bucket] = record.hash;
+        }
+        std::vector<Record>().swap(m_records);
+
+        DatasetHeader header;
+        memcpy(header.magic, DatasetHeader::MAGIC, sizeof(header.magic));
+        header.entries = m_entries;
+        header.buckets = buckets;
+        header.indexOffset = m_offset;
+
+        write(index.data(), index.size() * sizeof(uint64_t));
+        if (!flush()) {
+            return false;
+        }
+        if ((pwrite(m_fd, &header, sizeof(header), 0) != sizeof(header)) ||
+            (fsync(m_fd) != 0)) {
+            LOG(error) << "Can't write dataset: " << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    void DatasetBuilder::write(const void *data, size_t size)
+    {
+        m_buffer.append((const char *)data, size);
+        m_offset += size;
+
+        if (m_buffer.size() >= BUFFER_SIZE) {
+            flush();
+        }
+    }
+
+    bool DatasetBuilder::flush()
+    {
+        const char *data = m_buffer.data();
+        size_t size = m_buffer.size();
+        while (!m_failed && size) {
+            ssize_t written = ::write(m_fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG(error) << "Can't write dataset: " << strerror(errno);
+                m_failed = true;
+                break;
+            }
+            data += written;
+            size -= written;
+        }
+        m_buffer.clear();
+
+        return !m_failed;
+    }
+
+    bool DatasetBuilder::readKey(uint64_t offset, std::string &key)
+    {
+        uint32_t sizes[2];
+        if (pread(m_fd, sizes, sizeof(sizes), offset) != sizeof(sizes)) {
+            LOG(error) << "Can't read dataset: " << strerror(errno);
+            return false;
+        }
+        key.resize(sizes[0]);
+        if (sizes[0] &&
+            (pread(m_fd, &key[0], sizes[0], offset + sizeof(sizes)) != (ssize_t)sizes[0])) {
+            LOG(error) << "Can't read dataset: " << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+
+    Dataset::Dataset()
+        : m_data(nullptr)
+        , m_size(0)
+        , m_header(nullptr)
+        , m_index(nullptr)
+    {
+    }
+
+    Dataset::~Dataset()
+    {
+        if (m_data) {
+            munmap((void *)m_data, m_size);
+        }
+    }
+
+    bool Dataset::open(const std::string &path)
+    {
+        m_path = path;
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            LOG(error) << "Can't open dataset " << path << ": " << strerror(errno);
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            LOG(error) << "Can't stat dataset " << path << ": " << strerror(errno);
+            close(fd);
+            return false;
+        }
+        if ((size_t)st.st_size < sizeof(DatasetHeader)) {
+            LOG(error) << "Dataset " << path << " is truncated";
+            close(fd);
+            return false;
+        }
+
+        m_size = st.st_size;
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            LOG(error) << "Can't map dataset " << path << ": " << strerror(errno);
+            return false;
+        }
+        m_data = (const char *)data;
+        // Lookups touch random pages, readahead is useless
+        madvise(data, m_size, MADV_RANDOM);
+
+        m_header = (const DatasetHeader *)m_data;
+        const uint64_t buckets = m_header->buckets;
+        if (memcmp(m_header->magic, DatasetHeader::MAGIC, sizeof(m_header->magic)) ||
+            !buckets || (buckets & (buckets - 1)) ||
+            (m_header->indexOffset % sizeof(uint64_t)) ||
+            (m_header->indexOffset > m_size) ||
+            (buckets > ((m_size - m_header->indexOffset) / sizeof(uint64_t)))) {
+            LOG(error) << "Dataset " << path << " is corrupted";
+            return false;
+        }
+        m_index = (const uint64_t *)(m_data + m_header->indexOffset);
+
+        LOG(info) << "Dataset " << path << " is mapped ("
+                  << m_header->entries << " entries)";
+        return true;
+    }
+
+    bool Dataset::find(const std::string &key, const char *&value, uint32_t &size) const
+    {
+        const uint64_t mask = (m_header->buckets - 1);
+        const uint64_t end = m_header->indexOffset;
+
+        uint64_t bucket = (hash(key.data(), key.size()) & mask);
+        // Index of corrupted file may have no empty bucket
+        for (uint64_t probes = 0; probes < m_header->buckets;
+             ++probes, bucket = ((bucket + 1) & mask)) {
+            const uint64_t offset = m_index[bucket];
+            if (!offset) {
+                return false;
+            }
+
+            uint32_t sizes[2];
+            if ((offset + sizeof(sizes)) > end) {
+                return false;
+            }
+            memcpy(sizes, m_data + offset, sizeof(sizes));
+            const char *record = (m_data + offset + sizeof(sizes));
+            if ((offset + sizeof(sizes) + sizes[0] + sizes[1]) > end) {
+                return false;
+            }
+
+            if ((sizes[0] == key.size()) && !memcmp(record, key.data(), sizes[0])) {
+                value = (record + sizes[0]);
+                size = sizes[1];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t Dataset::hash(const char *data, size_t size)
+    {
+        // FNV-1a, must be the same for builder and server
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= (unsigned char)data[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+}
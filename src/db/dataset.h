@@ -0,0 +1,132 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+namespace Db
+{
+    /**
+     * @brief Layout of prebuilt dataset file
+     *
+     * - header
+     * - records: <key size> <value size> <key> <value>, sizes are uint32
+     * - index: open addressing hashtable (linear probing) of uint64
+     *   offsets of records, 0 is empty bucket; number of buckets is power
+     *   of two
+     *
+     * All numbers are in host byte order, file is built on the same
+     * architecture where it is served.
+     */
+    struct DatasetHeader
+    {
+        static const char MAGIC[8];
+
+        char magic[8];
+        uint64_t entries;
+        uint64_t buckets;
+        uint64_t indexOffset;
+    };
+
+    /**
+     * @brief Builder of dataset file (see bc-dataset)
+     *
+     * Records are written as they are added, only hashes and offsets are
+     * kept in memory, until index is written by finish().
+     * If key is added twice, the last value wins.
+     */
+    class DatasetBuilder : boost::noncopyable
+    {
+    public:
+        DatasetBuilder();
+        ~DatasetBuilder();
+
+        bool open(const std::string &path);
+        bool add(const std::string &key, const std::string &value);
+        /**
+         * Write index and header.
+         * Return false on IO errors (including errors of previous writes).
+         */
+        bool finish();
+
+        uint64_t entries() const
+        {
+            return m_entries;
+        }
+
+    private:
+        enum Constants
+        {
+            BUFFER_SIZE = 1 << 20 /* 1MB */
+        };
+
+        struct Record
+        {
+            uint64_t hash;
+            uint64_t offset;
+        };
+
+        int m_fd;
+        bool m_failed;
+        uint64_t m_offset;
+        uint64_t m_entries;
+        std::string m_buffer;
+        std::vector<Record> m_records;
+
+        void write(const void *data, size_t size);
+        bool flush();
+        bool readKey(uint64_t offset, std::string &key);
+    };
+
+    /**
+     * @brief Immutable dataset, mmapped from file built by DatasetBuilder
+     *
+     * Nothing is loaded on open(), pages are read on demand and shared
+     * (through page cache) with other processes that map the same file.
+     * No locks are needed, since it is never modified.
+     */
+    class Dataset : boost::noncopyable
+    {
+    public:
+        Dataset();
+        ~Dataset();
+
+        bool open(const std::string &path);
+
+        const std::string &path() const
+        {
+            return m_path;
+        }
+        uint64_t entries() const
+        {
+            return m_header->entries;
+        }
+
+        /**
+         * @value points into mapping, and is valid while dataset exists
+         */
+        bool find(const std::string &key, const char *&value, uint32_t &size) const;
+
+        static uint64_t hash(const char *data, size_t size);
+
+    private:
+        std::string m_path;
+        const char *m_data;
+        size_t m_size;
+        const DatasetHeader *m_header;
+        const uint64_t *m_index;
+    };
+}
@@ -10,10 +10,13 @@
 
 
 #include "hashtable.h"
+#include "chunkedforeach.h"
 #include "server/jsvm.h"
 #include "kernel/exception.h"
 #include "util/log.h"
 
+#include <algorithm>
+
 
 namespace Db
 {
@@ -24,23 +27,30 @@ namespace Db
 
     std::string HashTable::get(const CommandHandler::Arguments &arguments)
     {
+        HotKeys::sample(this, arguments[1] /* key */);
+
         // get shared lock
-        boost::shared_lock<boost::shared_mutex> lock(m_access);
+        SharedLock lock(m_access);
 
         Table::const_iterator value = m_table.find(arguments[1]);
         if (value == m_table.end()) {
             return CommandHandler::REPLY_NIL;
         }
-        return CommandHandler::toReplyString(value->second);
+        Value buffer;
+        return CommandHandler::toReplyString(read(value->second, buffer));
     }
 
     std::string HashTable::set(const CommandHandler::Arguments &arguments)
     {
+        HotKeys::sample(this, arguments[1] /* key */);
+
         // get exclusive lock
-        boost::upgrade_lock<boost::shared_mutex> lock(m_access);
-        boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
+        ExclusiveLock lock(m_access);
 
-        m_table[arguments[1] /* key */] = arguments[2] /* value */;
+        Entry &entry = m_table[arguments[1] /* key */];
+        release(entry);
+        entry.value = arguments[2] /* value */;
+        changed(arguments[1] /* key */, entry);
 
         return CommandHandler::REPLY_OK;
     }
@@ -48,43 +58,400 @@ namespace Db
     std::string HashTable::del(const CommandHandler::Arguments &arguments)
     {
         // get exclusive lock
-        boost::upgrade_lock<boost::shared_mutex> lock(m_access);
-        boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
+        ExclusiveLock lock(m_access);
 
-        Table::const_iterator value = m_table.find(arguments[1]);
+        Table::iterator value = m_table.find(arguments[1]);
         if (value == m_table.end()) {
             return CommandHandler::REPLY_FALSE;
         }
 
+        release(value->second);
         m_table.erase(value);
+        deleted(arguments[1] /* key */);
         return CommandHandler::REPLY_TRUE;
     }
 
-    std::string HashTable::foreach(const CommandHandler::Arguments &arguments)
+    std::string HashTable::foreach(const CommandHandler::Arguments &arguments,
+                                   CommandHandler &handler)
+    {
+        ForeachOptions options;
+        if (!parseForeachOptions(arguments, options)) {
+            return REPLY_ERROR_SYNTAX;
+        }
+        // Inside MULTI/EXEC lock is held for the whole batch anyway
+        if (!options.atomic && !BatchLock::owns(m_access)) {
+            return ChunkedForeach<HashTable>::start(*this, arguments[1] /* script */,
+                                                    options, handler);
+        }
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Batch batch;
+        batch.reserve(m_table.size());
+        for (std::pair<const Key, Entry> &i : m_table) {
+            if (!options.filter.matches(i.first)) {
+                continue;
+            }
+            batch.push_back(std::make_pair(&i.first, &i.second));
+        }
+
+        try {
+            apply(arguments[1] /* script */, batch, options.threads);
+        } catch (const Exception &e) {
+            LOG(error) << e.getMessage();
+            LOG(error) << "Will not continue";
+            return CommandHandler::REPLY_ERROR;
+        }
+
+        return CommandHandler::REPLY_TRUE;
+    }
+
+    std::string HashTable::reduce(const CommandHandler::Arguments &arguments)
+    {
+        if ((arguments.size() < 2 /* script */) || (arguments.size() > 3)) {
+            return REPLY_ERROR_SYNTAX;
+        }
+
+        JsVm vm(arguments[1] /* script */);
+        if (!vm.init() ||
+            !vm.setAccumulator((arguments.size() == 3) ? arguments[2] : std::string())) {
+            return CommandHandler::REPLY_ERROR;
+        }
+
+        // get shared lock
+        SharedLock lock(m_access);
+
+        try {
+            Value buffer;
+            for (const std::pair<const Key, Entry> &i : m_table) {
+                vm.reduce(i.first, read(i.second, buffer));
+            }
+        } catch (const Exception &e) {
+            LOG(error) << e.getMessage();
+            LOG(error) << "Will not continue";
+            return CommandHandler::REPLY_ERROR;
+        }
+
+        return vm.accumulatorReply();
+    }
+
+    std::string HashTable::eval(const std::string &code,
+                                const std::vector<Key> &keys,
+                                const std::vector<std::string> &args)
     {
-        JsVm vm(arguments[1]);
+        JsVm vm(code);
         if (!vm.init()) {
             return CommandHandler::REPLY_ERROR;
         }
 
         // get exclusive lock
-        boost::upgrade_lock<boost::shared_mutex> lock(m_access);
-        // XXX: support non-atomic mode
-        boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
-
-        for (std::pair<const Key, Value> &i : m_table) {
-            std::string key(i.first);
-            std::string &value = i.second;
-
-            try {
-                value = vm.call(key, value);
-            } catch (const Exception &e) {
-                LOG(error) << e.getMessage();
-                LOG(error) << "Will not continue";
-                return CommandHandler::REPLY_ERROR;
+        ExclusiveLock lock(m_access);
+
+        JsVm::Writes writes;
+        std::string reply;
+        try {
+            std::vector<const Value *> values;
+            values.reserve(keys.size());
+            for (const Key &key : keys) {
+                Table::iterator found = m_table.find(key);
+                values.push_back((found != m_table.end()) ? &load(found->second) : nullptr);
             }
+
+            reply = vm.eval(keys, values, args, writes);
+        } catch (const Exception &e) {
+            LOG(error) << e.getMessage();
+            return CommandHandler::REPLY_ERROR;
         }
 
-        return CommandHandler::REPLY_TRUE;
+        for (JsVm::Write &write : writes) {
+            const Key &key = keys[write.index];
+            if (write.deleted) {
+                Table::iterator found = m_table.find(key);
+                if (found != m_table.end()) {
+                    release(found->second);
+                    m_table.erase(found);
+                    deleted(key);
+                }
+                continue;
+            }
+            Entry &entry = m_table[key];
+            release(entry);
+            entry.value.swap(write.value);
+            changed(key, entry);
+        }
+
+        return reply;
+    }
+
+    void HashTable::foreachBegin(ForeachCursor &cursor, const KeyFilter &filter)
+    {
+        cursor.position = 0;
+
+        // get shared lock
+        SharedLock lock(m_access);
+
+        cursor.keys.reserve(m_table.size());
+        for (const std::pair<const Key, Entry> &i : m_table) {
+            if (!filter.matches(i.first)) {
+                continue;
+            }
+            cursor.keys.push_back(i.first);
+        }
+    }
+
+    bool HashTable::foreachChunk(const std::string &code, size_t threads,
+                                 ForeachCursor &cursor, size_t limit)
+    {
+        const size_t end = std::min(cursor.position + limit, cursor.keys.size());
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Batch batch;
+        batch.reserve(end - cursor.position);
+        for (; cursor.position < end; ++cursor.position) {
+            Table::iterator found = m_table.find(cursor.keys[cursor.position]);
+            if (found == m_table.end()) {
+                continue;
+            }
+            batch.push_back(std::make_pair(&found->first, &found->second));
+        }
+        apply(code, batch, threads);
+
+        return (cursor.position < cursor.keys.size());
+    }
+
+    std::string HashTable::append(const CommandHandler::Arguments &arguments)
+    {
+        const Value &tail = arguments[2];
+        // Reject too big tail before taking the lock
+        if (tail.size() > MAX_VALUE_SIZE) {
+            return REPLY_ERROR_VALUE_TOO_BIG;
+        }
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Entry &entry = m_table[arguments[1] /* key */];
+        if ((entry.size() + tail.size()) > MAX_VALUE_SIZE) {
+            return REPLY_ERROR_VALUE_TOO_BIG;
+        }
+        appendTail(load(entry), tail);
+        changed(arguments[1] /* key */, entry);
+
+        return CommandHandler::toIntegerReplyString(entry.value.size());
+    }
+
+    std::string HashTable::getRange(const CommandHandler::Arguments &arguments)
+    {
+        long long start, end;
+        if (!CommandHandler::toInteger(arguments[2], start) ||
+            !CommandHandler::toInteger(arguments[3], end)) {
+            return REPLY_ERROR_NOT_INTEGER;
+        }
+
+        // get shared lock
+        SharedLock lock(m_access);
+
+        Table::const_iterator value = m_table.find(arguments[1]);
+        if (value == m_table.end()) {
+            return CommandHandler::toReplyString(std::string());
+        }
+        Value buffer;
+        return rangeReply(read(value->second, buffer), start, end);
+    }
+
+    std::string HashTable::setRange(const CommandHandler::Arguments &arguments)
+    {
+        long long offset;
+        if (!CommandHandler::toInteger(arguments[2], offset) || (offset < 0)) {
+            return REPLY_ERROR_NOT_INTEGER;
+        }
+        const Value &chunk = arguments[3];
+        if ((offset + chunk.size()) > MAX_VALUE_SIZE) {
+            return REPLY_ERROR_VALUE_TOO_BIG;
+        }
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Table::iterator value = m_table.find(arguments[1]);
+        if (value == m_table.end()) {
+            // Do not create empty key, like redis does
+            if (chunk.empty()) {
+                return CommandHandler::toIntegerReplyString(0);
+            }
+            value = m_table.insert(std::make_pair(arguments[1] /* key */, Entry())).first;
+        }
+        writeRange(load(value->second), offset, chunk);
+        changed(value->first, value->second);
+
+        return CommandHandler::toIntegerReplyString(value->second.value.size());
+    }
+
+    std::string HashTable::length(const CommandHandler::Arguments &arguments)
+    {
+        // get shared lock
+        SharedLock lock(m_access);
+
+        Table::const_iterator value = m_table.find(arguments[1]);
+        if (value == m_table.end()) {
+            return CommandHandler::toIntegerReplyString(0);
+        }
+        return CommandHandler::toIntegerReplyString(value->second.size());
+    }
+
+    std::string HashTable::getVersioned(const CommandHandler::Arguments &arguments)
+    {
+        // get shared lock
+        SharedLock lock(m_access);
+
+        Table::const_iterator value = m_table.find(arguments[1]);
+        if (value == m_table.end()) {
+            return CommandHandler::REPLY_NIL;
+        }
+        Value buffer;
+        return versionedReply(value->second, read(value->second, buffer));
+    }
+
+    std::string HashTable::compareAndSet(const CommandHandler::Arguments &arguments)
+    {
+        long long version;
+        if (!CommandHandler::toInteger(arguments[2], version) || (version < 0)) {
+            return REPLY_ERROR_NOT_INTEGER;
+        }
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        Table::iterator value = m_table.find(arguments[1]);
+        if (value == m_table.end()) {
+            if (version) {
+                return CommandHandler::REPLY_FALSE;
+            }
+            value = m_table.insert(std::make_pair(arguments[1] /* key */, Entry())).first;
+        } else if (value->second.version != (Version)version) {
+            return CommandHandler::REPLY_FALSE;
+        }
+
+        Entry &entry = value->second;
+        release(entry);
+        entry.value = arguments[3] /* value */;
+        changed(value->first, entry);
+
+        return CommandHandler::toIntegerReplyString(entry.version);
+    }
+
+    HashTable::Version HashTable::versionOf(const Key &key)
+    {
+        // get shared lock
+        SharedLock lock(m_access);
+
+        Table::const_iterator value = m_table.find(key);
+        if (value == m_table.end()) {
+            return 0;
+        }
+        return value->second.version;
+    }
+
+    size_t HashTable::size()
+    {
+        // get shared lock
+        SharedLock lock(m_access);
+
+        return m_table.size();
+    }
+
+    void HashTable::flush()
+    {
+        Table table;
+
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        m_table.swap(table);
+        m_tier.releaseAll();
+        flushed();
+    }
+
+    void HashTable::dump(SnapshotWriter &writer)
+    {
+        writer.writeLength(m_table.size());
+        Value buffer;
+        for (const std::pair<const Key, Entry> &i : m_table) {
+            writer.writeEntry(i.first, read(i.second, buffer));
+        }
+    }
+
+    void HashTable::restore(Entries &entries)
+    {
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        for (Entries::value_type &i : entries) {
+            Entry &entry = m_table[std::move(i.first)];
+            release(entry);
+            entry.value.swap(i.second);
+            stamp(entry);
+        }
+    }
+
+    void HashTable::reserve(size_t count)
+    {
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        m_table.reserve(m_table.size() + count);
+    }
+
+    void HashTable::replay(const std::vector<Journal::Record> &records)
+    {
+        // get exclusive lock
+        ExclusiveLock lock(m_access);
+
+        for (const Journal::Record &record : records) {
+            switch (record.type) {
+                case 'S':
+                {
+                    Entry &entry = m_table[Key(record.key, record.keySize)];
+                    release(entry);
+                    entry.value.assign(record.value, record.valueSize);
+                    stamp(entry);
+                    break;
+                }
+                case 'D':
+                {
+                    Table::iterator found = m_table.find(Key(record.key, record.keySize));
+                    if (found != m_table.end()) {
+                        release(found->second);
+                        m_table.erase(found);
+                    }
+                    break;
+                }
+                case 'F':
+                    m_table.clear();
+                    m_tier.releaseAll();
+                    break;
+            }
+        }
+    }
+
+    void HashTable::forEachEntry(const std::function<bool(const Key &key, Entry &entry)> &callback)
+    {
+        for (std::pair<const Key, Entry> &i : m_table) {
+            if (!callback(i.first, i.second)) {
+                return;
+            }
+        }
+    }
+
+    HashTable::Entry *HashTable::findEntry(const Key &key)
+    {
+        Table::iterator found = m_table.find(key);
+        if (found == m_table.end()) {
+            return nullptr;
+        }
+        return &found->second;
     }
 }
@@ -12,9 +12,11 @@
 #pragma once
 
 #include "db/interface.h"
+#include "db/snapshot.h"
 
-#include <boost/thread/pthread/shared_mutex.hpp>
 #include <unordered_map>
+#include <vector>
+#include <functional>
 #include <string>
 
 
@@ -33,15 +35,83 @@ namespace Db
         std::string get(const CommandHandler::Arguments &arguments);
         std::string set(const CommandHandler::Arguments &arguments);
         std::string del(const CommandHandler::Arguments &arguments);
-        std::string foreach(const CommandHandler::Arguments &arguments);
+        std::string foreach(const CommandHandler::Arguments &arguments,
+                            CommandHandler &handler);
+        std::string reduce(const CommandHandler::Arguments &arguments);
+        std::string eval(const std::string &code,
+                         const std::vector<Key> &keys,
+                         const std::vector<std::string> &args);
 
-    private:
-        typedef std::unordered_map<Key, Value> Table;
-        Table m_table;
+        std::string append(const CommandHandler::Arguments &arguments);
+        std::string getRange(const CommandHandler::Arguments &arguments);
+        std::string setRange(const CommandHandler::Arguments &arguments);
+        std::string length(const CommandHandler::Arguments &arguments);
+
+        std::string getVersioned(const CommandHandler::Arguments &arguments);
+        std::string compareAndSet(const CommandHandler::Arguments &arguments);
+
+        /**
+         * Version of entry with @key, 0 if there is no such entry
+         */
+        Version versionOf(const Key &key);
+        /**
+         * Number of entries
+         */
+        size_t size();
+        /**
+         * Drop all entries.
+         * Entries are swapped out under lock, and freed after it released.
+         */
+        void flush();
 
         /**
-         * TODO: maybe move to ThreadSafe wrapper
+         * Write all entries, caller must hold lock (see Snapshot)
+         */
+        void dump(SnapshotWriter &writer);
+        /**
+         * Insert decoded entries of dump(), existing entries are overwritten.
+         * Values are swapped out of @entries.
+         */
+        void restore(Entries &entries);
+        /**
+         * Reserve buckets for @count entries (i.e. before restore())
          */
-        boost::shared_mutex m_access;
+        void reserve(size_t count);
+        /**
+         * Apply modifications read from journal (see Journal::replay())
+         */
+        void replay(const std::vector<Journal::Record> &records);
+
+        /**
+         * Access to entries for TierCompactor, caller must hold lock.
+         * Iteration stops when @callback returns false.
+         */
+        void forEachEntry(const std::function<bool(const Key &key, Entry &entry)> &callback);
+        /**
+         * Return nullptr if there is no such entry
+         */
+        Entry *findEntry(const Key &key);
+
+        /**
+         * Non-atomic foreach() (see ChunkedForeach)
+         *
+         * Position is a snapshot of keys, since table can be rehashed
+         * between chunks (and iterators/buckets became invalid).
+         * Keys that was deleted during the pass are skipped, and keys
+         * that was added are not processed.
+         * Filter is applied to the snapshot.
+         */
+        struct ForeachCursor
+        {
+            std::vector<Key> keys;
+            size_t position;
+        };
+        void foreachBegin(ForeachCursor &cursor, const KeyFilter &filter);
+        bool foreachChunk(const std::string &code, size_t threads,
+                          ForeachCursor &cursor, size_t limit);
+
+    private:
+        typedef std::unordered_map<Key, Entry> Table;
+        Table m_table;
     };
 }
@@ -0,0 +1,178 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "hotkeys.h"
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <cstring>
+
+
+namespace Db
+{
+    uint32_t HotKeys::s_sampleRate = 0;
+    thread_local int32_t HotKeys::s_countdown = 0;
+    thread_local HotKeys::Shard *HotKeys::s_shard = nullptr;
+    thread_local uint64_t HotKeys::s_random = 0;
+    std::vector< std::unique_ptr<HotKeys::Shard> > HotKeys::s_shards;
+    std::mutex HotKeys::s_shardsMutex;
+
+    namespace
+    {
+        bool hotter(const HotKeys::Item &a, const HotKeys::Item &b)
+        {
+            return a.count > b.count;
+        }
+
+        uint64_t mix(uint64_t value)
+        {
+            value ^= (value >> 33);
+            value *= 0xff51afd7ed558ccdULL;
+            value ^= (value >> 33);
+            return value;
+        }
+    }
+
+    void HotKeys::configure(uint32_t sampleRate)
+    {
+        s_sampleRate = sampleRate;
+    }
+
+    std::vector<HotKeys::Item> HotKeys::top(const std::vector<const void *> &engines,
+                                            size_t count)
+    {
+        // The same key can be in tops of different threads
+        std::map<std::pair<const void *, std::string>, uint64_t> merged;
+        {
+            std::lock_guard<std::mutex> lock(s_shardsMutex);
+
+            for (const std::unique_ptr<Shard> &shard : s_shards) {
+                std::lock_guard<std::mutex> shardLock(shard->mutex);
+                for (const Item &item : shard->top) {
+                    // Cooled down to nothing (see age())
+                    if (!item.count ||
+                        (std::find(engines.begin(), engines.end(), item.engine) == engines.end())) {
+                        continue;
+                    }
+                    merged[std::make_pair(item.engine, item.key)] += item.count;
+                }
+            }
+        }
+
+        std::vector<Item> items;
+        items.reserve(merged.size());
+        for (const auto &keyCount : merged) {
+            items.push_back(Item{ keyCount.first.first, keyCount.first.second,
+                                  keyCount.second * s_sampleRate });
+        }
+        std::sort(items.begin(), items.end(), hotter);
+        if (items.size() > count) {
+            items.resize(count);
+        }
+        return items;
+    }
+
+    void HotKeys::reset()
+    {
+        std::lock_guard<std::mutex> lock(s_shardsMutex);
+
+        for (const std::unique_ptr<Shard> &shard : s_shards) {
+            std::lock_guard<std::mutex> shardLock(shard->mutex);
+            memset(shard->sketch, 0, sizeof(shard->sketch));
+            shard->top.clear();
+            shard->samples = 0;
+        }
+    }
+
+    void HotKeys::record(const void *engine, const std::string &key)
+    {
+        Shard &shard = HotKeys::shard();
+
+        // Random distance to the next sample (xorshift), so periodic
+        // patterns of accesses are not aliased with the rate
+        s_random ^= (s_random << 13);
+        s_random ^= (s_random >> 7);
+        s_random ^= (s_random << 17);
+        s_countdown = (1 + (s_random % (2 * (uint64_t)s_sampleRate - 1)));
+
+        const uint64_t hash = (std::hash<std::string>()(key) ^ mix((uintptr_t)engine));
+        const uint64_t step = (mix(hash) | 1);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        // Conservative update: only the smallest counters are incremented
+        uint32_t *counters[SKETCH_DEPTH];
+        uint32_t estimation = UINT32_MAX;
+        for (size_t row = 0; row < SKETCH_DEPTH; ++row) {
+            counters[row] = &shard.sketch[row][(hash + row * step) % SKETCH_WIDTH];
+            estimation = std::min(estimation, *counters[row]);
+        }
+        ++estimation;
+        for (uint32_t *counter : counters) {
+            *counter = std::max(*counter, estimation);
+        }
+
+        std::vector<Item> &top = shard.top;
+        std::vector<Item>::iterator found = std::find_if(top.begin(), top.end(),
+            [engine, &key] (const Item &item)
+        {
+            return (item.engine == engine) && (item.key == key);
+        });
+        if (found != top.end()) {
+            found->count = estimation;
+            std::make_heap(top.begin(), top.end(), hotter);
+        } else if (top.size() < TOP_SIZE) {
+            top.push_back(Item{ engine, key, estimation });
+            std::push_heap(top.begin(), top.end(), hotter);
+        } else if (top.front().count < estimation) {
+            std::pop_heap(top.begin(), top.end(), hotter);
+            top.back() = Item{ engine, key, estimation };
+            std::push_heap(top.begin(), top.end(), hotter);
+        }
+
+        if (++shard.samples >= AGING_SAMPLES) {
+            age(shard);
+        }
+    }
+
+    HotKeys::Shard &HotKeys::shard()
+    {
+        if (s_shard) {
+            return *s_shard;
+        }
+
+        std::unique_ptr<Shard> shard(new Shard);
+        memset(shard->sketch, 0, sizeof(shard->sketch));
+        shard->top.reserve(TOP_SIZE);
+        shard->samples = 0;
+        s_random = (mix((uintptr_t)shard.get()) | 1);
+
+        // Shards are never freed, so tops of exited threads are kept
+        std::lock_guard<std::mutex> lock(s_shardsMutex);
+        s_shard = shard.get();
+        s_shards.push_back(std::move(shard));
+        return *s_shard;
+    }
+
+    void HotKeys::age(Shard &shard)
+    {
+        for (uint32_t (&row)[SKETCH_WIDTH] : shard.sketch) {
+            for (uint32_t &counter : row) {
+                counter /= 2;
+            }
+        }
+        for (Item &item : shard.top) {
+            item.count /= 2;
+        }
+        shard.samples = 0;
+    }
+}
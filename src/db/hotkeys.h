@@ -0,0 +1,120 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+
+namespace Db
+{
+    /**
+     * @brief Detection of hot keys (HOTKEYS)
+     *
+     * Every @sampleRate'th access of get()/set() of engines is sampled into
+     * count-min sketch of thread (i.e. worker), keys with the biggest
+     * estimations are kept in small top of thread, tops are merged only by
+     * HOTKEYS. Counters are halved periodically, so old keys cool down.
+     *
+     * Sampling is disabled by default, sample() is only a branch then.
+     *
+     * Engine is passed as opaque pointer (see Interface), to distinguish
+     * the same key of different engines/key-spaces.
+     */
+    class HotKeys : boost::noncopyable
+    {
+    public:
+        struct Item
+        {
+            const void *engine;
+            std::string key;
+            /**
+             * Estimated number of accesses (sampled multiplied by rate)
+             */
+            uint64_t count;
+        };
+
+        /**
+         * Must be called before any engine is used, 0 disables sampling
+         */
+        static void configure(uint32_t sampleRate);
+        static bool enabled()
+        {
+            return s_sampleRate;
+        }
+        static uint32_t sampleRate()
+        {
+            return s_sampleRate;
+        }
+
+        static void sample(const void *engine, const std::string &key)
+        {
+            if (__builtin_expect(!s_sampleRate, 1) || (--s_countdown > 0)) {
+                return;
+            }
+            record(engine, key);
+        }
+
+        /**
+         * Hottest @count keys of @engines, hottest first
+         */
+        static std::vector<Item> top(const std::vector<const void *> &engines, size_t count);
+        static void reset();
+
+    private:
+        enum Constants
+        {
+            SKETCH_DEPTH = 4,
+            SKETCH_WIDTH = 1024,
+            /**
+             * Size of top of every thread, merged top is not bigger
+             * than number of threads multiplied by this
+             */
+            TOP_SIZE = 32,
+            /**
+             * Counters are halved after this number of samples of thread
+             */
+            AGING_SAMPLES = 1 << 16
+        };
+
+        struct Shard
+        {
+            /**
+             * Taken by owner thread (only for sampled accesses) and by
+             * readers, so it is not contended
+             */
+            std::mutex mutex;
+            uint32_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+            /**
+             * Min-heap by count, count is not multiplied by rate here
+             */
+            std::vector<Item> top;
+            uint32_t samples;
+        };
+
+        static uint32_t s_sampleRate;
+        static thread_local int32_t s_countdown;
+        static thread_local Shard *s_shard;
+        static thread_local uint64_t s_random;
+
+        static std::vector< std::unique_ptr<Shard> > s_shards;
+        static std::mutex s_shardsMutex;
+
+        static void record(const void *engine, const std::string &key);
+        static Shard &shard();
+        static void age(Shard &shard);
+    };
+}
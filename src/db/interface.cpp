@@ -10,12 +10,24 @@
 
 
 #include "interface.h"
+#include "server/jsvm.h"
+#include "server/jsworkers.h"
+#include "kernel/exception.h"
 #include "util/compiler.h"
 
+#include <algorithm>
+#include <fnmatch.h>
+
 
 namespace Db
 {
+    const char *Interface::REPLY_ERROR_NOT_INTEGER   = "-ERR value is not an integer or out of range\r\n";
+    const char *Interface::REPLY_ERROR_VALUE_TOO_BIG = "-ERR value is too big\r\n";
+    const char *Interface::REPLY_ERROR_SYNTAX        = "-ERR syntax error\r\n";
+
     Interface::Interface()
+        : m_journal(nullptr)
+        , m_lastVersion(0)
     {
     }
 
@@ -37,8 +49,276 @@ namespace Db
         return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
     }
 
-    std::string Interface::foreach(const CommandHandler::Arguments &UNUSED(arguments))
+    std::string Interface::foreach(const CommandHandler::Arguments &UNUSED(arguments),
+                                   CommandHandler &UNUSED(handler))
+    {
+        return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
+    }
+
+    std::string Interface::reduce(const CommandHandler::Arguments &UNUSED(arguments))
+    {
+        return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
+    }
+
+    std::string Interface::eval(const std::string &UNUSED(code),
+                                const std::vector<Key> &UNUSED(keys),
+                                const std::vector<std::string> &UNUSED(args))
+    {
+        return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
+    }
+
+    std::string Interface::append(const CommandHandler::Arguments &UNUSED(arguments))
+    {
+        return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
+    }
+
+    std::string Interface::getRange(const CommandHandler::Arguments &UNUSED(arguments))
+    {
+        return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
+    }
+
+    std::string Interface::setRange(const CommandHandler::Arguments &UNUSED(arguments))
     {
         return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
     }
+
+    std::string Interface::length(const CommandHandler::Arguments &UNUSED(arguments))
+    {
+        return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
+    }
+
+    std::string Interface::getVersioned(const CommandHandler::Arguments &UNUSED(arguments))
+    {
+        return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
+    }
+
+    std::string Interface::compareAndSet(const CommandHandler::Arguments &UNUSED(arguments))
+    {
+        return CommandHandler::REPLY_ERROR_NOTSUPPORTED;
+    }
+
+    bool Interface::KeyFilter::matches(const Key &key) const
+    {
+        if (key.compare(0, prefix.size(), prefix) != 0) {
+            return false;
+        }
+        if (hasRange && ((key < min) || (key > max))) {
+            return false;
+        }
+        if (!pattern.empty() && (fnmatch(pattern.c_str(), key.c_str(), 0) != 0)) {
+            return false;
+        }
+        return true;
+    }
+
+    const Interface::Key &Interface::KeyFilter::lowerBound() const
+    {
+        if (hasRange && (min > prefix)) {
+            return min;
+        }
+        return prefix;
+    }
+
+    bool Interface::KeyFilter::isAfter(const Key &key) const
+    {
+        if (key.compare(0, prefix.size(), prefix) > 0) {
+            return true;
+        }
+        return (hasRange && (key > max));
+    }
+
+    bool Interface::parseForeachOptions(const CommandHandler::Arguments &arguments,
+                                        ForeachOptions &options)
+    {
+        if (arguments.size() < 2 /* script */) {
+            return false;
+        }
+
+        for (size_t i = 2; i < arguments.size(); ++i) {
+            const std::string &option = arguments[i];
+            const size_t left = arguments.size() - i - 1;
+
+            if (option == "ATOMIC") {
+                options.atomic = true;
+                continue;
+            }
+            if ((option == "PREFIX") && left) {
+                options.filter.prefix = arguments[++i];
+                continue;
+            }
+            if ((option == "MATCH") && left) {
+                options.filter.pattern = arguments[++i];
+                continue;
+            }
+            if ((option == "RANGE") && (left >= 2)) {
+                options.filter.hasRange = true;
+                options.filter.min = arguments[++i];
+                options.filter.max = arguments[++i];
+                continue;
+            }
+
+            long long number;
+            if (!left ||
+                !CommandHandler::toInteger(arguments[++i], number) ||
+                (number <= 0)) {
+                return false;
+            }
+
+            if (option == "CHUNK") {
+                options.chunkSize = number;
+            } else if (option == "THREADS") {
+                options.threads = number;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Interface::apply(const std::string &code, const Batch &batch, size_t threads)
+    {
+        JsWorkers &workers = TheJsWorkers::instance();
+        threads = std::min(threads, workers.size() + 1 /* current thread */);
+        threads = std::min(threads, batch.size() / MIN_FOREACH_ENTRIES_PER_THREAD);
+        threads = std::max(threads, (size_t)1);
+
+        std::atomic<bool> stop(false);
+        std::vector<std::string> errors(threads);
+        std::vector<JsWorkers::Task> tasks;
+        tasks.reserve(threads);
+
+        const size_t perThread = (batch.size() + threads - 1) / threads;
+        for (size_t i = 0; i < threads; ++i) {
+            const size_t begin = std::min(i * perThread, batch.size());
+            const size_t end = std::min(begin + perThread, batch.size());
+            std::string &error = errors[i];
+
+            tasks.push_back([this, &code, &batch, begin, end, &stop, &error] ()
+            {
+                try {
+                    JsVm vm(code);
+                    if (!vm.init()) {
+                        throw Exception("Can't compile script");
+                    }
+                    for (size_t j = begin; (j < end) && !stop; ++j) {
+                        apply(vm, *batch[j].first, *batch[j].second);
+                    }
+                } catch (const Exception &e) {
+                    error = e.getMessage();
+                    stop = true;
+                }
+            });
+        }
+
+        workers.run(tasks);
+
+        if (!stop) {
+            return;
+        }
+        std::string message;
+        for (const std::string &error : errors) {
+            if (error.empty()) {
+                continue;
+            }
+            if (!message.empty()) {
+                message += "; ";
+            }
+            message += error;
+        }
+        throw Exception(message);
+    }
+
+    void Interface::apply(JsVm &vm, const Key &key, Entry &entry)
+    {
+        if (!entry.spilled()) {
+            if (vm.call(key, entry.value)) {
+                changed(key, entry);
+            }
+            return;
+        }
+
+        // Spilled value stays spilled, if script did not change it
+        Value value;
+        read(entry, value);
+        if (vm.call(key, value)) {
+            release(entry);
+            entry.value.swap(value);
+            changed(key, entry);
+        }
+    }
+
+    void Interface::appendTail(Value &value, const Value &tail)
+    {
+        grow(value, value.size() + tail.size());
+        value.append(tail);
+    }
+
+    void Interface::writeRange(Value &value, size_t offset, const Value &chunk)
+    {
+        const size_t size = offset + chunk.size();
+        if (size > value.size()) {
+            grow(value, size);
+            // Padding with zero-bytes, like redis does
+            value.resize(size, '\0');
+        }
+        value.replace(offset, chunk.size(), chunk);
+    }
+
+    std::string Interface::rangeReply(const Value &value, long long start, long long end)
+    {
+        const long long size = value.size();
+
+        if (start < 0) {
+            start = std::max(size + start, 0LL);
+        }
+        if (end < 0) {
+            end = size + end;
+        }
+        end = std::min(end, size - 1);
+
+        if (start > end || !size) {
+            return CommandHandler::toReplyString(std::string());
+        }
+        return CommandHandler::toReplyString(value.substr(start, end - start + 1));
+    }
+
+    std::string Interface::versionedReply(const Entry &entry, const Value &value)
+    {
+        return CommandHandler::toMultiBulkReplyString({
+            CommandHandler::toIntegerReplyString(entry.version),
+            CommandHandler::toReplyString(value)
+        });
+    }
+
+    const Interface::Value &Interface::read(const Entry &entry, Value &buffer) const
+    {
+        touch(entry);
+        if (!entry.spilled()) {
+            return entry.value;
+        }
+        if (!m_tier.read(entry.spilledOffset, entry.spilledSize, buffer)) {
+            throw Exception("can't read spilled value");
+        }
+        return buffer;
+    }
+
+    Interface::Value &Interface::load(Entry &entry)
+    {
+        if (entry.spilled()) {
+            // Entry stays spilled, if value can't be read
+            Value value;
+            read(entry, value);
+            release(entry);
+            entry.value.swap(value);
+        }
+        return entry.value;
+    }
+
+    void Interface::grow(Value &value, size_t size)
+    {
+        if (size <= value.capacity()) {
+            return;
+        }
+        value.reserve(std::max(size, value.capacity() * 2));
+    }
 }
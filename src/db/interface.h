@@ -12,10 +12,19 @@
 #pragma once
 
 #include "kernel/commandhandler.h" // CommandHandler::Arguments
+#include "db/lock.h"
+#include "db/journal.h"
+#include "db/tier.h"
+#include "db/hotkeys.h"
 
 #include <boost/noncopyable.hpp>
 #include <string>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <cstdint>
 
+class JsVm;
 
 namespace Db
 {
@@ -38,9 +47,116 @@ namespace Db
     public:
         typedef std::string Key;
         typedef std::string Value;
+        /**
+         * Version stamp of entry, changed on every modification of entry.
+         * Zero means that there is no such entry.
+         */
+        typedef uint64_t Version;
+        /**
+         * Decoded entries (i.e. of snapshot)
+         */
+        typedef std::vector< std::pair<Key, Value> > Entries;
+        /**
+         * Value with metadata, the same for all engines
+         */
+        struct Entry
+        {
+            Value value;
+            Version version;
+            /**
+             * Value is spilled to extent file (see Tier) if @spilledSize is
+             * not zero, @value is empty then.
+             */
+            uint64_t spilledOffset;
+            uint32_t spilledSize;
+            /**
+             * Last access (see Tier::now()), updated under shared lock too
+             */
+            mutable std::atomic<uint32_t> accessed;
+
+            Entry(const Value &value = Value(), Version version = 0)
+                : value(value)
+                , version(version)
+                , spilledOffset(0)
+                , spilledSize(0)
+                , accessed(Tier::now())
+            {}
+            Entry(const Entry &entry)
+                : value(entry.value)
+                , version(entry.version)
+                , spilledOffset(entry.spilledOffset)
+                , spilledSize(entry.spilledSize)
+                , accessed(entry.accessed.load(std::memory_order_relaxed))
+            {}
+
+            bool spilled() const
+            {
+                return spilledSize;
+            }
+            size_t size() const
+            {
+                return spilled() ? spilledSize : value.size();
+            }
+        };
         /** XXX: Return some enum retry/skip/ok */
         typedef void (Iterate)(const Key &key, const Value &value);
 
+        /**
+         * Filter of keys for foreach(), evaluated before calling script:
+         * PREFIX <prefix>, MATCH <glob>, RANGE <min> <max> (inclusive)
+         *
+         * Ordered engines seek to the first key that can match, and stop
+         * after the last one (see lowerBound()/isAfter()).
+         */
+        struct KeyFilter
+        {
+            Key prefix;
+            std::string pattern;
+            bool hasRange;
+            Key min;
+            Key max;
+
+            KeyFilter()
+                : hasRange(false)
+            {}
+
+            bool matches(const Key &key) const;
+            /**
+             * First key that can match
+             */
+            const Key &lowerBound() const;
+            /**
+             * Return true if @key and all keys after it can't match
+             */
+            bool isAfter(const Key &key) const;
+        };
+
+        /**
+         * Options of foreach():
+         * "<script> [ ATOMIC ] [ CHUNK <n> ] [ THREADS <n> ] [ <filter> ]"
+         *
+         * In non-atomic mode (default) entries are processed by chunks,
+         * lock is released between chunks, and connection yields to its
+         * event loop (see ChunkedForeach).
+         * Inside MULTI/EXEC it is always atomic.
+         *
+         * With THREADS entries of every chunk (or of the whole engine in
+         * atomic mode) are split between threads (see JsWorkers).
+         */
+        struct ForeachOptions
+        {
+            bool atomic;
+            size_t chunkSize;
+            size_t threads;
+            KeyFilter filter;
+
+            ForeachOptions()
+                : atomic(false)
+                , chunkSize(DEFAULT_FOREACH_CHUNK_SIZE)
+                , threads(1)
+            {}
+        };
+
         Interface();
 
         /**
@@ -52,6 +168,222 @@ namespace Db
         std::string get(const CommandHandler::Arguments &arguments);
         std::string set(const CommandHandler::Arguments &arguments);
         std::string del(const CommandHandler::Arguments &arguments);
-        std::string foreach(const CommandHandler::Arguments &arguments);
+        std::string foreach(const CommandHandler::Arguments &arguments,
+                            CommandHandler &handler);
+        /**
+         * Read-only foreach: "<script> [ <initial accumulator as JSON> ]",
+         * script returns new accumulator, last one is the reply.
+         * Under shared lock.
+         */
+        std::string reduce(const CommandHandler::Arguments &arguments);
+        /**
+         * Run stored script for @keys (see JsVm::eval()), reads and writes
+         * are done under one exclusive lock.
+         */
+        std::string eval(const std::string &code,
+                         const std::vector<Key> &keys,
+                         const std::vector<std::string> &args);
+
+        /**
+         * Partial value operations, they works directly on stored value,
+         * without transferring whole value to/from the client.
+         */
+        std::string append(const CommandHandler::Arguments &arguments);
+        std::string getRange(const CommandHandler::Arguments &arguments);
+        std::string setRange(const CommandHandler::Arguments &arguments);
+        std::string length(const CommandHandler::Arguments &arguments);
+
+        /**
+         * Optimistic concurrency:
+         * - getVersioned() return version of entry with value
+         * - compareAndSet() set value only if version of entry is the same
+         *   as passed (0 - entry must not exist)
+         */
+        std::string getVersioned(const CommandHandler::Arguments &arguments);
+        std::string compareAndSet(const CommandHandler::Arguments &arguments);
+
+        /**
+         * Log all modifications to @shard (see Journal)
+         */
+        void setJournal(Journal::Shard *shard)
+        {
+            m_journal = shard;
+        }
+        Journal::Shard *journal()
+        {
+            return m_journal;
+        }
+
+        /**
+         * For locking a batch of commands (see BatchLock)
+         */
+        Mutex &mutex()
+        {
+            return m_access;
+        }
+
+        /**
+         * Extent file for cold values (see TierCompactor)
+         */
+        Tier &tier()
+        {
+            return m_tier;
+        }
+
+    protected:
+        /**
+         * TODO: maybe move to ThreadSafe wrapper
+         */
+        Mutex m_access;
+        Tier m_tier;
+
+        enum Constants
+        {
+            /**
+             * Number of entries processed by foreach() under one lock
+             */
+            DEFAULT_FOREACH_CHUNK_SIZE = 1 << 10 /* 1024 */
+        };
+
+        /**
+         * Upper bound for value that can be created with setRange() or
+         * grown by append(), to avoid huge allocations because of one
+         * malformed offset (or endless appends).
+         */
+        static const size_t MAX_VALUE_SIZE = (512 << 20) /* 512MB */;
+
+        static const char *REPLY_ERROR_NOT_INTEGER;
+        static const char *REPLY_ERROR_VALUE_TOO_BIG;
+        static const char *REPLY_ERROR_SYNTAX;
+
+        /**
+         * Return false if options are malformed
+         */
+        static bool parseForeachOptions(const CommandHandler::Arguments &arguments,
+                                        ForeachOptions &options);
+
+        /**
+         * Helpers for partial value operations, shared between engines.
+         * Must be called under exclusive lock (except rangeReply()).
+         */
+        static void appendTail(Value &value, const Value &tail);
+        static void writeRange(Value &value, size_t offset, const Value &chunk);
+        /**
+         * @start and @end are inclusive, negative means offset from the end
+         * (like in GETRANGE in redis)
+         */
+        static std::string rangeReply(const Value &value, long long start, long long end);
+        static std::string versionedReply(const Entry &entry, const Value &value);
+
+        /**
+         * Value of @entry, spilled value is read into @buffer (see Tier).
+         * Can be called under shared lock.
+         * Throws Exception if spilled value can't be read.
+         */
+        const Value &read(const Entry &entry, Value &buffer) const;
+        /**
+         * Move spilled value of @entry back into memory, before it is
+         * modified in place.
+         * Must be called under exclusive lock.
+         * Throws Exception (and leaves it spilled) if value can't be read.
+         */
+        Value &load(Entry &entry);
+        /**
+         * Drop spilled value of @entry, before it is overwritten or deleted.
+         * Must be called under exclusive lock.
+         */
+        void release(Entry &entry)
+        {
+            if (entry.spilled()) {
+                m_tier.release(entry.spilledSize);
+                entry.spilledSize = 0;
+            }
+        }
+        static void touch(const Entry &entry)
+        {
+            if (!Tier::enabled()) {
+                return;
+            }
+            const uint32_t now = Tier::now();
+            if (entry.accessed.load(std::memory_order_relaxed) != now) {
+                entry.accessed.store(now, std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * Entries for foreach()
+         */
+        typedef std::vector< std::pair<const Key *, Entry *> > Batch;
+        /**
+         * Call script of foreach() for every entry of @batch (on @threads
+         * threads), and save new values.
+         * Must be called under exclusive lock.
+         * Throws Exception on script errors (after all threads stopped).
+         */
+        void apply(const std::string &code, const Batch &batch, size_t threads);
+
+        /**
+         * Assign new version to modified entry.
+         * Must be called under exclusive lock.
+         *
+         * Versions are unique per engine (not per entry), to avoid ABA
+         * problem for deleted and created again entries.
+         */
+        void stamp(Entry &entry)
+        {
+            entry.version = ++m_lastVersion;
+            touch(entry);
+        }
+        /**
+         * Stamp modified entry, and log new value.
+         * Must be called under exclusive lock.
+         */
+        void changed(const Key &key, Entry &entry)
+        {
+            stamp(entry);
+            if (m_journal) {
+                m_journal->set(key, entry.value);
+            }
+        }
+        void deleted(const Key &key)
+        {
+            if (m_journal) {
+                m_journal->del(key);
+            }
+        }
+        void flushed()
+        {
+            if (m_journal) {
+                m_journal->flush();
+            }
+        }
+
+    private:
+        enum
+        {
+            /**
+             * Do not start threads for less entries than this
+             */
+            MIN_FOREACH_ENTRIES_PER_THREAD = 1 << 6 /* 64 */
+        };
+
+        /**
+         * Amortized growth: reserve at least twice of current capacity,
+         * to make sequence of appends O(n) in total.
+         */
+        static void grow(Value &value, size_t size);
+
+        /**
+         * Call script for one entry, and save new value.
+         * Throws Exception on script error.
+         */
+        void apply(JsVm &vm, const Key &key, Entry &entry);
+
+        Journal::Shard *m_journal;
+
+        /**
+         * Atomic, since foreach() can stamp entries from several threads
+         */
+        std::atomic<Version> m_lastVersion;
     };
 }
@@ -0,0 +1,806 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "journal.h"
+#include "keyspace.h"
+#include "snapshot.h" // SnapshotReader
+#include "server/jsworkers.h"
+#include "kernel/exception.h"
+#include "util/log.h"
+
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+namespace
+{
+    void appendLength(std::string &buffer, uint64_t length)
+    {
+        do {
+            char byte = (length & 0x7f);
+            length >>= 7;
+            if (length) {
+                byte |= 0x80;
+            }
+            buffer += byte;
+        } while (length);
+    }
+
+    void appendString(std::string &buffer, const std::string &string)
+    {
+        appendLength(buffer, string.size());
+        buffer += string;
+    }
+}
+
+namespace Db
+{
+    Journal::Decoder::Result Journal::Decoder::next(const char *&position, const char *end,
+                                                    Decoded &decoded)
+    {
+        SnapshotReader reader(position, end);
+        Record &record = decoded.record;
+        record = { 'S', nullptr, 0, nullptr, 0 };
+
+        if (m_bulkLeft) {
+            if (!reader.readString(record.key, record.keySize) ||
+                !reader.readString(record.value, record.valueSize)) {
+                return INCOMPLETE;
+            }
+            decoded.type = 'S';
+            decoded.id = m_bulkId;
+            --m_bulkLeft;
+            position = reader.position();
+            return DECODED;
+        }
+
+        char type;
+        if (!reader.readByte(type)) {
+            return INCOMPLETE;
+        }
+        decoded.type = record.type = type;
+        decoded.id = 0;
+
+        switch (type) {
+            case 'P':
+            case 'E':
+                break;
+            case 'N':
+                if (!reader.readLength(decoded.id) ||
+                    !reader.readString(decoded.keySpace) ||
+                    !reader.readByte(decoded.engine)) {
+                    return INCOMPLETE;
+                }
+                if ((decoded.engine != 'H') && (decoded.engine != 'A')) {
+                    return MALFORMED;
+                }
+                break;
+            case 'B':
+                if (!reader.readLength(decoded.id) ||
+                    !reader.readLength(decoded.count)) {
+                    return INCOMPLETE;
+                }
+                m_bulkId = decoded.id;
+                m_bulkLeft = decoded.count;
+                break;
+            case 'S':
+            case 'D':
+                if (!reader.readLength(decoded.id) ||
+                    !reader.readString(record.key, record.keySize)) {
+                    return INCOMPLETE;
+                }
+                if ((type == 'S') &&
+                    !reader.readString(record.value, record.valueSize)) {
+                    return INCOMPLETE;
+                }
+                break;
+            case 'F':
+                if (!reader.readLength(decoded.id)) {
+                    return INCOMPLETE;
+                }
+                break;
+            default:
+                return MALFORMED;
+        }
+
+        position = reader.position();
+        return DECODED;
+    }
+
+
+    void Journal::Shard::set(const std::string &key, const std::string &value)
+    {
+        if (!m_journal.m_enabled) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_journal.m_mutex);
+        if (!m_journal.m_enabled) {
+            return;
+        }
+
+        std::string &pending = m_journal.m_pending;
+        pending += 'S';
+        appendLength(pending, m_id);
+        appendString(pending, key);
+        appendString(pending, value);
+        m_journal.appended();
+    }
+
+    void Journal::Shard::del(const std::string &key)
+    {
+        if (!m_journal.m_enabled) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_journal.m_mutex);
+        if (!m_journal.m_enabled) {
+            return;
+        }
+
+        std::string &pending = m_journal.m_pending;
+        pending += 'D';
+        appendLength(pending, m_id);
+        appendString(pending, key);
+        m_journal.appended();
+    }
+
+    void Journal::Shard::flush()
+    {
+        if (!m_journal.m_enabled) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_journal.m_mutex);
+        if (!m_journal.m_enabled) {
+            return;
+        }
+
+        std::string &pending = m_journal.m_pending;
+        pending += 'F';
+        appendLength(pending, m_id);
+        m_journal.appended();
+    }
+
+
+    bool Journal::parseFsyncPolicy(const std::string &name, FsyncPolicy &policy)
+    {
+        if (name == "always") {
+            policy = FSYNC_ALWAYS;
+        } else if (name == "everysec") {
+            policy = FSYNC_EVERYSEC;
+        } else if (name == "no") {
+            policy = FSYNC_NO;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    Journal::Journal()
+        : m_keySpaces(nullptr)
+        , m_fd(-1)
+        , m_policy(FSYNC_EVERYSEC)
+        , m_enabled(false)
+        , m_stopped(false)
+        , m_appended(0)
+        , m_synced(0)
+        , m_fileSize(0)
+        , m_writing(0)
+        , m_rewriteSize(0)
+        , m_rewriting(false)
+        , m_rewritten(false)
+        , m_rewrittenOffset(0)
+    {
+    }
+
+    Journal::~Journal()
+    {
+        close();
+    }
+
+    Journal::Shard *Journal::shard(const std::string &keySpace, char engine)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        uint64_t id = m_shards.size();
+        m_shards.push_back(ShardInfo());
+
+        ShardInfo &info = m_shards.back();
+        info.keySpace = keySpace;
+        info.engine = engine;
+        info.shard.reset(new Shard(*this, id));
+
+        if (m_enabled) {
+            declare(id);
+        }
+        return info.shard.get();
+    }
+
+    bool Journal::replay(const std::string &path, KeySpaces &keySpaces)
+    {
+        int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            return (errno == ENOENT);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        if (!st.st_size) {
+            ::close(fd);
+            return true;
+        }
+
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            LOG(error) << "Can't mmap " << path << ": " << strerror(errno);
+            ::close(fd);
+            return false;
+        }
+        madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+
+        const char *begin = (const char *)mapped;
+        const char *end = begin + st.st_size;
+
+        /**
+         * Split records by shards (ids of shards are different for every
+         * run of server, so they are mapped to key-space/engine).
+         */
+        struct Replayed
+        {
+            std::string keySpace;
+            char engine;
+            std::vector<Record> records;
+        };
+        std::vector<Replayed> replayed;
+        std::map<std::pair<std::string, char>, size_t> indexes;
+        std::unordered_map<uint64_t, size_t> declared;
+
+        Decoder decoder;
+        Decoder::Decoded decoded;
+        Decoder::Result result;
+        const char *position = begin;
+        const char *complete = begin;
+        bool malformed = false;
+        /**
+         * Incomplete bulk at the end is not applied at all
+         */
+        size_t bulkShard = 0;
+        size_t bulkSize = 0;
+        while ((result = decoder.next(position, end, decoded)) == Decoder::DECODED) {
+            if (decoded.type == 'N') {
+                std::pair<std::map<std::pair<std::string, char>, size_t>::iterator, bool> inserted =
+                    indexes.insert(std::make_pair(std::make_pair(decoded.keySpace, decoded.engine),
+                                                  replayed.size()));
+                if (inserted.second) {
+                    replayed.push_back(Replayed());
+                    replayed.back().keySpace = decoded.keySpace;
+                    replayed.back().engine = decoded.engine;
+                }
+                declared[decoded.id] = inserted.first->second;
+                complete = position;
+                continue;
+            }
+
+            std::unordered_map<uint64_t, size_t>::const_iterator shard = declared.find(decoded.id);
+            if ((shard == declared.end()) ||
+                (decoded.type == 'P') || (decoded.type == 'E')) {
+                malformed = true;
+                break;
+            }
+
+            std::vector<Record> &records = replayed[shard->second].records;
+            if (decoded.type == 'B') {
+                bulkShard = shard->second;
+                bulkSize = records.size();
+            } else {
+                records.push_back(decoded.record);
+            }
+            if (!decoder.inBulk()) {
+                complete = position;
+            }
+        }
+        if (result == Decoder::MALFORMED) {
+            malformed = true;
+        }
+        if (!malformed && decoder.inBulk()) {
+            replayed[bulkShard].records.resize(bulkSize);
+        }
+
+        std::vector<JsWorkers::Task> tasks;
+        for (const Replayed &shard : replayed) {
+            KeySpace *keySpace = keySpaces.findOrCreate(shard.keySpace);
+            if (!keySpace) {
+                malformed = true;
+                break;
+            }
+            tasks.push_back([keySpace, &shard] ()
+                            {
+                                if (shard.engine == 'H') {
+                                    keySpace->hashTable().replay(shard.records);
+                                } else {
+                                    keySpace->avlTree().replay(shard.records);
+                                }
+                            });
+        }
+        if (!malformed) {
+            TheJsWorkers::instance().run(tasks);
+        }
+
+        munmap(mapped, st.st_size);
+
+        if (malformed) {
+            ::close(fd);
+            LOG(error) << "Malformed journal " << path;
+            return false;
+        }
+
+        if (complete != end) {
+            LOG(warning) << "Truncating incomplete record at the end of journal " << path
+                         << " (" << (end - complete) << " bytes)";
+            if (ftruncate(fd, complete - begin) != 0) {
+                ::close(fd);
+                return false;
+            }
+        }
+        ::close(fd);
+
+        LOG(info) << "Journal " << path << " replayed";
+        return true;
+    }
+
+    bool Journal::open(const std::string &path, FsyncPolicy policy,
+                       KeySpaces &keySpaces)
+    {
+        if (path.size()) {
+            // Readable too, tail is copied to rewritten journal (see switchToRewritten())
+            m_fd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+            struct stat st;
+            if ((m_fd < 0) || (fstat(m_fd, &st) != 0)) {
+                LOG(error) << "Can't open " << path << ": " << strerror(errno);
+                return false;
+            }
+            m_fileSize = m_rewriteSize = st.st_size;
+        }
+        m_path = path;
+        m_policy = policy;
+        m_keySpaces = &keySpaces;
+
+        std::random_device random;
+        char id[33];
+        snprintf(id, sizeof(id), "%08x%08x%08x%08x",
+                 random(), random(), random(), random());
+        m_replicationId = id;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            // Ids of shards are valid only for this run
+            for (uint64_t id = 0; id < m_shards.size(); ++id) {
+                declare(id);
+            }
+            m_stopped = false;
+            m_enabled = true;
+        }
+
+        m_writer = std::thread(&Journal::write, this);
+        return true;
+    }
+
+    void Journal::close()
+    {
+        if (!m_writer.joinable()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_enabled = false;
+            m_stopped = true;
+        }
+        m_pendingCondition.notify_one();
+        m_streamCondition.notify_all();
+        m_writer.join();
+
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    bool Journal::commit(const SyncedCallback &synced)
+    {
+        if ((m_policy != FSYNC_ALWAYS) || !m_enabled) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        /**
+         * Wait for everything appended so far, since records of command
+         * could be appended by other threads too (i.e. HFOR ... THREADS)
+         */
+        const uint64_t sequence = m_appended;
+        // Writer already returned, or nothing new
+        if (m_stopped || (m_synced >= sequence)) {
+            return false;
+        }
+        m_syncWaiters.push_back(std::make_pair(sequence, synced));
+        return true;
+    }
+
+    void Journal::setBacklogSize(size_t size)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_backlog.resize(size);
+    }
+
+    bool Journal::canContinue(const std::string &id, uint64_t offset)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        return m_backlog.size() && (id == m_replicationId) &&
+               (offset >= m_backlog.begin()) && (offset <= m_backlog.end());
+    }
+
+    pid_t Journal::dump(int &fd, uint64_t &offset)
+    {
+        int pipeFds[2];
+        if (pipe(pipeFds) != 0) {
+            LOG(error) << "Can't create pipe: " << strerror(errno);
+            return -1;
+        }
+
+        pid_t child;
+        m_keySpaces->withAll([this, &pipeFds, &child, &offset] (const std::vector<KeySpace *> &keySpaces)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                offset = m_backlog.end() + m_pending.size();
+            }
+
+            child = fork();
+            if (child == 0) {
+                // Otherwise it will not get EPIPE, if reader is gone
+                ::close(pipeFds[0]);
+                _exit(writeState(pipeFds[1], keySpaces) ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+        });
+        ::close(pipeFds[1]);
+
+        if (child < 0) {
+            LOG(error) << "Can't fork: " << strerror(errno);
+            ::close(pipeFds[0]);
+            return -1;
+        }
+        fd = pipeFds[0];
+        return child;
+    }
+
+    bool Journal::readStream(uint64_t offset, std::string &data)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_streamCondition.wait_for(lock, std::chrono::seconds(1),
+                                   [this, offset] { return m_stopped ||
+                                                           (m_backlog.end() > offset); });
+
+        return !m_stopped && m_backlog.read(offset, data, STREAM_CHUNK_SIZE);
+    }
+
+    void Journal::declare(uint64_t id)
+    {
+        const ShardInfo &info = m_shards[id];
+
+        m_pending += 'N';
+        appendLength(m_pending, id);
+        appendString(m_pending, info.keySpace);
+        m_pending += info.engine;
+    }
+
+    void Journal::appended()
+    {
+        ++m_appended;
+        m_pendingCondition.notify_one();
+    }
+
+    bool Journal::backgroundRewrite()
+    {
+        bool rewriting = false;
+        if (!persistent() || !m_rewriting.compare_exchange_strong(rewriting, true)) {
+            return false;
+        }
+
+        pid_t child;
+        uint64_t offset;
+        m_keySpaces->withAll([this, &child, &offset] (const std::vector<KeySpace *> &keySpaces)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                offset = m_fileSize + m_writing + m_pending.size();
+            }
+
+            child = fork();
+            if (child == 0) {
+                // No logging here, its locks can be in any state.
+                _exit(rewrite(keySpaces) ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+        });
+
+        if (child < 0) {
+            LOG(error) << "Can't fork: " << strerror(errno);
+
+            // Do not retry on every write
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_rewriteSize = m_fileSize;
+            m_rewriting = false;
+            return false;
+        }
+
+        LOG(info) << "Background journal rewriting started by " << child;
+        std::thread(&Journal::reap, this, child, offset).detach();
+        return true;
+    }
+
+    bool Journal::rewrite(const std::vector<KeySpace *> &keySpaces)
+    {
+        const std::string temporary = rewritePath();
+
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+
+        bool written = writeState(fd, keySpaces) && (fsync(fd) == 0);
+        return (::close(fd) == 0) && written;
+    }
+
+    bool Journal::writeState(int fd, const std::vector<KeySpace *> &keySpaces)
+    {
+        SnapshotWriter writer(fd);
+        for (uint64_t id = 0; id < m_shards.size(); ++id) {
+            writer.writeByte('N');
+            writer.writeLength(id);
+            writer.writeString(m_shards[id].keySpace);
+            writer.writeByte(m_shards[id].engine);
+        }
+        try {
+            for (KeySpace *keySpace : keySpaces) {
+                writer.writeByte('B');
+                writer.writeLength(keySpace->hashTable().journal()->id());
+                keySpace->hashTable().dump(writer);
+                writer.writeByte('B');
+                writer.writeLength(keySpace->avlTree().journal()->id());
+                keySpace->avlTree().dump(writer);
+            }
+        } catch (const Exception &e) {
+            // Spilled value can't be read
+            LOG(error) << e.getMessage();
+            return false;
+        }
+        return writer.flush();
+    }
+
+    void Journal::reap(pid_t child, uint64_t offset)
+    {
+        int status;
+        while ((waitpid(child, &status, 0) < 0) && (errno == EINTR)) {
+        }
+
+        const std::string temporary = rewritePath();
+        bool copied = false;
+        if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+            /**
+             * Copy most of records that was appended during rewrite here,
+             * so writer will copy only the rest.
+             */
+            int from = ::open(m_path.c_str(), O_RDONLY);
+            int to = ::open(temporary.c_str(), O_WRONLY | O_APPEND);
+            struct stat st;
+            copied = (from >= 0) && (to >= 0) && (fstat(from, &st) == 0) &&
+                     copy(from, to, offset, st.st_size);
+            if (from >= 0) {
+                ::close(from);
+            }
+            if (to >= 0) {
+                ::close(to);
+            }
+        }
+
+        if (!copied) {
+            LOG(error) << "Background journal rewriting failed";
+            unlink(temporary.c_str());
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_rewriteSize = m_fileSize;
+            m_rewriting = false;
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_rewritten = true;
+            m_rewrittenOffset = offset;
+        }
+        m_pendingCondition.notify_one();
+    }
+
+    uint64_t Journal::switchToRewritten(uint64_t offset)
+    {
+        const std::string temporary = rewritePath();
+
+        int fd = ::open(temporary.c_str(), O_RDWR | O_APPEND);
+        struct stat st;
+        if ((fd >= 0) &&
+            (fstat(m_fd, &st) == 0) &&
+            copy(m_fd, fd, offset, st.st_size) &&
+            (fdatasync(fd) == 0) &&
+            (fstat(fd, &st) == 0) &&
+            (rename(temporary.c_str(), m_path.c_str()) == 0)) {
+            ::close(m_fd);
+            m_fd = fd;
+
+            LOG(info) << "Background journal rewriting finished";
+            return st.st_size;
+        }
+
+        LOG(error) << "Can't switch to rewritten journal: " << strerror(errno);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        unlink(temporary.c_str());
+        return 0;
+    }
+
+    bool Journal::copy(int from, int to, uint64_t &offset, uint64_t end)
+    {
+        std::vector<char> buffer(std::min<uint64_t>(COPY_BUFFER_SIZE, end - std::min(offset, end)));
+
+        while (offset < end) {
+            ssize_t size = pread(from, buffer.data(),
+                                 std::min<uint64_t>(buffer.size(), end - offset), offset);
+            if (size < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            if (!size) {
+                return false;
+            }
+            if (!writeAll(to, buffer.data(), size)) {
+                return false;
+            }
+            offset += size;
+        }
+        return true;
+    }
+
+    void Journal::write()
+    {
+        std::string buffer;
+        std::vector< std::pair<uint64_t, SyncedCallback> > synced;
+        bool dirty = false;
+        time_t lastSync = time(nullptr);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_pendingCondition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return m_stopped || m_rewritten ||
+                                                        !m_pending.empty(); });
+
+            bool stopped = m_stopped;
+            uint64_t appended = m_appended;
+            bool rewritten = m_rewritten;
+            uint64_t offset = m_rewrittenOffset;
+            m_rewritten = false;
+            buffer.swap(m_pending);
+            m_writing = buffer.size();
+            m_backlog.append(buffer.data(), buffer.size());
+            lock.unlock();
+
+            if (!buffer.empty()) {
+                m_streamCondition.notify_all();
+
+                if ((m_fd >= 0) && !writeAll(m_fd, buffer.data(), buffer.size())) {
+                    LOG(error) << "Can't write journal: " << strerror(errno);
+                }
+                dirty = (m_fd >= 0);
+                buffer.clear();
+            }
+
+            time_t now = time(nullptr);
+            if (dirty && ((m_policy == FSYNC_ALWAYS) ||
+                          (m_policy == FSYNC_EVERYSEC && (now - lastSync) >= 1) ||
+                          stopped)) {
+                if (fdatasync(m_fd) != 0) {
+                    LOG(error) << "Can't sync journal: " << strerror(errno);
+                }
+                dirty = false;
+                lastSync = now;
+            }
+
+            uint64_t rewrittenSize = 0;
+            if (rewritten) {
+                // Synced by switchToRewritten()
+                rewrittenSize = switchToRewritten(offset);
+            }
+
+            lock.lock();
+            m_synced = appended;
+            auto ready = std::partition(m_syncWaiters.begin(), m_syncWaiters.end(),
+                                        [appended] (const std::pair<uint64_t, SyncedCallback> &waiter)
+                                        {
+                                            return waiter.first > appended;
+                                        });
+            std::move(ready, m_syncWaiters.end(), std::back_inserter(synced));
+            m_syncWaiters.erase(ready, m_syncWaiters.end());
+            if (!synced.empty()) {
+                lock.unlock();
+                for (const auto &waiter : synced) {
+                    waiter.second();
+                }
+                synced.clear();
+                lock.lock();
+            }
+
+            if (rewritten) {
+                m_fileSize = rewrittenSize ? rewrittenSize : (m_fileSize + m_writing);
+                m_rewriteSize = m_fileSize;
+                m_rewriting = false;
+            } else {
+                m_fileSize += m_writing;
+            }
+            m_writing = 0;
+
+            if (stopped && m_pending.empty()) {
+                return;
+            }
+
+            if (!m_rewriting && (m_fd >= 0) &&
+                (m_fileSize >= MIN_REWRITE_SIZE) &&
+                (m_fileSize >= (m_rewriteSize * 2))) {
+                // Do not block writer by locks of engines
+                std::thread(&Journal::backgroundRewrite, this).detach();
+            }
+        }
+    }
+
+    bool Journal::writeAll(int fd, const char *data, size_t size)
+    {
+        while (size) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+}
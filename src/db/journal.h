@@ -0,0 +1,389 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include "backlog.h"
+
+#include <boost/noncopyable.hpp>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+
+namespace Db
+{
+    class KeySpace;
+    class KeySpaces;
+
+    /**
+     * @brief Append-only log of modifications of entries
+     *
+     * Engines append resulting values (not commands), so HFOR/HEVALSHA
+     * results and partial value operations are logged the same way as
+     * HSET/HDEL.
+     *
+     * Records are encoded into in-memory buffer under engine lock (so they
+     * are ordered per engine), and written by dedicated writer thread,
+     * that writes everything accumulated since last write at once
+     * (group commit).
+     *
+     * Format (lengths are varints, like in Snapshot):
+     *   'N' <shard id> <key-space name> <engine>  -- declaration of shard
+     *   'S' <shard id> <key> <value>
+     *   'D' <shard id> <key>
+     *   'F' <shard id>
+     *   'B' <shard id> <count> <key> <value> ...  -- written by rewrite
+     *
+     * Log is rewritten in background (see backgroundRewrite()) when it
+     * grows twice since last rewrite, so its size is proportional to
+     * live data.
+     *
+     * The same records are streamed to replicas (see readStream()),
+     * last of them are kept in circular backlog, so replica that was
+     * disconnected for a short time can continue from its offset.
+     * Replication stream also has:
+     *   'P'  -- ping, sent when there is nothing to stream
+     *   'E'  -- end of state of key-spaces, that is sent on full resync
+     *           (see dump()), offsets are counted after it
+     */
+    class Journal : boost::noncopyable
+    {
+    public:
+        enum FsyncPolicy
+        {
+            /**
+             * Reply after record is synced (see commit())
+             */
+            FSYNC_ALWAYS,
+            FSYNC_EVERYSEC,
+            /**
+             * Leave it to OS
+             */
+            FSYNC_NO,
+        };
+        /**
+         * Return false for unknown policy
+         */
+        static bool parseFsyncPolicy(const std::string &name, FsyncPolicy &policy);
+
+        /**
+         * Modification read from log, points into mapped log
+         */
+        struct Record
+        {
+            char type;
+            const char *key;
+            uint64_t keySize;
+            const char *value;
+            uint64_t valueSize;
+        };
+
+        /**
+         * @brief Incremental decoder of records
+         *
+         * Entries of bulk record are returned one by one, as 'S' records
+         * (after 'B' record itself), so bulks are not buffered whole.
+         */
+        class Decoder
+        {
+        public:
+            struct Decoded
+            {
+                char type;
+                uint64_t id;
+                Record record;
+                /**
+                 * 'N' only
+                 */
+                std::string keySpace;
+                char engine;
+                /**
+                 * 'B' only
+                 */
+                uint64_t count;
+            };
+            enum Result
+            {
+                DECODED,
+                /**
+                 * Need more data, nothing is consumed
+                 */
+                INCOMPLETE,
+                MALFORMED,
+            };
+
+            Decoder()
+                : m_bulkId(0)
+                , m_bulkLeft(0)
+            {}
+
+            /**
+             * Decode one record from [@position, @end), @position is
+             * advanced to the end of it.
+             */
+            Result next(const char *&position, const char *end, Decoded &decoded);
+            bool inBulk() const
+            {
+                return m_bulkLeft;
+            }
+
+        private:
+            uint64_t m_bulkId;
+            uint64_t m_bulkLeft;
+        };
+
+        /**
+         * @brief Log of one engine of one key-space
+         */
+        class Shard : boost::noncopyable
+        {
+        public:
+            Shard(Journal &journal, uint64_t id)
+                : m_journal(journal)
+                , m_id(id)
+            {}
+
+            /**
+             * Must be called under exclusive lock of engine
+             */
+            void set(const std::string &key, const std::string &value);
+            void del(const std::string &key);
+            void flush();
+
+            uint64_t id() const
+            {
+                return m_id;
+            }
+
+        private:
+            Journal &m_journal;
+            uint64_t m_id;
+        };
+
+        Journal();
+        ~Journal();
+
+        /**
+         * Shards are never destroyed, like key-spaces
+         */
+        Shard *shard(const std::string &keySpace, char engine);
+
+        /**
+         * Apply log to @keySpaces, shards are replayed in parallel.
+         * Incomplete record at the end (i.e. after crash) is truncated.
+         * Return false on errors (missing log is not an error).
+         */
+        bool replay(const std::string &path, KeySpaces &keySpaces);
+        /**
+         * Start appending to log (must be called after replay()),
+         * @keySpaces are used for rewrites.
+         * Empty @path means that records are only streamed to replicas.
+         */
+        bool open(const std::string &path, FsyncPolicy policy,
+                  KeySpaces &keySpaces);
+        /**
+         * Write everything that was appended and stop writer
+         */
+        void close();
+        bool enabled() const
+        {
+            return m_enabled;
+        }
+        /**
+         * Log is written to file
+         */
+        bool persistent() const
+        {
+            return m_enabled && !m_path.empty();
+        }
+
+        /**
+         * Size of replication backlog, 0 disables replication.
+         * Must be called before open().
+         */
+        void setBacklogSize(size_t size);
+        size_t backlogSize() const
+        {
+            return m_backlog.size();
+        }
+        /**
+         * Random id, that is generated by open(), offsets of stream are
+         * valid only with it.
+         */
+        const std::string &replicationId() const
+        {
+            return m_replicationId;
+        }
+        /**
+         * Return true if stream can be continued from @offset of @id
+         * (i.e. it is still in backlog).
+         */
+        bool canContinue(const std::string &id, uint64_t offset);
+        /**
+         * Write state of all key-spaces (in format of log) in forked child,
+         * like backgroundRewrite() does.
+         * @fd is set to read end of pipe, that state is written to,
+         * @offset is set to offset of stream at the moment of fork().
+         * Return pid of child, -1 on errors.
+         */
+        pid_t dump(int &fd, uint64_t &offset);
+        /**
+         * Wait (up to a second) for records after @offset of stream, and
+         * copy some of them to @data (empty if there is no new records).
+         * Return false if @offset is not in backlog already, or journal
+         * is closed.
+         */
+        bool readStream(uint64_t offset, std::string &data);
+
+        /**
+         * Rewrite log from current state of all key-spaces:
+         * - fork() while shared locks of all engines are held, and write
+         *   minimal log in child (like Snapshot does)
+         * - remember offset of log at the moment of fork(), records after
+         *   it are copied from the old log into new one after child
+         *   finished, so they are not buffered in memory
+         * - writer thread copies the rest and rename()s new log over
+         *   the old one
+         * Return false if journal is disabled, rewrite is already in
+         * progress, or fork() failed.
+         */
+        bool backgroundRewrite();
+        bool rewriteInProgress() const
+        {
+            return m_rewriting;
+        }
+
+        typedef std::function<void()> SyncedCallback;
+        /**
+         * With FSYNC_ALWAYS, if records appended so far (by any thread) are
+         * not synced yet, return true, and call @synced from writer thread
+         * after they are synced (so it must not block, i.e. post reply).
+         * Otherwise (and with other policies) return false immediately.
+         * Must be called without locks of engines (i.e. before reply).
+         */
+        bool commit(const SyncedCallback &synced);
+
+    private:
+        enum Constants
+        {
+            /**
+             * Do not rewrite small logs automatically
+             */
+            MIN_REWRITE_SIZE = 64 << 20 /* 64MB */,
+            COPY_BUFFER_SIZE = 1 << 20 /* 1MB */,
+            /**
+             * Max size of data returned by readStream() at once
+             */
+            STREAM_CHUNK_SIZE = 1 << 16 /* 64K */
+        };
+
+        struct ShardInfo
+        {
+            std::string keySpace;
+            char engine;
+            std::unique_ptr<Shard> shard;
+        };
+        std::vector<ShardInfo> m_shards;
+
+        std::string m_path;
+        KeySpaces *m_keySpaces;
+        int m_fd;
+        FsyncPolicy m_policy;
+        std::atomic<bool> m_enabled;
+        bool m_stopped;
+
+        /**
+         * Records that are not written yet, and sequence numbers of
+         * last appended/written records (for commit())
+         */
+        std::string m_pending;
+        uint64_t m_appended;
+        uint64_t m_synced;
+        /**
+         * Callbacks of commit(), that wait for sequence number
+         */
+        std::vector< std::pair<uint64_t, SyncedCallback> > m_syncWaiters;
+
+        /**
+         * Size of log and of records that are written now, so offset of
+         * next record is (m_fileSize + m_writing + m_pending.size())
+         */
+        uint64_t m_fileSize;
+        uint64_t m_writing;
+        /**
+         * Size of log after last rewrite (or at start)
+         */
+        uint64_t m_rewriteSize;
+        std::atomic<bool> m_rewriting;
+        /**
+         * Set when rewritten log is ready to be switched to by writer,
+         * records from @m_rewrittenOffset must be copied into it
+         */
+        bool m_rewritten;
+        uint64_t m_rewrittenOffset;
+
+        /**
+         * Records that was written, for replicas (protected by m_mutex)
+         */
+        Backlog m_backlog;
+        std::string m_replicationId;
+
+        std::mutex m_mutex;
+        std::condition_variable m_pendingCondition;
+        std::condition_variable m_streamCondition;
+        std::thread m_writer;
+
+        /**
+         * Must be called under m_mutex
+         */
+        void declare(uint64_t id);
+        void appended();
+
+        void write();
+        static bool writeAll(int fd, const char *data, size_t size);
+
+        std::string rewritePath() const
+        {
+            return m_path + ".rewrite";
+        }
+        /**
+         * Write minimal log, called in child without any locks
+         */
+        bool rewrite(const std::vector<KeySpace *> &keySpaces);
+        /**
+         * Write declarations of all shards and bulks of all their entries
+         */
+        bool writeState(int fd, const std::vector<KeySpace *> &keySpaces);
+        /**
+         * Wait for child, and copy records that was written after fork()
+         * into rewritten log (while writer keeps appending to old one)
+         */
+        void reap(pid_t child, uint64_t offset);
+        /**
+         * Called by writer, copy the rest and rename rewritten log.
+         * Return size of new log, 0 on errors.
+         */
+        uint64_t switchToRewritten(uint64_t offset);
+        /**
+         * Copy [@offset, @end) of @from to the end of @to, @offset is
+         * advanced to the end of copied data.
+         */
+        static bool copy(int from, int to, uint64_t &offset, uint64_t end);
+    };
+}
@@ -0,0 +1,114 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "keyspace.h"
+#include "util/log.h"
+
+
+namespace Db
+{
+    KeySpace::KeySpace(const std::string &name, Journal &journal)
+        : m_name(name)
+    {
+        m_hashTable.setJournal(journal.shard(name, 'H'));
+        m_avlTree.setJournal(journal.shard(name, 'A'));
+    }
+
+    KeySpace::KeySpace(const std::string &name)
+        : m_name(name)
+    {
+    }
+
+    void KeySpace::flush()
+    {
+        m_hashTable.flush();
+        m_avlTree.flush();
+    }
+
+    const char *KeySpaces::DEFAULT_NAME = "0";
+
+    KeySpaces::KeySpaces(Journal &journal)
+        : m_journal(journal)
+        , m_default(nullptr)
+    {
+        m_default = findOrCreate(DEFAULT_NAME);
+    }
+
+    KeySpace *KeySpaces::findOrCreate(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(m_access);
+
+        Map::iterator found = m_keySpaces.find(name);
+        if (found != m_keySpaces.end()) {
+            return found->second.get();
+        }
+        if (m_keySpaces.size() >= MAX_KEY_SPACES) {
+            return nullptr;
+        }
+
+        KeySpace *keySpace = new KeySpace(name, m_journal);
+        m_keySpaces[name].reset(keySpace);
+        return keySpace;
+    }
+
+    bool KeySpaces::attach(const std::string &name, const std::string &path)
+    {
+        std::unique_ptr<Dataset> dataset(new Dataset);
+        if (!dataset->open(path)) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_access);
+
+        if (m_keySpaces.count(name)) {
+            LOG(error) << "Key-space " << name << " already exists, "
+                       << "can't attach dataset " << path;
+            return false;
+        }
+        if (m_keySpaces.size() >= MAX_KEY_SPACES) {
+            LOG(error) << "Too many key-spaces, can't attach dataset " << path;
+            return false;
+        }
+
+        KeySpace *keySpace = new KeySpace(name);
+        keySpace->m_dataset = std::move(dataset);
+        m_keySpaces[name].reset(keySpace);
+        return true;
+    }
+
+    void KeySpaces::forEach(const std::function<void(KeySpace &keySpace)> &callback)
+    {
+        std::lock_guard<std::mutex> lock(m_access);
+
+        for (Map::value_type &keySpace : m_keySpaces) {
+            callback(*keySpace.second);
+        }
+    }
+
+    void KeySpaces::withAll(const std::function<void(const std::vector<KeySpace *> &keySpaces)> &callback)
+    {
+        std::lock_guard<std::mutex> lock(m_access);
+
+        std::vector<KeySpace *> keySpaces;
+        std::vector<Mutex *> mutexes;
+        for (Map::value_type &keySpace : m_keySpaces) {
+            if (keySpace.second->dataset()) {
+                continue;
+            }
+            keySpaces.push_back(keySpace.second.get());
+            mutexes.push_back(&keySpace.second->hashTable().mutex());
+            mutexes.push_back(&keySpace.second->avlTree().mutex());
+        }
+
+        SharedBatchLock enginesLock(mutexes);
+        callback(keySpaces);
+    }
+}
@@ -0,0 +1,168 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include "db/hashtable.h"
+#include "db/avltree.h"
+#include "db/journal.h"
+#include "db/dataset.h"
+
+#include <boost/noncopyable.hpp>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <string>
+
+
+namespace Db
+{
+    /**
+     * @brief Logical database, with its own instance of every engine
+     *
+     * So every key-space has its own locks, and do not contend with others.
+     */
+    class KeySpace : boost::noncopyable
+    {
+    public:
+        /**
+         * Modifications of all engines are logged to @journal
+         */
+        KeySpace(const std::string &name, Journal &journal);
+        /**
+         * Modifications are not logged (i.e. for read-only key-spaces of
+         * datasets, that must not appear in journal/replication stream)
+         */
+        KeySpace(const std::string &name);
+
+        const std::string &name() const
+        {
+            return m_name;
+        }
+
+        HashTable &hashTable()
+        {
+            return m_hashTable;
+        }
+        AvlTree &avlTree()
+        {
+            return m_avlTree;
+        }
+
+        /**
+         * Drop all entries from all engines.
+         */
+        void flush();
+
+        /**
+         * Prebuilt dataset, that serves reads of this key-space instead of
+         * hashtable, nullptr for usual key-spaces.
+         * Such key-spaces are read-only (see KeySpaces::attach()).
+         */
+        const Dataset *dataset() const
+        {
+            return m_dataset.get();
+        }
+
+        /**
+         * Count command on engine of this key-space (see INFO keyspace)
+         *
+         * Relaxed, since counters are for statistics only.
+         */
+        void recordCommand(bool write)
+        {
+            m_calls.fetch_add(1, std::memory_order_relaxed);
+            if (write) {
+                m_writes.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        uint64_t calls() const
+        {
+            return m_calls.load(std::memory_order_relaxed);
+        }
+        uint64_t writes() const
+        {
+            return m_writes.load(std::memory_order_relaxed);
+        }
+
+    private:
+        friend class KeySpaces;
+
+        std::string m_name;
+        std::unique_ptr<Dataset> m_dataset;
+
+        std::atomic<uint64_t> m_calls { 0 };
+        std::atomic<uint64_t> m_writes { 0 };
+
+        HashTable m_hashTable;
+        AvlTree m_avlTree;
+    };
+
+    /**
+     * @brief Registry of all key-spaces
+     *
+     * Key-spaces are created on demand, and never destroyed (only flushed),
+     * so references to them can be cached (i.e. per connection).
+     */
+    class KeySpaces : boost::noncopyable
+    {
+    public:
+        typedef std::map< std::string, std::unique_ptr<KeySpace> > Map;
+
+        static const char *DEFAULT_NAME;
+
+        KeySpaces(Journal &journal);
+
+        KeySpace &defaultKeySpace()
+        {
+            return *m_default;
+        }
+        /**
+         * Return nullptr if there are too many key-spaces already.
+         */
+        KeySpace *findOrCreate(const std::string &name);
+        /**
+         * Create read-only key-space @name, served from dataset file @path
+         * (see Dataset).
+         * Must be called after snapshot/journal is loaded, fails if
+         * key-space already exists.
+         */
+        bool attach(const std::string &name, const std::string &path);
+
+        /**
+         * Call @callback for every key-space, under registry lock
+         */
+        void forEach(const std::function<void(KeySpace &keySpace)> &callback);
+        /**
+         * Call @callback once with all key-spaces, under registry lock
+         * and shared locks of all their engines (i.e. for fork() of Snapshot)
+         *
+         * Read-only key-spaces are skipped, their engines are always empty,
+         * and datasets are not persisted.
+         */
+        void withAll(const std::function<void(const std::vector<KeySpace *> &keySpaces)> &callback);
+
+    private:
+        enum Constants
+        {
+            MAX_KEY_SPACES = 1 << 10 /* 1024 */
+        };
+
+        Journal &m_journal;
+        Map m_keySpaces;
+        KeySpace *m_default;
+        std::mutex m_access;
+    };
+}
@@ -0,0 +1,78 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "lock.h"
+
+#include <algorithm>
+
+
+namespace Db
+{
+    thread_local BatchLock *BatchLock::s_current = nullptr;
+
+    BatchLock::BatchLock(const std::vector<Mutex *> &mutexes)
+        : m_mutexes(mutexes)
+        , m_previous(s_current)
+    {
+        // Already held by outer batch
+        m_mutexes.erase(std::remove_if(m_mutexes.begin(), m_mutexes.end(),
+                                       [] (Mutex *mutex) { return owns(*mutex); }),
+                        m_mutexes.end());
+        std::sort(m_mutexes.begin(), m_mutexes.end());
+        m_mutexes.erase(std::unique(m_mutexes.begin(), m_mutexes.end()),
+                        m_mutexes.end());
+
+        for (Mutex *mutex : m_mutexes) {
+            mutex->lock();
+        }
+        s_current = this;
+    }
+
+    BatchLock::~BatchLock()
+    {
+        s_current = m_previous;
+        for (std::vector<Mutex *>::reverse_iterator mutex = m_mutexes.rbegin();
+             mutex != m_mutexes.rend(); ++mutex) {
+            (*mutex)->unlock();
+        }
+    }
+
+    bool BatchLock::owns(const Mutex &mutex)
+    {
+        for (const BatchLock *batch = s_current; batch; batch = batch->m_previous) {
+            if (std::binary_search(batch->m_mutexes.begin(), batch->m_mutexes.end(),
+                                   &mutex)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    SharedBatchLock::SharedBatchLock(const std::vector<Mutex *> &mutexes)
+        : m_mutexes(mutexes)
+    {
+        std::sort(m_mutexes.begin(), m_mutexes.end());
+        m_mutexes.erase(std::unique(m_mutexes.begin(), m_mutexes.end()),
+                        m_mutexes.end());
+
+        for (Mutex *mutex : m_mutexes) {
+            mutex->lock_shared();
+        }
+    }
+
+    SharedBatchLock::~SharedBatchLock()
+    {
+        for (std::vector<Mutex *>::reverse_iterator mutex = m_mutexes.rbegin();
+             mutex != m_mutexes.rend(); ++mutex) {
+            (*mutex)->unlock_shared();
+        }
+    }
+}
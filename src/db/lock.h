@@ -0,0 +1,113 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include "util/probes.h"
+
+#include <boost/thread/pthread/shared_mutex.hpp>
+#include <boost/noncopyable.hpp>
+#include <vector>
+
+
+namespace Db
+{
+    typedef boost::shared_mutex Mutex;
+
+    /**
+     * @brief Hold exclusive locks for a batch of commands (i.e. MULTI/EXEC)
+     *
+     * While it is alive, SharedLock/ExclusiveLock for mutexes of the batch
+     * do nothing in the thread that created it, so engines code do not need
+     * separate non-locking versions of commands.
+     *
+     * Mutexes are locked in order of their addresses, to avoid deadlocks
+     * between concurrent batches.
+     */
+    class BatchLock : boost::noncopyable
+    {
+    public:
+        BatchLock(const std::vector<Mutex *> &mutexes);
+        ~BatchLock();
+
+        /**
+         * Is @mutex held by batch of current thread
+         */
+        static bool owns(const Mutex &mutex);
+
+    private:
+        std::vector<Mutex *> m_mutexes;
+        BatchLock *m_previous;
+
+        static thread_local BatchLock *s_current;
+    };
+
+    /**
+     * @brief Hold shared locks of a set of engines (i.e. for fork())
+     *
+     * Mutexes are locked in order of their addresses, like in BatchLock.
+     */
+    class SharedBatchLock : boost::noncopyable
+    {
+    public:
+        SharedBatchLock(const std::vector<Mutex *> &mutexes);
+        ~SharedBatchLock();
+
+    private:
+        std::vector<Mutex *> m_mutexes;
+    };
+
+    class SharedLock : boost::noncopyable
+    {
+    public:
+        SharedLock(Mutex &mutex)
+            : m_mutex(BatchLock::owns(mutex) ? nullptr : &mutex)
+        {
+            if (m_mutex) {
+                PROBE2(lock__wait, m_mutex, 0);
+                m_mutex->lock_shared();
+                PROBE2(lock__acquired, m_mutex, 0);
+            }
+        }
+        ~SharedLock()
+        {
+            if (m_mutex) {
+                m_mutex->unlock_shared();
+            }
+        }
+
+    private:
+        Mutex *m_mutex;
+    };
+
+    class ExclusiveLock : boost::noncopyable
+    {
+    public:
+        ExclusiveLock(Mutex &mutex)
+            : m_mutex(BatchLock::owns(mutex) ? nullptr : &mutex)
+        {
+            if (m_mutex) {
+                PROBE2(lock__wait, m_mutex, 1);
+                m_mutex->lock();
+                PROBE2(lock__acquired, m_mutex, 1);
+            }
+        }
+        ~ExclusiveLock()
+        {
+            if (m_mutex) {
+                m_mutex->unlock();
+            }
+        }
+
+    private:
+        Mutex *m_mutex;
+    };
+}
@@ -0,0 +1,507 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "snapshot.h"
+#include "keyspace.h"
+#include "server/jsworkers.h"
+#include "kernel/exception.h"
+#include "util/log.h"
+
+#include <functional>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+namespace Db
+{
+    SnapshotWriter::SnapshotWriter(int fd)
+        : m_fd(fd)
+        , m_failed(false)
+        , m_offset(0)
+        , m_inTable(false)
+        , m_segment()
+    {
+        m_buffer.reserve(BUFFER_SIZE);
+    }
+
+    void SnapshotWriter::writeByte(char byte)
+    {
+        write(&byte, 1);
+    }
+
+    void SnapshotWriter::writeLength(uint64_t length)
+    {
+        char bytes[10];
+        size_t size = 0;
+        do {
+            bytes[size] = (length & 0x7f);
+            length >>= 7;
+            if (length) {
+                bytes[size] |= 0x80;
+            }
+            ++size;
+        } while (length);
+
+        write(bytes, size);
+    }
+
+    void SnapshotWriter::writeString(const std::string &string)
+    {
+        writeLength(string.size());
+        write(string.data(), string.size());
+    }
+
+    void SnapshotWriter::writeEntry(const std::string &key, const std::string &value)
+    {
+        if (m_inTable && !m_segment.count) {
+            m_segment.offset = m_offset;
+            m_crc.reset();
+        }
+
+        writeString(key);
+        writeString(value);
+
+        if (m_inTable &&
+            ((++m_segment.count >= SEGMENT_ENTRIES) ||
+             ((m_offset - m_segment.offset) >= SEGMENT_SIZE))) {
+            endSegment();
+        }
+    }
+
+    void SnapshotWriter::beginTable(const std::string &name, char engine)
+    {
+        Table table = { name, engine };
+        m_tables.push_back(table);
+
+        m_segment.table = (m_tables.size() - 1);
+        m_segment.count = 0;
+        m_inTable = true;
+    }
+
+    void SnapshotWriter::endTable()
+    {
+        endSegment();
+        m_inTable = false;
+    }
+
+    void SnapshotWriter::endSegment()
+    {
+        if (!m_segment.count) {
+            return;
+        }
+
+        m_segment.size = (m_offset - m_segment.offset);
+        m_segment.crc = m_crc.checksum();
+        m_segments.push_back(m_segment);
+        m_segment.count = 0;
+    }
+
+    bool SnapshotWriter::finish()
+    {
+        uint64_t index = m_offset;
+        writeByte('E');
+
+        writeLength(m_tables.size());
+        for (const Table &table : m_tables) {
+            writeString(table.name);
+            writeByte(table.engine);
+        }
+
+        writeLength(m_segments.size());
+        for (const Segment &segment : m_segments) {
+            writeLength(segment.table);
+            writeLength(segment.offset);
+            writeLength(segment.size);
+            writeLength(segment.count);
+
+            char bytes[4];
+            for (size_t i = 0; i < sizeof(bytes); ++i) {
+                bytes[i] = (segment.crc >> (i * 8)) & 0xff;
+            }
+            write(bytes, sizeof(bytes));
+        }
+
+        char bytes[8];
+        for (size_t i = 0; i < sizeof(bytes); ++i) {
+            bytes[i] = (index >> (i * 8)) & 0xff;
+        }
+        write(bytes, sizeof(bytes));
+
+        return flush();
+    }
+
+    void SnapshotWriter::write(const char *data, size_t size)
+    {
+        m_offset += size;
+        if (m_inTable) {
+            m_crc.process_bytes(data, size);
+        }
+
+        if ((m_buffer.size() + size) > BUFFER_SIZE) {
+            flush();
+        }
+        // Big values are written directly
+        if (size > BUFFER_SIZE) {
+            m_buffer.assign(data, data + size);
+            flush();
+            return;
+        }
+        m_buffer.insert(m_buffer.end(), data, data + size);
+    }
+
+    bool SnapshotWriter::flush()
+    {
+        const char *data = m_buffer.data();
+        size_t left = m_buffer.size();
+
+        while (left && !m_failed) {
+            ssize_t written = ::write(m_fd, data, left);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                m_failed = true;
+                break;
+            }
+            data += written;
+            left -= written;
+        }
+        m_buffer.clear();
+
+        return !m_failed;
+    }
+
+
+    SnapshotReader::SnapshotReader(const char *begin, const char *end)
+        : m_current(begin)
+        , m_end(end)
+    {
+    }
+
+    bool SnapshotReader::readByte(char &byte)
+    {
+        if (m_current == m_end) {
+            return false;
+        }
+        byte = *m_current++;
+        return true;
+    }
+
+    bool SnapshotReader::readLength(uint64_t &length)
+    {
+        length = 0;
+        for (size_t shift = 0; shift < 64; shift += 7) {
+            char byte;
+            if (!readByte(byte)) {
+                return false;
+            }
+            length |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool SnapshotReader::readString(std::string &string)
+    {
+        const char *data;
+        uint64_t length;
+        if (!readString(data, length)) {
+            return false;
+        }
+        string.assign(data, length);
+        return true;
+    }
+
+    bool SnapshotReader::readString(const char *&data, uint64_t &length)
+    {
+        if (!readLength(length) || (length > (uint64_t)(m_end - m_current))) {
+            return false;
+        }
+        data = m_current;
+        m_current += length;
+        return true;
+    }
+
+
+    const char *Snapshot::MAGIC = "BCSNAP02";
+
+    Snapshot::Snapshot(KeySpaces &keySpaces)
+        : m_keySpaces(keySpaces)
+        , m_child(0)
+        , m_lastSave(0)
+    {
+    }
+
+    bool Snapshot::save()
+    {
+        bool saved;
+        m_keySpaces.withAll([this, &saved] (const std::vector<KeySpace *> &keySpaces)
+        {
+            saved = write(keySpaces);
+        });
+
+        if (saved) {
+            m_lastSave = time(nullptr);
+        }
+        return saved;
+    }
+
+    bool Snapshot::backgroundSave()
+    {
+        if (inProgress()) {
+            return false;
+        }
+
+        pid_t child;
+        m_keySpaces.withAll([this, &child] (const std::vector<KeySpace *> &keySpaces)
+        {
+            child = fork();
+            if (child == 0) {
+                // No logging here, its locks can be in any state.
+                _exit(write(keySpaces) ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+        });
+
+        if (child < 0) {
+            LOG(error) << "Can't fork: " << strerror(errno);
+            return false;
+        }
+
+        LOG(info) << "Background saving started by " << child;
+        m_child = child;
+        std::thread(&Snapshot::reap, this, child).detach();
+        return true;
+    }
+
+    void Snapshot::reap(pid_t child)
+    {
+        int status;
+        while ((waitpid(child, &status, 0) < 0) && (errno == EINTR)) {
+        }
+
+        if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+            LOG(info) << "Background saving finished";
+            m_lastSave = time(nullptr);
+        } else {
+            LOG(error) << "Background saving failed";
+        }
+        m_child = 0;
+    }
+
+    bool Snapshot::write(const std::vector<KeySpace *> &keySpaces)
+    {
+        const std::string temporary = m_path + ".tmp";
+
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+
+        SnapshotWriter writer(fd);
+        bool dumped = true;
+        try {
+            writer.writeString(MAGIC);
+            for (KeySpace *keySpace : keySpaces) {
+                writer.writeByte('K');
+                writer.writeString(keySpace->name());
+
+                writer.writeByte('H');
+                writer.beginTable(keySpace->name(), 'H');
+                keySpace->hashTable().dump(writer);
+                writer.endTable();
+
+                writer.writeByte('A');
+                writer.beginTable(keySpace->name(), 'A');
+                keySpace->avlTree().dump(writer);
+                writer.endTable();
+            }
+        } catch (const Exception &e) {
+            // Spilled value can't be read, do not replace snapshot
+            LOG(error) << e.getMessage();
+            dumped = false;
+        }
+
+        bool written = dumped && writer.finish() && (fsync(fd) == 0);
+        written = (close(fd) == 0) && written;
+
+        if (!written || (rename(temporary.c_str(), m_path.c_str()) != 0)) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool Snapshot::load()
+    {
+        int fd = open(m_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return (errno == ENOENT);
+        }
+
+        struct stat st;
+        if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)(1 /* E */ + 8 /* index */))) {
+            close(fd);
+            LOG(error) << "Malformed snapshot " << m_path;
+            return false;
+        }
+
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            LOG(error) << "Can't mmap " << m_path << ": " << strerror(errno);
+            return false;
+        }
+        // Segments are read in parallel, so not sequentially
+        madvise(mapped, st.st_size, MADV_WILLNEED);
+
+        const char *begin = (const char *)mapped;
+        const char *end = begin + st.st_size - 8 /* index */;
+
+        uint64_t index = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            index |= (uint64_t)(unsigned char)end[i] << (i * 8);
+        }
+
+        std::string magic;
+        SnapshotReader header(begin, end);
+        bool loaded = header.readString(magic) && (magic == MAGIC) &&
+                      (index < (uint64_t)(end - begin)) && (begin[index] == 'E');
+
+        /**
+         * Read index: tables, and segments of them
+         */
+        struct Table
+        {
+            KeySpace *keySpace;
+            char engine;
+            uint64_t count;
+        };
+        std::vector<Table> tables;
+
+        struct Segment
+        {
+            Table *table;
+            const char *data;
+            uint64_t size;
+            uint64_t count;
+            uint32_t crc;
+        };
+        std::vector<Segment> segments;
+
+        SnapshotReader reader(begin + index + 1 /* E */, end);
+        uint64_t count = 0;
+        loaded = loaded && reader.readLength(count);
+        for (; loaded && count; --count) {
+            std::string name;
+            Table table = { nullptr, 0, 0 };
+            loaded = reader.readString(name) && reader.readByte(table.engine) &&
+                     ((table.engine == 'H') || (table.engine == 'A')) &&
+                     (table.keySpace = m_keySpaces.findOrCreate(name));
+            tables.push_back(table);
+        }
+
+        loaded = loaded && reader.readLength(count);
+        for (; loaded && count; --count) {
+            uint64_t table;
+            uint64_t offset;
+            Segment segment = { nullptr, nullptr, 0, 0, 0 };
+            char crc[4];
+            loaded = reader.readLength(table) && (table < tables.size()) &&
+                     reader.readLength(offset) &&
+                     reader.readLength(segment.size) &&
+                     reader.readLength(segment.count) &&
+                     reader.readByte(crc[0]) && reader.readByte(crc[1]) &&
+                     reader.readByte(crc[2]) && reader.readByte(crc[3]) &&
+                     (offset <= index) && (segment.size <= (index - offset));
+            if (!loaded) {
+                break;
+            }
+
+            segment.table = &tables[table];
+            segment.data = begin + offset;
+            for (size_t i = 0; i < sizeof(crc); ++i) {
+                segment.crc |= (uint32_t)(unsigned char)crc[i] << (i * 8);
+            }
+            segment.table->count += segment.count;
+            segments.push_back(segment);
+        }
+
+        /**
+         * Decode segments in parallel, and insert into presized tables
+         * (inserts into one table are serialized by its lock).
+         */
+        if (loaded) {
+            for (const Table &table : tables) {
+                if (table.engine == 'H') {
+                    table.keySpace->hashTable().reserve(table.count);
+                }
+            }
+
+            std::atomic<size_t> next(0);
+            std::atomic<bool> failed(false);
+            std::function<void()> decode = [&segments, &next, &failed] ()
+            {
+                Interface::Entries entries;
+                size_t i;
+                while (!failed && ((i = next++) < segments.size())) {
+                    const Segment &segment = segments[i];
+
+                    boost::crc_32_type crc;
+                    crc.process_bytes(segment.data, segment.size);
+                    if ((crc.checksum() != segment.crc) ||
+                        (segment.count > segment.size)) {
+                        failed = true;
+                        return;
+                    }
+
+                    SnapshotReader reader(segment.data, segment.data + segment.size);
+                    entries.resize(segment.count);
+                    for (Interface::Entries::value_type &entry : entries) {
+                        if (!reader.readEntry(entry.first, entry.second)) {
+                            failed = true;
+                            return;
+                        }
+                    }
+
+                    if (segment.table->engine == 'H') {
+                        segment.table->keySpace->hashTable().restore(entries);
+                    } else {
+                        segment.table->keySpace->avlTree().restore(entries);
+                    }
+                }
+            };
+
+            JsWorkers &workers = TheJsWorkers::instance();
+            std::vector<JsWorkers::Task> tasks(workers.size() + 1 /* caller */, decode);
+            workers.run(tasks);
+
+            loaded = !failed;
+        }
+
+        munmap(mapped, st.st_size);
+
+        if (!loaded) {
+            LOG(error) << "Malformed snapshot " << m_path;
+            return false;
+        }
+        m_lastSave = st.st_mtime;
+        LOG(info) << "Snapshot " << m_path << " loaded (" << segments.size() << " segments)";
+        return true;
+    }
+}
@@ -0,0 +1,220 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/crc.hpp>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <sys/types.h>
+
+
+namespace Db
+{
+    class KeySpace;
+    class KeySpaces;
+
+    /**
+     * @brief Streamed writer of snapshot
+     *
+     * Lengths are varints (LEB128), so small keys/values are compact.
+     *
+     * Entries of tables (engines) are split into segments, that can be
+     * decoded independently, and every segment has its own checksum.
+     * Index of segments is written at the end (see finish()).
+     */
+    class SnapshotWriter : boost::noncopyable
+    {
+    public:
+        SnapshotWriter(int fd);
+
+        void writeByte(char byte);
+        void writeLength(uint64_t length);
+        void writeString(const std::string &string);
+        void writeEntry(const std::string &key, const std::string &value);
+
+        /**
+         * Following entries belongs to table @engine of key-space @name,
+         * until endTable().
+         * Without it entries are not indexed (i.e. for Journal).
+         */
+        void beginTable(const std::string &name, char engine);
+        void endTable();
+
+        /**
+         * Write index of segments, and flush.
+         * Return false on IO errors (including errors of previous writes).
+         */
+        bool finish();
+        /**
+         * Flush without index (i.e. for Journal)
+         */
+        bool flush();
+
+    private:
+        enum Constants
+        {
+            BUFFER_SIZE = 1 << 20 /* 1MB */,
+            /**
+             * Segment is closed after this number of entries or bytes
+             */
+            SEGMENT_ENTRIES = 1 << 16 /* 64K */,
+            SEGMENT_SIZE = 16 << 20 /* 16MB */
+        };
+
+        struct Table
+        {
+            std::string name;
+            char engine;
+        };
+        struct Segment
+        {
+            uint64_t table;
+            uint64_t offset;
+            uint64_t size;
+            uint64_t count;
+            uint32_t crc;
+        };
+
+        int m_fd;
+        std::vector<char> m_buffer;
+        bool m_failed;
+        /**
+         * Number of bytes written (including buffered)
+         */
+        uint64_t m_offset;
+
+        std::vector<Table> m_tables;
+        std::vector<Segment> m_segments;
+        bool m_inTable;
+        /**
+         * Current segment, count is zero if it is not started yet
+         */
+        Segment m_segment;
+        boost::crc_32_type m_crc;
+
+        void write(const char *data, size_t size);
+        void endSegment();
+    };
+
+    /**
+     * @brief Reader of snapshot in memory (i.e. mmap()ed)
+     *
+     * All methods return false on malformed data.
+     */
+    class SnapshotReader : boost::noncopyable
+    {
+    public:
+        SnapshotReader(const char *begin, const char *end);
+
+        bool readByte(char &byte);
+        bool readLength(uint64_t &length);
+        bool readString(std::string &string);
+        /**
+         * Without copying, @data points into underlying memory
+         */
+        bool readString(const char *&data, uint64_t &length);
+        bool readEntry(std::string &key, std::string &value)
+        {
+            return readString(key) && readString(value);
+        }
+
+        const char *position() const
+        {
+            return m_current;
+        }
+
+    private:
+        const char *m_current;
+        const char *m_end;
+    };
+
+    /**
+     * @brief SAVE/BGSAVE/loading of snapshot of all key-spaces
+     *
+     * Format:
+     *   magic
+     *   [ 'K' <name> [ 'H' <count> <entries> ] [ 'A' <count> <entries> ] ] ...
+     *   'E'
+     *   <number of tables> [ <key-space name> <engine> ] ...
+     *   <number of segments> [ <table> <offset> <size> <count> <crc32> ] ...
+     *   <offset of 'E', 8 bytes little-endian>
+     *
+     * Segments of entries are decoded in parallel on load (see load()).
+     *
+     * Snapshot is written to temporary file, and renamed after fsync(),
+     * so there is always complete snapshot on disk.
+     *
+     * BGSAVE fork()s while shared locks of all engines are held, so child
+     * has consistent copy (copy-on-write) of all engines, and it does not
+     * use locks at all (they are in undefined state after fork()).
+     */
+    class Snapshot : boost::noncopyable
+    {
+    public:
+        static const char *MAGIC;
+
+        Snapshot(KeySpaces &keySpaces);
+
+        void setPath(const std::string &path)
+        {
+            m_path = path;
+        }
+
+        /**
+         * Synchronously, under shared locks of all engines
+         */
+        bool save();
+        /**
+         * Return false if already in progress, or fork() failed
+         */
+        bool backgroundSave();
+        bool inProgress() const
+        {
+            return m_child > 0;
+        }
+        /**
+         * Time of last successful save
+         */
+        time_t lastSave() const
+        {
+            return m_lastSave;
+        }
+
+        /**
+         * Must be called before serving.
+         * Hash tables are reserved from index, and segments are decoded
+         * and inserted in parallel (on js workers).
+         * Return false on errors (missing snapshot is not an error).
+         */
+        bool load();
+
+    private:
+        KeySpaces &m_keySpaces;
+        std::string m_path;
+        std::atomic<pid_t> m_child;
+        std::atomic<time_t> m_lastSave;
+
+        /**
+         * Write all key-spaces without locks
+         * (caller holds them, or this is forked child).
+         */
+        bool write(const std::vector<KeySpace *> &keySpaces);
+        /**
+         * Wait for child in separate thread
+         */
+        void reap(pid_t child);
+    };
+}
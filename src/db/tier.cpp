@@ -0,0 +1,185 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "tier.h"
+#include "util/log.h"
+
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+namespace Db
+{
+    std::string Tier::s_directory;
+    size_t Tier::s_minValueSize = 0;
+    uint32_t Tier::s_idleTime = 0;
+    std::atomic<uint32_t> Tier::s_now(0);
+
+    void Tier::configure(const std::string &directory,
+                         size_t minValueSize, uint32_t idleTime)
+    {
+        s_directory = directory;
+        s_minValueSize = minValueSize;
+        s_idleTime = idleTime;
+        tick();
+    }
+
+    void Tier::tick()
+    {
+        s_now.store(time(nullptr), std::memory_order_relaxed);
+    }
+
+    Tier::Tier()
+        : m_fd(-1)
+        , m_size(0)
+        , m_dead(0)
+        , m_compactedFd(-1)
+        , m_compactedSize(0)
+    {
+    }
+
+    Tier::~Tier()
+    {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+        abortCompaction();
+    }
+
+    bool Tier::read(uint64_t offset, uint32_t size, std::string &value) const
+    {
+        value.resize(size);
+
+        size_t done = 0;
+        while (done < size) {
+            ssize_t bytes = pread(m_fd, &value[done], size - done, offset + done);
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG(error) << "Can't read spilled value: " << strerror(errno);
+                value.clear();
+                return false;
+            }
+            if (!bytes) {
+                LOG(error) << "Spilled value is truncated";
+                value.clear();
+                return false;
+            }
+            done += bytes;
+        }
+        return true;
+    }
+
+    bool Tier::append(const std::string &value, uint64_t &offset)
+    {
+        if ((m_fd < 0) && ((m_fd = create()) < 0)) {
+            return false;
+        }
+
+        offset = m_size;
+        if (!writeAll(m_fd, value.data(), value.size(), offset)) {
+            LOG(error) << "Can't spill value: " << strerror(errno);
+            return false;
+        }
+        m_size += value.size();
+        return true;
+    }
+
+    void Tier::releaseAll()
+    {
+        m_dead.store(m_size);
+    }
+
+    bool Tier::needsCompaction() const
+    {
+        const uint64_t size = m_size;
+        return (size >= MIN_COMPACTION_SIZE) && ((deadSize() * 2) > size);
+    }
+
+    bool Tier::startCompaction()
+    {
+        m_compactedFd = create();
+        m_compactedSize = 0;
+        return (m_compactedFd >= 0);
+    }
+
+    bool Tier::copy(uint64_t offset, uint32_t size, uint64_t &newOffset)
+    {
+        std::string value;
+        if (!read(offset, size, value)) {
+            return false;
+        }
+
+        newOffset = m_compactedSize;
+        if (!writeAll(m_compactedFd, value.data(), value.size(), newOffset)) {
+            LOG(error) << "Can't compact spilled values: " << strerror(errno);
+            return false;
+        }
+        m_compactedSize += size;
+        return true;
+    }
+
+    void Tier::finishCompaction(uint64_t live)
+    {
+        close(m_fd);
+        m_fd = m_compactedFd;
+        m_size = m_compactedSize;
+        m_dead = (m_compactedSize - live);
+        m_compactedFd = -1;
+    }
+
+    void Tier::abortCompaction()
+    {
+        if (m_compactedFd >= 0) {
+            close(m_compactedFd);
+            m_compactedFd = -1;
+        }
+    }
+
+    int Tier::create()
+    {
+        std::string path = s_directory + "/boostcached-tier-XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+
+        int fd = mkstemp(name.data());
+        if (fd < 0) {
+            LOG(error) << "Can't create extent file in " << s_directory
+                       << ": " << strerror(errno);
+            return -1;
+        }
+        unlink(name.data());
+        return fd;
+    }
+
+    bool Tier::writeAll(int fd, const char *data, size_t size, uint64_t offset)
+    {
+        while (size) {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,172 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+
+namespace Db
+{
+    /**
+     * @brief Extent file of one engine, for cold values spilled out of memory
+     *
+     * Values are appended by TierCompactor, entry keeps only offset and
+     * size of its value (see Interface::Entry). Spilled value is read with
+     * pread() (without moving it back), and is loaded back into memory
+     * only when it is modified.
+     *
+     * Space of values that was loaded back (or deleted) is only counted,
+     * and reclaimed by compaction (see TierCompactor).
+     *
+     * File is unlinked right after creation, since values are not
+     * persistent here (Snapshot/Journal have all of them).
+     *
+     * read() does not lock: file is replaced only under exclusive lock
+     * of engine, and all reads are under its lock too.
+     */
+    class Tier : boost::noncopyable
+    {
+    public:
+        /**
+         * Must be called before any engine is used, tiering is disabled
+         * by default (empty @directory).
+         * Values of at least @minValueSize bytes, that was not accessed
+         * for @idleTime seconds are spilled.
+         */
+        static void configure(const std::string &directory,
+                              size_t minValueSize, uint32_t idleTime);
+        static bool enabled()
+        {
+            return !s_directory.empty();
+        }
+        static const std::string &directory()
+        {
+            return s_directory;
+        }
+        static size_t minValueSize()
+        {
+            return s_minValueSize;
+        }
+        static uint32_t idleTime()
+        {
+            return s_idleTime;
+        }
+
+        /**
+         * Coarse clock for access times of entries (seconds), updated by
+         * TierCompactor, so reads do not call time().
+         */
+        static uint32_t now()
+        {
+            return s_now.load(std::memory_order_relaxed);
+        }
+        static void tick();
+
+        Tier();
+        ~Tier();
+
+        /**
+         * Return false on IO errors
+         */
+        bool read(uint64_t offset, uint32_t size, std::string &value) const;
+        /**
+         * Append @value, file is created on first call.
+         * Called only by TierCompactor, without lock of engine.
+         */
+        bool append(const std::string &value, uint64_t &offset);
+        /**
+         * Space of value is not used anymore (value is loaded back or
+         * deleted)
+         */
+        void release(uint32_t size)
+        {
+            m_dead.fetch_add(size, std::memory_order_relaxed);
+        }
+        /**
+         * All values are released (i.e. engine is flushed)
+         */
+        void releaseAll();
+
+        uint64_t size() const
+        {
+            return m_size.load(std::memory_order_relaxed);
+        }
+        uint64_t deadSize() const
+        {
+            return m_dead.load(std::memory_order_relaxed);
+        }
+        /**
+         * Size of values that are still spilled
+         */
+        uint64_t liveSize() const
+        {
+            const uint64_t size = this->size();
+            const uint64_t dead = deadSize();
+            return (size > dead) ? (size - dead) : 0;
+        }
+        /**
+         * More than half of file is dead
+         */
+        bool needsCompaction() const;
+
+        /**
+         * Compaction: values that are still alive are copied into new file
+         * (without lock of engine), and then engine switches to it (under
+         * exclusive lock).
+         */
+        bool startCompaction();
+        /**
+         * Copy value from current file to new one
+         */
+        bool copy(uint64_t offset, uint32_t size, uint64_t &newOffset);
+        /**
+         * Must be called under exclusive lock of engine, after offsets
+         * of entries are updated, @live is size of values in new file that
+         * are still used.
+         */
+        void finishCompaction(uint64_t live);
+        void abortCompaction();
+
+    private:
+        enum Constants
+        {
+            /**
+             * Do not compact small files
+             */
+            MIN_COMPACTION_SIZE = 64 << 20 /* 64MB */
+        };
+
+        static std::string s_directory;
+        static size_t s_minValueSize;
+        static uint32_t s_idleTime;
+        static std::atomic<uint32_t> s_now;
+
+        int m_fd;
+        std::atomic<uint64_t> m_size;
+        std::atomic<uint64_t> m_dead;
+
+        /**
+         * New file, while compaction is in progress
+         */
+        int m_compactedFd;
+        uint64_t m_compactedSize;
+
+        /**
+         * Return -1 on errors
+         */
+        static int create();
+        static bool writeAll(int fd, const char *data, size_t size, uint64_t offset);
+    };
+}
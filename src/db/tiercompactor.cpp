@@ -0,0 +1,231 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "tiercompactor.h"
+#include "keyspace.h"
+#include "util/log.h"
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <limits>
+
+
+namespace Db
+{
+    TierCompactor::TierCompactor(KeySpaces &keySpaces)
+        : m_keySpaces(keySpaces)
+        , m_stopped(true)
+    {
+    }
+
+    TierCompactor::~TierCompactor()
+    {
+        stop();
+    }
+
+    void TierCompactor::start()
+    {
+        m_stopped = false;
+        m_thread = std::thread(&TierCompactor::run, this);
+    }
+
+    void TierCompactor::stop()
+    {
+        if (!m_thread.joinable()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopped = true;
+        }
+        m_stoppedCondition.notify_one();
+        m_thread.join();
+    }
+
+    void TierCompactor::run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (unsigned seconds = 1; !m_stopped; ++seconds) {
+            m_stoppedCondition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return m_stopped; });
+            if (m_stopped) {
+                break;
+            }
+
+            Tier::tick();
+            if (seconds % SCAN_INTERVAL) {
+                continue;
+            }
+
+            lock.unlock();
+            scan();
+            lock.lock();
+        }
+    }
+
+    void TierCompactor::scan()
+    {
+        // Key-spaces are never destroyed, so registry lock is not needed
+        std::vector<KeySpace *> keySpaces;
+        m_keySpaces.forEach([&keySpaces] (KeySpace &keySpace)
+        {
+            keySpaces.push_back(&keySpace);
+        });
+
+        for (KeySpace *keySpace : keySpaces) {
+            spill(keySpace->hashTable());
+            compact(keySpace->hashTable());
+            spill(keySpace->avlTree());
+            compact(keySpace->avlTree());
+        }
+    }
+
+    template <class Engine>
+    void TierCompactor::spill(Engine &engine)
+    {
+        struct Candidate
+        {
+            Interface::Key key;
+            Interface::Version version;
+            Interface::Value value;
+            uint32_t size;
+            uint64_t offset;
+        };
+
+        const uint32_t now = Tier::now();
+        const size_t minValueSize = Tier::minValueSize();
+        const uint32_t idleTime = Tier::idleTime();
+        Tier &tier = engine.tier();
+
+        bool more = true;
+        while (more) {
+            std::vector<Candidate> candidates;
+            size_t size = 0;
+            more = false;
+
+            {
+                // get shared lock
+                SharedLock lock(engine.mutex());
+
+                engine.forEachEntry([&] (const Interface::Key &key, Interface::Entry &entry)
+                {
+                    if (entry.spilled() ||
+                        (entry.value.size() < minValueSize) ||
+                        (entry.value.size() > std::numeric_limits<uint32_t>::max()) ||
+                        ((now - entry.accessed.load(std::memory_order_relaxed)) < idleTime)) {
+                        return true;
+                    }
+                    if (size >= MAX_SPILL_BATCH_SIZE) {
+                        more = true;
+                        return false;
+                    }
+                    candidates.push_back({ key, entry.version, entry.value,
+                                           (uint32_t)entry.value.size(), 0 });
+                    size += entry.value.size();
+                    return true;
+                });
+            }
+            if (candidates.empty()) {
+                return;
+            }
+
+            size_t written = 0;
+            for (; written < candidates.size(); ++written) {
+                Candidate &candidate = candidates[written];
+                if (!tier.append(candidate.value, candidate.offset)) {
+                    more = false;
+                    break;
+                }
+                // Do not hold two copies till the end of batch
+                Interface::Value().swap(candidate.value);
+            }
+
+            // get exclusive lock
+            ExclusiveLock lock(engine.mutex());
+
+            for (size_t i = 0; i < written; ++i) {
+                const Candidate &candidate = candidates[i];
+
+                Interface::Entry *entry = engine.findEntry(candidate.key);
+                if (!entry || (entry->version != candidate.version) || entry->spilled()) {
+                    tier.release(candidate.size);
+                    continue;
+                }
+                entry->spilledOffset = candidate.offset;
+                entry->spilledSize = candidate.size;
+                Interface::Value().swap(entry->value);
+            }
+        }
+    }
+
+    template <class Engine>
+    void TierCompactor::compact(Engine &engine)
+    {
+        struct Spilled
+        {
+            Interface::Key key;
+            Interface::Version version;
+            uint64_t offset;
+            uint32_t size;
+            uint64_t newOffset;
+        };
+
+        Tier &tier = engine.tier();
+        if (!tier.needsCompaction()) {
+            return;
+        }
+
+        std::vector<Spilled> spilled;
+        {
+            // get shared lock
+            SharedLock lock(engine.mutex());
+
+            engine.forEachEntry([&spilled] (const Interface::Key &key, Interface::Entry &entry)
+            {
+                if (entry.spilled()) {
+                    spilled.push_back({ key, entry.version,
+                                        entry.spilledOffset, entry.spilledSize, 0 });
+                }
+                return true;
+            });
+        }
+
+        LOG(info) << "Compacting extent file (" << tier.size() << " bytes, "
+                  << tier.deadSize() << " are not used)";
+
+        if (!tier.startCompaction()) {
+            return;
+        }
+        for (Spilled &value : spilled) {
+            if (!tier.copy(value.offset, value.size, value.newOffset)) {
+                tier.abortCompaction();
+                return;
+            }
+        }
+
+        // get exclusive lock
+        ExclusiveLock lock(engine.mutex());
+
+        uint64_t live = 0;
+        for (const Spilled &value : spilled) {
+            Interface::Entry *entry = engine.findEntry(value.key);
+            if (!entry || (entry->version != value.version) ||
+                !entry->spilled() || (entry->spilledOffset != value.offset)) {
+                continue;
+            }
+            entry->spilledOffset = value.newOffset;
+            live += value.size;
+        }
+        tier.finishCompaction(live);
+    }
+}
@@ -0,0 +1,72 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+
+namespace Db
+{
+    class KeySpaces;
+
+    /**
+     * @brief Background thread, that moves cold values of all engines to
+     * their extent files, and compacts these files (see Tier)
+     *
+     * Both are done in three steps, to hold exclusive lock of engine only
+     * for updating of entries:
+     * - collect candidates under shared lock
+     * - write/copy values without lock
+     * - update entries under exclusive lock, entries that was modified
+     *   meanwhile (version is changed) are skipped
+     */
+    class TierCompactor : boost::noncopyable
+    {
+    public:
+        TierCompactor(KeySpaces &keySpaces);
+        ~TierCompactor();
+
+        void start();
+        void stop();
+
+    private:
+        enum Constants
+        {
+            /**
+             * Engines are scanned for cold values every SCAN_INTERVAL
+             * seconds, clock of access times is updated every second
+             */
+            SCAN_INTERVAL = 10,
+            /**
+             * Max size of values, that are copied out of engine at once
+             */
+            MAX_SPILL_BATCH_SIZE = 64 << 20 /* 64MB */
+        };
+
+        KeySpaces &m_keySpaces;
+        bool m_stopped;
+        std::mutex m_mutex;
+        std::condition_variable m_stoppedCondition;
+        std::thread m_thread;
+
+        void run();
+        void scan();
+
+        template <class Engine>
+        void spill(Engine &engine);
+        template <class Engine>
+        void compact(Engine &engine);
+    };
+}
@@ -0,0 +1,104 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "clients.h"
+
+#include <boost/format.hpp>
+
+
+Clients::Client::Client()
+    : id(0)
+    , worker(0)
+    , created(time(nullptr))
+    , lastInteraction(created)
+    , bytesIn(0)
+    , bytesOut(0)
+    , commands(0)
+    , inputBuffer(0)
+    , outputBuffer(0)
+{
+}
+
+Clients::Clients()
+    : m_nextId(1)
+{
+}
+
+void Clients::add(Client &client)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    client.id = m_nextId++;
+    m_clients[client.id] = &client;
+}
+
+void Clients::remove(Client &client)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_clients.erase(client.id);
+}
+
+std::string Clients::list() const
+{
+    const time_t now = time(nullptr);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::string list;
+    for (const auto &idClient : m_clients) {
+        const Client &client = *idClient.second;
+        list += str(boost::format("id=%i addr=%s worker=%i age=%i idle=%i cmd=%i "
+                                  "in=%i out=%i qbuf=%i obuf=%i\n")
+                    % client.id
+                    % client.address
+                    % client.worker
+                    % (now - client.created)
+                    % (now - client.lastInteraction.load(std::memory_order_relaxed))
+                    % client.commands.load(std::memory_order_relaxed)
+                    % client.bytesIn.load(std::memory_order_relaxed)
+                    % client.bytesOut.load(std::memory_order_relaxed)
+                    % client.inputBuffer.load(std::memory_order_relaxed)
+                    % client.outputBuffer.load(std::memory_order_relaxed));
+    }
+    return list;
+}
+
+size_t Clients::kill(const std::string &address, uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    size_t killed = 0;
+    for (const auto &idClient : m_clients) {
+        const Client &client = *idClient.second;
+        if (address.size() ? (client.address != address) : (client.id != id)) {
+            continue;
+        }
+
+        // Connection can be closed by itself before handler is called
+        const uint64_t clientId = client.id;
+        client.post([this, clientId] ()
+        {
+            close(clientId);
+        });
+        ++killed;
+    }
+    return killed;
+}
+
+void Clients::close(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::map<uint64_t, Client *>::const_iterator found = m_clients.find(id);
+    if (found != m_clients.end()) {
+        found->second->close();
+    }
+}
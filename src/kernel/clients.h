@@ -0,0 +1,118 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <string>
+#include <cstdint>
+#include <ctime>
+
+
+/**
+ * @brief Registry of connections (CLIENT LIST/KILL)
+ *
+ * Every connection (see Session) owns its Client, counters of it are
+ * written only by worker thread of connection (without atomic
+ * read-modify-write), and read by CLIENT LIST from any thread.
+ *
+ * Connection is closed only in its worker thread (see Client::post),
+ * so it can't be freed while it is closed.
+ *
+ * There must be only one instance (see Commands::clients()).
+ */
+class Clients : boost::noncopyable
+{
+public:
+    typedef std::function<void()> Handler;
+
+    struct Client : boost::noncopyable
+    {
+        /**
+         * Set by add()
+         */
+        uint64_t id;
+        std::string address;
+        /**
+         * Index of io_service of connection (see IoServicePool)
+         */
+        size_t worker;
+        time_t created;
+        std::atomic<time_t> lastInteraction;
+
+        std::atomic<uint64_t> bytesIn;
+        std::atomic<uint64_t> bytesOut;
+        std::atomic<uint64_t> commands;
+        /**
+         * Memory held by unparsed input (capacity, not size, since
+         * buffer is not shrinked after huge pipelines)
+         */
+        std::atomic<uint64_t> inputBuffer;
+        /**
+         * Reply that is not written yet
+         */
+        std::atomic<uint64_t> outputBuffer;
+
+        /**
+         * Run handler in worker thread of connection
+         */
+        std::function<void(const Handler &)> post;
+        /**
+         * Close socket, called only in worker thread of connection,
+         * connection removes itself when pending operations are aborted.
+         */
+        Handler close;
+
+        Client();
+
+        /**
+         * Only for the thread of connection
+         */
+        static void increment(std::atomic<uint64_t> &counter, uint64_t value)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + value,
+                          std::memory_order_relaxed);
+        }
+        void touch()
+        {
+            lastInteraction.store(time(nullptr), std::memory_order_relaxed);
+        }
+    };
+
+    Clients();
+
+    void add(Client &client);
+    void remove(Client &client);
+
+    /**
+     * "id=<id> addr=<address> worker=<n> ..." line for every connection
+     */
+    std::string list() const;
+    /**
+     * Return number of connections that are closed, @address is empty
+     * for kill by @id and vice versa.
+     */
+    size_t kill(const std::string &address, uint64_t id);
+
+private:
+    uint64_t m_nextId;
+    std::map<uint64_t, Client *> m_clients;
+    mutable std::mutex m_mutex;
+
+    /**
+     * In worker thread of connection
+     */
+    void close(uint64_t id);
+};
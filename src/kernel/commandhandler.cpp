@@ -12,9 +12,13 @@
 
 #include "commands.h"
 #include "util/log.h"
+#include "util/probes.h"
 
 #include <boost/format.hpp>
+#include <chrono>
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
 
 
 const char *CommandHandler::REPLY_FALSE              = ":0\r\n";
@@ -23,12 +27,21 @@ const char *CommandHandler::REPLY_NIL                = "$-1\r\n";
 const char *CommandHandler::REPLY_OK                 = "+OK\r\n";
 const char *CommandHandler::REPLY_ERROR              = "-ERR\r\n";
 const char *CommandHandler::REPLY_ERROR_NOTSUPPORTED = "-ERR Not supported\r\n";
+const char *CommandHandler::REPLY_DEFERRED           = "";
 
 
 std::string CommandHandler::toReplyString(const std::string &string)
 {
     return str(boost::format("$%i\r\n%s\r\n") % string.size() % string);
 }
+std::string CommandHandler::toReplyString(const char *data, size_t size)
+{
+    std::string reply = str(boost::format("$%i\r\n") % size);
+    reply.reserve(reply.size() + size + 2);
+    reply.append(data, size);
+    reply.append("\r\n", 2);
+    return reply;
+}
 std::string CommandHandler::toErrorReplyString(const std::string &string)
 {
     return str(boost::format("-ERR %s\r\n") % string);
@@ -37,8 +50,85 @@ std::string CommandHandler::toInlineReplyString(const std::string &string)
 {
     return str(boost::format("+%s\r\n") % string);
 }
+std::string CommandHandler::toIntegerReplyString(long long integer)
+{
+    return str(boost::format(":%i\r\n") % integer);
+}
+std::string CommandHandler::toMultiBulkReplyString(const std::vector<std::string> &replies)
+{
+    std::string reply = str(boost::format("*%i\r\n") % replies.size());
+    for (const std::string &element : replies) {
+        reply += element;
+    }
+    return reply;
+}
+
+bool CommandHandler::toInteger(const std::string &string, long long &integer)
+{
+    if (string.empty()) {
+        return false;
+    }
+
+    const char *begin = string.c_str();
+    char *end;
+    errno = 0;
+    integer = strtoll(begin, &end, 10);
+    return !errno && (end == (begin + string.size()));
+}
 
 
+CommandHandler::CommandHandler()
+    : m_keySpace(&TheCommands::instance().keySpaces().defaultKeySpace())
+    , m_finished(true)
+{
+    reset();
+}
+
+void CommandHandler::post(const Handler &handler)
+{
+    if (!m_postCallback) {
+        handler();
+        return;
+    }
+    m_postCallback(handler);
+}
+
+void CommandHandler::finish(const std::string &reply)
+{
+    m_finished = true;
+    for (const Handler &handler : m_finishHandlers) {
+        handler();
+    }
+    m_finishHandlers.clear();
+
+    // With FSYNC_ALWAYS reply after records of command are synced,
+    // without blocking the worker
+    bool deferred = TheCommands::instance().journal().commit([this, reply] ()
+    {
+        post([this, reply] () { m_finishCallback(reply); });
+    });
+    if (!deferred) {
+        m_finishCallback(reply);
+    }
+}
+
+void CommandHandler::atFinish(const Handler &handler)
+{
+    if (m_finished) {
+        handler();
+        return;
+    }
+    m_finishHandlers.push_back(handler);
+}
+
+int CommandHandler::detach()
+{
+    if (!m_detachCallback) {
+        return -1;
+    }
+    return m_detachCallback();
+}
+
 bool CommandHandler::feedAndParseCommand(const char *buffer, size_t size)
 {
     m_commandString.append(buffer, size);
@@ -49,7 +139,7 @@ bool CommandHandler::feedAndParseCommand(const char *buffer, size_t size)
 
     const char *begin = &m_commandString.c_str()[ m_commandOffset ];
     const char *end   = &m_commandString.c_str()[ m_commandString.size() ];
-    if (!begin) {
+    if (begin == end) {
         LOG(trace) << "Parse: need more data, for " << this;
         return true;
     }
@@ -58,6 +148,10 @@ bool CommandHandler::feedAndParseCommand(const char *buffer, size_t size)
     if (m_numberOfArguments < 0) {
         // We have inline request, because it is not start with '*'
         if (*begin != '*') {
+            if (!memchr((const void *)begin, '\n', end - begin)) {
+                LOG(trace) << "Inline: need more data, for " << this;
+                return true;
+            }
             if (!parseInline(begin, end)) {
                 reset();
                 return true;
@@ -73,6 +167,7 @@ bool CommandHandler::feedAndParseCommand(const char *buffer, size_t size)
         return true;
     }
 
+    PROBE2(parse__complete, this, m_commandArguments.size());
     executeCommand();
     return false;
 }
@@ -86,7 +181,7 @@ bool CommandHandler::parseInline(const char *begin, const char *end)
         LOG(debug) << "LF not found, for " << this;
         return false;
     }
-    m_commandOffset += (lfPtr - begin);
+    m_commandOffset += (lfPtr - begin + 1 /* LF */);
 
     // trim
     if (*(lfPtr-1) == '\r') {
@@ -186,13 +281,62 @@ void CommandHandler::executeCommand()
      */
 
     Commands &commands = TheCommands::instance();
-    m_finishCallback((commands.find(m_commandArguments[0],
-                                    m_commandArguments.size() - 1))
+    const std::string &name = m_commandArguments[0];
+    const int numberOfArguments = m_commandArguments.size() - 1;
+
+    if (m_transaction.isActive()) {
+        const Commands::CallbackInfo *info = commands.lookup(name, numberOfArguments);
+        if (!info || !(info->flags & Commands::TRANSACTION_CONTROL)) {
+            m_finishCallback(m_transaction.queue(m_commandArguments, *this));
+            next();
+            return;
+        }
+    }
+
+    SlowLog &slowLog = commands.slowLog();
+    std::chrono::steady_clock::time_point start;
+    if (slowLog.enabled()) {
+        start = std::chrono::steady_clock::now();
+    }
+
+    const size_t keyLength = (numberOfArguments ? m_commandArguments[1].size() : 0);
+    PROBE3(command__start, this, name.c_str(), keyLength);
+
+    m_finished = false;
+
+    std::string reply = (commands.find(name, numberOfArguments))
     (
-         m_commandArguments
-    ));
+         m_commandArguments, *this
+    );
 
-    reset();
+    PROBE3(command__done, this, name.c_str(), keyLength);
+
+    if (slowLog.enabled()) {
+        if (reply.empty() /* REPLY_DEFERRED */) {
+            // Arguments are not available after command returned
+            const Arguments arguments(m_commandArguments);
+            const std::string address(m_address);
+            atFinish([&slowLog, arguments, address, start] ()
+            {
+                slowLog.check(arguments, address,
+                              std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - start).count());
+            });
+        } else {
+            slowLog.check(m_commandArguments, m_address,
+                          std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    /**
+     * Deferred reply (see finish()) can be already sent, and arguments
+     * must not be used by command after it returned.
+     */
+    if (!reply.empty()) {
+        finish(reply);
+    }
+
+    next();
 }
 
 std::string CommandHandler::toString() const
@@ -213,8 +357,19 @@ std::string CommandHandler::toString() const
 
 void CommandHandler::reset()
 {
-    m_type = NOT_SET;
     m_commandString.clear();
+    resetCommand();
+}
+
+void CommandHandler::next()
+{
+    m_commandString.erase(0, m_commandOffset);
+    resetCommand();
+}
+
+void CommandHandler::resetCommand()
+{
+    m_type = NOT_SET;
     m_commandOffset = 0;
     m_numberOfArguments = -1;
     m_numberOfArgumentsLeft = -1;
@@ -10,11 +10,18 @@
 
 #pragma once
 
+#include "transaction.h"
+
 #include <string>
 #include <vector>
 #include <functional>
 #include <boost/noncopyable.hpp>
 
+namespace Db
+{
+    class KeySpace;
+}
+
 /**
  * @brief Protocol format (based on redis protocol):
  * (@see http://redis.io/topics/protocol)
@@ -48,6 +55,9 @@ class CommandHandler : boost::noncopyable
 {
 public:
     typedef std::function<void(const std::string&)> FinishCallback;
+    typedef std::function<void()> Handler;
+    typedef std::function<void(const Handler&)> PostCallback;
+    typedef std::function<int()> DetachCallback;
     typedef std::vector<std::string> Arguments;
 
     /**
@@ -69,30 +79,122 @@ public:
      * Use this for non implemented _yet_ stuff
      */
     static const char *REPLY_ERROR_NOTSUPPORTED;
+    /**
+     * Command will send reply later, using finish()
+     */
+    static const char *REPLY_DEFERRED;
 
 
     /**
      * TODO: optimize
      */
     static std::string toReplyString(const std::string &string);
+    /**
+     * Without intermediate string (i.e. for mmapped values)
+     */
+    static std::string toReplyString(const char *data, size_t size);
     static std::string toInlineReplyString(const std::string &string);
     static std::string toErrorReplyString(const std::string &string);
+    static std::string toIntegerReplyString(long long integer);
+    /**
+     * @replies must be already formatted replies
+     */
+    static std::string toMultiBulkReplyString(const std::vector<std::string> &replies);
 
-    CommandHandler()
-    {
-        reset();
-    }
+    /**
+     * Parse whole @string as signed decimal integer.
+     * Return false if it is not an integer or it is out of range.
+     */
+    static bool toInteger(const std::string &string, long long &integer);
+
+    CommandHandler();
 
     void setFinishCallback(FinishCallback callback)
     {
         m_finishCallback = callback;
     }
+    void setPostCallback(PostCallback callback)
+    {
+        m_postCallback = callback;
+    }
+    void setDetachCallback(DetachCallback callback)
+    {
+        m_detachCallback = callback;
+    }
+    /**
+     * Address of client (i.e. "127.0.0.1:12345"), for SLOWLOG
+     */
+    void setAddress(const std::string &address)
+    {
+        m_address = address;
+    }
+    const std::string &address() const
+    {
+        return m_address;
+    }
 
     /**
-     * Return true if need it is not the end of command,
-     * and need to feed more data.
+     * Run @handler later, in the event loop of this connection
+     * (or right now, if there is no event loop).
+     *
+     * Used by long commands to yield between steps.
+     * Connection will not read next command, until finish() is called.
+     */
+    void post(const Handler &handler);
+    /**
+     * Send reply of command, that returned REPLY_DEFERRED
+     * (with FSYNC_ALWAYS journal, reply is posted after it is synced)
+     */
+    void finish(const std::string &reply);
+    /**
+     * Call @handler when reply of current command is sent with finish(),
+     * or right now if it is already sent (i.e. first chunk of HFOR was
+     * the last one).
+     * Used to measure commands that returned REPLY_DEFERRED.
+     */
+    void atFinish(const Handler &handler);
+    /**
+     * Return duplicate of socket of this connection, for commands that
+     * take it over (i.e. PSYNC), or -1 if there is no socket.
+     * Such command replies REPLY_DEFERRED, and calls finish() when it
+     * done with socket (after shutdown() of it).
+     */
+    int detach();
+
+    /**
+     * Key-space selected for this connection
+     */
+    Db::KeySpace &keySpace()
+    {
+        return *m_keySpace;
+    }
+    void selectKeySpace(Db::KeySpace &keySpace)
+    {
+        m_keySpace = &keySpace;
+    }
+
+    Transaction &transaction()
+    {
+        return m_transaction;
+    }
+
+    /**
+     * Return true if it is not the end of command, and need to feed more data.
+     * Return false if command was executed, the rest of @buffer is kept
+     * for the next call (that can be without new data, see hasPendingInput())
      */
     bool feedAndParseCommand(const char *buffer, size_t size);
+    bool hasPendingInput() const
+    {
+        return !m_commandString.empty();
+    }
+    /**
+     * Memory held by input that is not parsed yet
+     */
+    size_t bufferCapacity() const
+    {
+        return m_commandString.capacity();
+    }
 
 private:
     enum Type {
@@ -111,10 +213,22 @@ private:
     int m_lastArgumentLength;
     Arguments m_commandArguments;
 
+    Db::KeySpace *m_keySpace;
+    Transaction m_transaction;
+    std::string m_address;
+
     /**
      * This callback will be called with result of executed command
      */
     FinishCallback m_finishCallback;
+    PostCallback m_postCallback;
+    DetachCallback m_detachCallback;
+    /**
+     * Reply of current command is sent, otherwise handlers of atFinish()
+     * are waiting for it
+     */
+    bool m_finished;
+    std::vector<Handler> m_finishHandlers;
 
 
     /**
@@ -140,10 +254,15 @@ private:
     void executeCommand();
     std::string toString() const;
     /**
-     * Reset internal structures
-     * i.e. "Connection failover"
+     * Reset internal structures, and drop all input
+     * i.e. "Connection failover" (malformed input)
      */
     void reset();
+    /**
+     * Drop executed command, and keep the rest of input (pipelined commands)
+     */
+    void next();
+    void resetCommand();
 
     static void split(const char *begin, const char *end,
                       std::vector<std::string>& destination, char delimiter = ' ');
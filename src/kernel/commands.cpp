@@ -9,15 +9,60 @@
  */
 
 #include "commands.h"
+#include "replication.h"
 #include "util/compiler.h"
 #include "util/version.h"
+#include "server/jsvm.h"
+#include "exception.h"
 
 #include <boost/format.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <unistd.h>
 
 namespace PlaceHolders = std::placeholders;
 
-#define ADD_COMMAND(callback, objectPtr, argsNum) \
-    CallbackInfo(std::bind(callback, objectPtr, PlaceHolders::_1), argsNum);
+namespace
+{
+    /**
+     * Size of keys and in-memory values of engine
+     */
+    template <class Engine>
+    uint64_t dataSize(Engine &engine)
+    {
+        // get shared lock
+        Db::SharedLock lock(engine.mutex());
+
+        uint64_t size = 0;
+        engine.forEachEntry([&size] (const Db::Interface::Key &key, Db::Interface::Entry &entry)
+        {
+            size += (key.size() + entry.value.size());
+            return true;
+        });
+        return size;
+    }
+}
+
+const char *Commands::REPLY_ERROR_NOSCRIPT = "-NOSCRIPT No matching script. Please use SCRIPT LOAD.\r\n";
+
+/**
+ * Arguments after objectPtr: number of arguments, [ flags ]
+ */
+#define ADD_COMMAND(callback, objectPtr, ...) \
+    CallbackInfo(std::bind(callback, objectPtr, PlaceHolders::_1), __VA_ARGS__);
+/**
+ * For commands, that need connection state (i.e. CommandHandler)
+ */
+#define ADD_HANDLER_COMMAND(callback, objectPtr, ...) \
+    CallbackInfo(std::bind(callback, objectPtr, PlaceHolders::_1, PlaceHolders::_2), __VA_ARGS__);
+/**
+ * Arguments after argsNum: additional flags
+ */
+#define ADD_HASHTABLE_COMMAND(method, argsNum, flags) \
+    CallbackInfo(std::bind(&Commands::onHashTable, method, PlaceHolders::_1, PlaceHolders::_2), \
+                 argsNum, HASHTABLE | (flags));
+#define ADD_AVLTREE_COMMAND(method, argsNum, flags) \
+    CallbackInfo(std::bind(&Commands::onAvlTree, method, PlaceHolders::_1, PlaceHolders::_2), \
+                 argsNum, AVLTREE | (flags));
 
 Commands::Callback Commands::find(const std::string &commandName,
                                   int numberOfArguments) const
@@ -34,14 +79,43 @@ Commands::Callback Commands::find(const std::string &commandName,
         return std::bind(malformedArgumentsCallback,
                          PlaceHolders::_1, numberOfArguments, expectedArguments);
     }
+    if (m_readOnly && (command->second.flags & WRITE)) {
+        return std::bind(&Commands::readOnlyCallback, PlaceHolders::_1);
+    }
 
     return command->second.callback;
 }
 
+const Commands::CallbackInfo *Commands::lookup(const std::string &commandName,
+                                               int numberOfArguments) const
+{
+    HashTable::const_iterator command = m_commands.find(commandName);
+
+    if (command == m_commands.end()) {
+        return nullptr;
+    }
+
+    const int expectedArguments = command->second.numberOfArguments;
+    if ((expectedArguments >= 0) && (expectedArguments != numberOfArguments)) {
+        return nullptr;
+    }
+
+    return &command->second;
+}
+
 Commands::Commands()
+    : m_readOnly(false)
+    , m_keySpaces(m_journal)
+    , m_snapshot(m_keySpaces)
 {
     addGenericCommands();
     addDbCommands();
+    addKeySpaceCommands();
+    addTransactionCommands();
+    addScriptCommands();
+    addPersistenceCommands();
+    addReplicationCommands();
+    wrapCommands();
 }
 
 void Commands::addGenericCommands()
@@ -54,20 +128,164 @@ void Commands::addGenericCommands()
      * @TODO: somehow told which optional arguments command have
      */
     m_commands["VERSION"]  = ADD_COMMAND(&Commands::version, this, -1);
+    /**
+     * -1 because of optional section
+     */
+    m_commands["INFO"]     = ADD_COMMAND(&Commands::info, this, -1,
+                                         NO_TRANSACTION);
+    m_commands["SLOWLOG"]  = ADD_COMMAND(&Commands::slowLogQuery, this, -1);
+    m_commands["CLIENT"]   = ADD_COMMAND(&Commands::client, this, -1,
+                                         NO_TRANSACTION);
 }
 
 void Commands::addDbCommands()
 {
     /* hashtable */
-    m_commands["HGET"] =   ADD_COMMAND(&Db::HashTable::get, &m_dbHashTable, 1);
-    m_commands["HSET"] =   ADD_COMMAND(&Db::HashTable::set, &m_dbHashTable, 2);
-    m_commands["HDEL"] =   ADD_COMMAND(&Db::HashTable::del, &m_dbHashTable, 1);
-    m_commands["HFOR"] =   ADD_COMMAND(&Db::HashTable::foreach, &m_dbHashTable, 1);
+    m_commands["HGET"] =      ADD_HASHTABLE_COMMAND(&Db::HashTable::get, 1, 0);
+    m_commands["HSET"] =      ADD_HASHTABLE_COMMAND(&Db::HashTable::set, 2, WRITE);
+    m_commands["HDEL"] =      ADD_HASHTABLE_COMMAND(&Db::HashTable::del, 1, WRITE);
+    /**
+     * -1 because of optional ATOMIC/CHUNK arguments
+     */
+    m_commands["HFOR"] =      ADD_HANDLER_COMMAND(&Commands::hashTableForeach, this, -1,
+                                                  HASHTABLE | WRITE);
+    /**
+     * -1 because of optional initial accumulator
+     */
+    m_commands["HREDUCE"] =   ADD_HASHTABLE_COMMAND(&Db::HashTable::reduce, -1, 0);
+    m_commands["HAPPEND"] =   ADD_HASHTABLE_COMMAND(&Db::HashTable::append, 2, WRITE);
+    m_commands["HGETRANGE"] = ADD_HASHTABLE_COMMAND(&Db::HashTable::getRange, 3, 0);
+    m_commands["HSETRANGE"] = ADD_HASHTABLE_COMMAND(&Db::HashTable::setRange, 3, WRITE);
+    m_commands["HSTRLEN"] =   ADD_HASHTABLE_COMMAND(&Db::HashTable::length, 1, 0);
+    m_commands["HGETV"] =     ADD_HASHTABLE_COMMAND(&Db::HashTable::getVersioned, 1, 0);
+    m_commands["HCAS"] =      ADD_HASHTABLE_COMMAND(&Db::HashTable::compareAndSet, 3, WRITE);
     /* avltree */
-    m_commands["ATGET"] =  ADD_COMMAND(&Db::AvlTree::get, &m_dbAvlTree, 1);
-    m_commands["ATSET"] =  ADD_COMMAND(&Db::AvlTree::set, &m_dbAvlTree, 2);
-    m_commands["ATDEL"] =  ADD_COMMAND(&Db::AvlTree::del, &m_dbAvlTree, 1);
-    m_commands["ATFOR"] =  ADD_COMMAND(&Db::AvlTree::foreach, &m_dbAvlTree, 1);
+    m_commands["ATGET"] =      ADD_AVLTREE_COMMAND(&Db::AvlTree::get, 1, 0);
+    m_commands["ATSET"] =      ADD_AVLTREE_COMMAND(&Db::AvlTree::set, 2, WRITE);
+    m_commands["ATDEL"] =      ADD_AVLTREE_COMMAND(&Db::AvlTree::del, 1, WRITE);
+    m_commands["ATFOR"] =      ADD_HANDLER_COMMAND(&Commands::avlTreeForeach, this, -1,
+                                                   AVLTREE | WRITE);
+    m_commands["ATREDUCE"] =   ADD_AVLTREE_COMMAND(&Db::AvlTree::reduce, -1, 0);
+    m_commands["ATAPPEND"] =   ADD_AVLTREE_COMMAND(&Db::AvlTree::append, 2, WRITE);
+    m_commands["ATGETRANGE"] = ADD_AVLTREE_COMMAND(&Db::AvlTree::getRange, 3, 0);
+    m_commands["ATSETRANGE"] = ADD_AVLTREE_COMMAND(&Db::AvlTree::setRange, 3, WRITE);
+    m_commands["ATSTRLEN"] =   ADD_AVLTREE_COMMAND(&Db::AvlTree::length, 1, 0);
+    m_commands["ATGETV"] =     ADD_AVLTREE_COMMAND(&Db::AvlTree::getVersioned, 1, 0);
+    m_commands["ATCAS"] =      ADD_AVLTREE_COMMAND(&Db::AvlTree::compareAndSet, 3, WRITE);
+}
+
+void Commands::addKeySpaceCommands()
+{
+    m_commands["SELECT"] =    ADD_HANDLER_COMMAND(&Commands::select, this, 1,
+                                                  NO_TRANSACTION);
+    m_commands["FLUSHDB"] =   ADD_HANDLER_COMMAND(&Commands::flushKeySpace, this, 0,
+                                                  HASHTABLE | AVLTREE | WRITE);
+    /**
+     * Takes locks of all key-spaces, one by one.
+     */
+    m_commands["KEYSPACES"] = ADD_COMMAND(&Commands::keySpacesList, this, 0,
+                                          NO_TRANSACTION);
+    /**
+     * -1 because of optional count (or RESET)
+     */
+    m_commands["HOTKEYS"] =   ADD_HANDLER_COMMAND(&Commands::hotKeys, this, -1,
+                                                  NO_TRANSACTION);
+}
+
+void Commands::addTransactionCommands()
+{
+    m_commands["MULTI"] =   ADD_HANDLER_COMMAND(&Commands::multi, this, 0,
+                                                TRANSACTION_CONTROL);
+    m_commands["EXEC"] =    ADD_HANDLER_COMMAND(&Commands::exec, this, 0,
+                                                TRANSACTION_CONTROL);
+    m_commands["DISCARD"] = ADD_HANDLER_COMMAND(&Commands::discard, this, 0,
+                                                TRANSACTION_CONTROL);
+    m_commands["WATCH"] =   ADD_HANDLER_COMMAND(&Commands::watch, this, -1,
+                                                TRANSACTION_CONTROL);
+    m_commands["UNWATCH"] = ADD_HANDLER_COMMAND(&Commands::unwatch, this, 0,
+                                                TRANSACTION_CONTROL);
+}
+
+void Commands::addScriptCommands()
+{
+    /**
+     * LOAD <script> | EXISTS <sha1> ... | FLUSH
+     */
+    m_commands["SCRIPT"] =     ADD_COMMAND(&Commands::script, this, -1,
+                                           NO_TRANSACTION);
+    /**
+     * <sha1> <numkeys> [ key ... ] [ arg ... ]
+     */
+    m_commands["HEVALSHA"] =   ADD_HANDLER_COMMAND(&Commands::hashTableEvalSha, this, -1,
+                                                   HASHTABLE | WRITE);
+    m_commands["ATEVALSHA"] =  ADD_HANDLER_COMMAND(&Commands::avlTreeEvalSha, this, -1,
+                                                   AVLTREE | WRITE);
+}
+
+void Commands::addPersistenceCommands()
+{
+    /**
+     * Takes shared locks of all engines of all key-spaces at once,
+     * BGSAVE only for fork().
+     */
+    m_commands["SAVE"] =     ADD_COMMAND(&Commands::save, this, 0,
+                                         NO_TRANSACTION);
+    m_commands["BGSAVE"] =   ADD_COMMAND(&Commands::backgroundSave, this, 0,
+                                         NO_TRANSACTION);
+    m_commands["LASTSAVE"] = ADD_COMMAND(&Commands::lastSave, this, 0,
+                                         NO_TRANSACTION);
+    m_commands["BGREWRITEJOURNAL"] = ADD_COMMAND(&Commands::rewriteJournal, this, 0,
+                                                 NO_TRANSACTION);
+}
+
+void Commands::addReplicationCommands()
+{
+    /**
+     * <replication id> <offset>, takes over connection
+     */
+    m_commands["PSYNC"] = ADD_HANDLER_COMMAND(&Commands::psync, this, 2,
+                                              NO_TRANSACTION);
+}
+
+void Commands::wrapCommands()
+{
+    for (HashTable::value_type &command : m_commands) {
+        CallbackInfo &info = command.second;
+
+        WrappedCommand wrapped = {
+            info.callback,
+            m_stats.addCommand(command.first),
+            (info.flags & WRITE) != 0,
+            (info.flags & (HASHTABLE | AVLTREE)) != 0
+        };
+        m_wrappedCommands.push_back(wrapped);
+
+        const WrappedCommand *original = &m_wrappedCommands.back();
+        Stats *stats = &m_stats;
+        info.callback = [original, stats] (const CommandHandler::Arguments &arguments,
+                                           CommandHandler &handler) -> std::string
+        {
+            if (original->write && handler.keySpace().dataset()) {
+                return readOnlyKeySpaceCallback(arguments);
+            }
+            if (original->keySpace) {
+                handler.keySpace().recordCommand(original->write);
+            }
+
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::string reply = original->callback(arguments, handler);
+            if (reply.empty() /* REPLY_DEFERRED */) {
+                // Until reply is sent (i.e. all chunks of HFOR)
+                handler.atFinish([stats, original, start] ()
+                {
+                    stats->recordSince(original->id, start);
+                });
+            } else {
+                stats->recordSince(original->id, start);
+            }
+            return reply;
+        };
+    }
 }
 
 std::string Commands::notImplementedYetCallback(const CommandHandler::Arguments &arguments)
@@ -86,6 +304,18 @@ std::string Commands::malformedArgumentsCallback(const CommandHandler::Arguments
     return CommandHandler::toErrorReplyString(boost::str(format));
 }
 
+std::string Commands::readOnlyCallback(const CommandHandler::Arguments &arguments)
+{
+    boost::format format = boost::format("%s is not allowed on read-only replica") % arguments[0];
+    return CommandHandler::toErrorReplyString(boost::str(format));
+}
+
+std::string Commands::readOnlyKeySpaceCallback(const CommandHandler::Arguments &arguments)
+{
+    boost::format format = boost::format("%s is not allowed on read-only key-space") % arguments[0];
+    return CommandHandler::toErrorReplyString(boost::str(format));
+}
+
 std::string Commands::commandsList(const CommandHandler::Arguments &UNUSED(arguments))
 {
     std::string asString;
@@ -110,3 +340,444 @@ std::string Commands::version(const CommandHandler::Arguments &arguments)
 
     return CommandHandler::toInlineReplyString(Util::versionString(verbose));
 }
+
+std::string Commands::info(const CommandHandler::Arguments &arguments)
+{
+    if (arguments.size() > 2) {
+        return CommandHandler::toErrorReplyString("syntax error");
+    }
+    const std::string section = (arguments.size() == 2)
+                              ? boost::algorithm::to_lower_copy(arguments[1])
+                              : std::string("default");
+    const bool all = (section == "all");
+    const bool byDefault = (all || (section == "default"));
+
+    std::string info;
+    if (byDefault || (section == "server")) {
+        info += "# Server\r\n";
+        info += str(boost::format("version:%s\r\n") % Util::versionString(false));
+        info += str(boost::format("process_id:%i\r\n") % getpid());
+        info += str(boost::format("uptime_in_seconds:%i\r\n")
+                    % (time(nullptr) - m_stats.startTime()));
+    }
+    if (byDefault || (section == "clients")) {
+        info += "# Clients\r\n";
+        info += str(boost::format("connected_clients:%i\r\n") % m_stats.connections());
+        info += str(boost::format("total_connections_received:%i\r\n")
+                    % m_stats.totalConnections());
+    }
+    if (all || (section == "memory")) {
+        info += "# Memory\r\n";
+        m_keySpaces.forEach([&info] (Db::KeySpace &keySpace)
+        {
+            if (keySpace.dataset()) {
+                return;
+            }
+            info += str(boost::format("%s:hashtable_bytes=%i,hashtable_spilled_bytes=%i,"
+                                      "avltree_bytes=%i,avltree_spilled_bytes=%i\r\n")
+                        % keySpace.name()
+                        % dataSize(keySpace.hashTable())
+                        % keySpace.hashTable().tier().liveSize()
+                        % dataSize(keySpace.avlTree())
+                        % keySpace.avlTree().tier().liveSize());
+        });
+    }
+    if (byDefault || (section == "keyspace")) {
+        info += "# Keyspace\r\n";
+        m_keySpaces.forEach([&info] (Db::KeySpace &keySpace)
+        {
+            if (keySpace.dataset()) {
+                info += str(boost::format("%s:dataset_keys=%i,calls=%i,writes=%i\r\n")
+                            % keySpace.name()
+                            % keySpace.dataset()->entries()
+                            % keySpace.calls()
+                            % keySpace.writes());
+                return;
+            }
+            info += str(boost::format("%s:hashtable_keys=%i,avltree_keys=%i,calls=%i,writes=%i\r\n")
+                        % keySpace.name()
+                        % keySpace.hashTable().size()
+                        % keySpace.avlTree().size()
+                        % keySpace.calls()
+                        % keySpace.writes());
+        });
+    }
+    if (byDefault || (section == "commandstats")) {
+        info += "# Commandstats\r\n";
+        info += m_stats.commandStats();
+    }
+
+    return CommandHandler::toReplyString(info);
+}
+
+std::string Commands::slowLogQuery(const CommandHandler::Arguments &arguments)
+{
+    if ((arguments.size() == 2) && (arguments[1] == "LEN")) {
+        return CommandHandler::toIntegerReplyString(m_slowLog.length());
+    }
+    if ((arguments.size() == 2) && (arguments[1] == "RESET")) {
+        m_slowLog.reset();
+        return CommandHandler::REPLY_OK;
+    }
+    if ((arguments.size() >= 2) && (arguments.size() <= 3) && (arguments[1] == "GET")) {
+        long long count = 10;
+        if ((arguments.size() == 3) &&
+            (!CommandHandler::toInteger(arguments[2], count) || (count < 0))) {
+            return CommandHandler::toErrorReplyString("value is not an integer or out of range");
+        }
+
+        std::vector<std::string> replies;
+        for (const SlowLog::Entry &entry : m_slowLog.get(count)) {
+            std::vector<std::string> entryArguments;
+            for (const std::string &argument : entry.arguments) {
+                entryArguments.push_back(CommandHandler::toReplyString(argument));
+            }
+
+            std::vector<std::string> fields;
+            fields.push_back(CommandHandler::toIntegerReplyString(entry.id));
+            fields.push_back(CommandHandler::toIntegerReplyString(entry.time));
+            fields.push_back(CommandHandler::toIntegerReplyString(entry.duration));
+            fields.push_back(CommandHandler::toMultiBulkReplyString(entryArguments));
+            fields.push_back(CommandHandler::toReplyString(entry.address));
+            replies.push_back(CommandHandler::toMultiBulkReplyString(fields));
+        }
+        return CommandHandler::toMultiBulkReplyString(replies);
+    }
+    return CommandHandler::toErrorReplyString("syntax error");
+}
+
+std::string Commands::client(const CommandHandler::Arguments &arguments)
+{
+    if ((arguments.size() == 2) && (arguments[1] == "LIST")) {
+        return CommandHandler::toReplyString(m_clients.list());
+    }
+    if ((arguments.size() == 3) && (arguments[1] == "KILL")) {
+        if (!m_clients.kill(arguments[2], 0)) {
+            return CommandHandler::toErrorReplyString("No such client");
+        }
+        return CommandHandler::REPLY_OK;
+    }
+    if ((arguments.size() == 4) && (arguments[1] == "KILL") && (arguments[2] == "ID")) {
+        long long id;
+        if (!CommandHandler::toInteger(arguments[3], id) || (id <= 0)) {
+            return CommandHandler::toErrorReplyString("value is not an integer or out of range");
+        }
+        return CommandHandler::toIntegerReplyString(m_clients.kill(std::string(), id));
+    }
+    return CommandHandler::toErrorReplyString("syntax error");
+}
+
+std::string Commands::onHashTable(HashTableMethod method,
+                                  const CommandHandler::Arguments &arguments,
+                                  CommandHandler &handler)
+{
+    if (const Db::Dataset *dataset = handler.keySpace().dataset()) {
+        return onDataset(method, arguments, *dataset);
+    }
+    try {
+        return (handler.keySpace().hashTable().*method)(arguments);
+    } catch (const Exception &e) {
+        // i.e. spilled value can't be read (already logged by Db::Tier)
+        return CommandHandler::toErrorReplyString(e.getMessage());
+    }
+}
+
+std::string Commands::onAvlTree(AvlTreeMethod method,
+                                const CommandHandler::Arguments &arguments,
+                                CommandHandler &handler)
+{
+    if (handler.keySpace().dataset()) {
+        return notSupportedOnDataset(arguments);
+    }
+    try {
+        return (handler.keySpace().avlTree().*method)(arguments);
+    } catch (const Exception &e) {
+        return CommandHandler::toErrorReplyString(e.getMessage());
+    }
+}
+
+std::string Commands::onDataset(HashTableMethod method,
+                                const CommandHandler::Arguments &arguments,
+                                const Db::Dataset &dataset)
+{
+    const char *value;
+    uint32_t size;
+
+    if (method == &Db::HashTable::get) {
+        if (!dataset.find(arguments[1], value, size)) {
+            return CommandHandler::REPLY_NIL;
+        }
+        return CommandHandler::toReplyString(value, size);
+    }
+    if (method == &Db::HashTable::length) {
+        if (!dataset.find(arguments[1], value, size)) {
+            return CommandHandler::toIntegerReplyString(0);
+        }
+        return CommandHandler::toIntegerReplyString(size);
+    }
+
+    return notSupportedOnDataset(arguments);
+}
+
+std::string Commands::notSupportedOnDataset(const CommandHandler::Arguments &arguments)
+{
+    boost::format format = boost::format("%s is not supported on read-only key-space") % arguments[0];
+    return CommandHandler::toErrorReplyString(boost::str(format));
+}
+
+std::string Commands::hashTableForeach(const CommandHandler::Arguments &arguments,
+                                       CommandHandler &handler)
+{
+    if (handler.keySpace().dataset()) {
+        return notSupportedOnDataset(arguments);
+    }
+    return handler.keySpace().hashTable().foreach(arguments, handler);
+}
+
+std::string Commands::avlTreeForeach(const CommandHandler::Arguments &arguments,
+                                     CommandHandler &handler)
+{
+    if (handler.keySpace().dataset()) {
+        return notSupportedOnDataset(arguments);
+    }
+    return handler.keySpace().avlTree().foreach(arguments, handler);
+}
+
+std::string Commands::script(const CommandHandler::Arguments &arguments)
+{
+    if ((arguments.size() == 3) && (arguments[1] == "LOAD")) {
+        // Compile it now, to report errors early (and warm up this worker)
+        JsVm vm(arguments[2]);
+        if (!vm.init()) {
+            return CommandHandler::toErrorReplyString("can't compile script");
+        }
+        return CommandHandler::toReplyString(m_scripts.load(arguments[2]));
+    }
+    if ((arguments.size() > 2) && (arguments[1] == "EXISTS")) {
+        std::vector<std::string> replies;
+        std::string code;
+        for (size_t i = 2; i < arguments.size(); ++i) {
+            replies.push_back(m_scripts.find(arguments[i], code)
+                              ? CommandHandler::REPLY_TRUE
+                              : CommandHandler::REPLY_FALSE);
+        }
+        return CommandHandler::toMultiBulkReplyString(replies);
+    }
+    if ((arguments.size() == 2) && (arguments[1] == "FLUSH")) {
+        m_scripts.flush();
+        return CommandHandler::REPLY_OK;
+    }
+    return CommandHandler::toErrorReplyString("syntax error");
+}
+
+std::string Commands::save(const CommandHandler::Arguments &UNUSED(arguments))
+{
+    if (m_snapshot.inProgress()) {
+        return CommandHandler::toErrorReplyString("background save already in progress");
+    }
+    if (!m_snapshot.save()) {
+        return CommandHandler::REPLY_ERROR;
+    }
+    return CommandHandler::REPLY_OK;
+}
+
+std::string Commands::backgroundSave(const CommandHandler::Arguments &UNUSED(arguments))
+{
+    if (m_snapshot.inProgress()) {
+        return CommandHandler::toErrorReplyString("background save already in progress");
+    }
+    if (!m_snapshot.backgroundSave()) {
+        return CommandHandler::REPLY_ERROR;
+    }
+    return CommandHandler::toInlineReplyString("Background saving started");
+}
+
+std::string Commands::lastSave(const CommandHandler::Arguments &UNUSED(arguments))
+{
+    return CommandHandler::toIntegerReplyString(m_snapshot.lastSave());
+}
+
+std::string Commands::rewriteJournal(const CommandHandler::Arguments &UNUSED(arguments))
+{
+    if (!m_journal.persistent()) {
+        return CommandHandler::toErrorReplyString("journal is disabled");
+    }
+    if (m_journal.rewriteInProgress()) {
+        return CommandHandler::toErrorReplyString("background journal rewriting already in progress");
+    }
+    if (!m_journal.backgroundRewrite()) {
+        return CommandHandler::REPLY_ERROR;
+    }
+    return CommandHandler::toInlineReplyString("Background journal rewriting started");
+}
+
+std::string Commands::psync(const CommandHandler::Arguments &arguments,
+                            CommandHandler &handler)
+{
+    return ReplicaFeed::start(m_journal, arguments, handler);
+}
+
+std::string Commands::hashTableEvalSha(const CommandHandler::Arguments &arguments,
+                                       CommandHandler &handler)
+{
+    std::string code;
+    std::vector<std::string> keys, args;
+    if (handler.keySpace().dataset()) {
+        return notSupportedOnDataset(arguments);
+    }
+    std::string error = parseEvalSha(arguments, code, keys, args);
+    if (!error.empty()) {
+        return error;
+    }
+    return handler.keySpace().hashTable().eval(code, keys, args);
+}
+
+std::string Commands::avlTreeEvalSha(const CommandHandler::Arguments &arguments,
+                                     CommandHandler &handler)
+{
+    std::string code;
+    std::vector<std::string> keys, args;
+    if (handler.keySpace().dataset()) {
+        return notSupportedOnDataset(arguments);
+    }
+    std::string error = parseEvalSha(arguments, code, keys, args);
+    if (!error.empty()) {
+        return error;
+    }
+    return handler.keySpace().avlTree().eval(code, keys, args);
+}
+
+std::string Commands::parseEvalSha(const CommandHandler::Arguments &arguments,
+                                   std::string &code,
+                                   std::vector<std::string> &keys,
+                                   std::vector<std::string> &args)
+{
+    long long numberOfKeys;
+    if ((arguments.size() < 3) ||
+        !CommandHandler::toInteger(arguments[2], numberOfKeys) ||
+        (numberOfKeys < 0) ||
+        (numberOfKeys > (long long)(arguments.size() - 3))) {
+        return CommandHandler::toErrorReplyString("syntax error");
+    }
+    if (!m_scripts.find(arguments[1], code)) {
+        return REPLY_ERROR_NOSCRIPT;
+    }
+
+    CommandHandler::Arguments::const_iterator keysBegin = arguments.begin() + 3;
+    keys.assign(keysBegin, keysBegin + numberOfKeys);
+    args.assign(keysBegin + numberOfKeys, arguments.end());
+
+    return std::string();
+}
+
+std::string Commands::select(const CommandHandler::Arguments &arguments,
+                             CommandHandler &handler)
+{
+    if (arguments[1].empty()) {
+        return CommandHandler::toErrorReplyString("invalid key-space name");
+    }
+
+    Db::KeySpace *keySpace = m_keySpaces.findOrCreate(arguments[1]);
+    if (!keySpace) {
+        return CommandHandler::toErrorReplyString("too many key-spaces");
+    }
+    handler.selectKeySpace(*keySpace);
+
+    return CommandHandler::REPLY_OK;
+}
+
+std::string Commands::flushKeySpace(const CommandHandler::Arguments &UNUSED(arguments),
+                                    CommandHandler &handler)
+{
+    handler.keySpace().flush();
+    return CommandHandler::REPLY_OK;
+}
+
+std::string Commands::keySpacesList(const CommandHandler::Arguments &UNUSED(arguments))
+{
+    std::string asString;
+    m_keySpaces.forEach([&asString] (Db::KeySpace &keySpace)
+    {
+        if (keySpace.dataset()) {
+            asString += str(boost::format("%s dataset:%i\n")
+                            % keySpace.name()
+                            % keySpace.dataset()->entries());
+            return;
+        }
+        asString += str(boost::format("%s hashtable:%i avltree:%i\n")
+                        % keySpace.name()
+                        % keySpace.hashTable().size()
+                        % keySpace.avlTree().size());
+    });
+    return CommandHandler::toReplyString(asString);
+}
+
+std::string Commands::hotKeys(const CommandHandler::Arguments &arguments,
+                              CommandHandler &handler)
+{
+    if ((arguments.size() == 2) && (arguments[1] == "RESET")) {
+        Db::HotKeys::reset();
+        return CommandHandler::REPLY_OK;
+    }
+    if (!Db::HotKeys::enabled()) {
+        return CommandHandler::toErrorReplyString("hot keys sampling is disabled "
+                                                  "(see --hotkeys-sample-rate)");
+    }
+    long long count = 10;
+    if (arguments.size() > 2) {
+        return CommandHandler::toErrorReplyString("syntax error");
+    }
+    if ((arguments.size() == 2) &&
+        (!CommandHandler::toInteger(arguments[1], count) || (count < 0))) {
+        return CommandHandler::toErrorReplyString("value is not an integer or out of range");
+    }
+
+    Db::KeySpace &keySpace = handler.keySpace();
+    const void *hashTable = &keySpace.hashTable();
+    const void *avlTree = &keySpace.avlTree();
+
+    std::vector<std::string> replies;
+    for (const Db::HotKeys::Item &item : Db::HotKeys::top({ hashTable, avlTree }, count)) {
+        std::vector<std::string> fields;
+        fields.push_back(CommandHandler::toReplyString(item.key));
+        fields.push_back(CommandHandler::toReplyString(item.engine == hashTable ?
+                                                       "hashtable" : "avltree"));
+        fields.push_back(CommandHandler::toIntegerReplyString(item.count));
+        replies.push_back(CommandHandler::toMultiBulkReplyString(fields));
+    }
+    return CommandHandler::toMultiBulkReplyString(replies);
+}
+
+std::string Commands::multi(const CommandHandler::Arguments &UNUSED(arguments),
+                            CommandHandler &handler)
+{
+    return handler.transaction().begin();
+}
+
+std::string Commands::exec(const CommandHandler::Arguments &UNUSED(arguments),
+                           CommandHandler &handler)
+{
+    return handler.transaction().exec(handler);
+}
+
+std::string Commands::discard(const CommandHandler::Arguments &UNUSED(arguments),
+                              CommandHandler &handler)
+{
+    return handler.transaction().discard();
+}
+
+std::string Commands::watch(const CommandHandler::Arguments &arguments,
+                            CommandHandler &handler)
+{
+    if (arguments.size() < 2) {
+        return malformedArgumentsCallback(arguments, arguments.size() - 1, 1);
+    }
+    return handler.transaction().watch(arguments, handler.keySpace());
+}
+
+std::string Commands::unwatch(const CommandHandler::Arguments &UNUSED(arguments),
+                              CommandHandler &handler)
+{
+    handler.transaction().unwatch();
+    return CommandHandler::REPLY_OK;
+}
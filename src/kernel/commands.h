@@ -14,20 +14,28 @@
 #include "commandhandler.h" // CommandHandler::Arguments
 #include "wrapper/singleton.h"
 
-#include "db/hashtable.h"
-#include "db/avltree.h"
+#include "db/keyspace.h"
+#include "db/snapshot.h"
+#include "db/journal.h"
+#include "kernel/scripts.h"
+#include "kernel/stats.h"
+#include "kernel/slowlog.h"
+#include "kernel/clients.h"
 
 #include <boost/noncopyable.hpp>
 #include <string>
 #include <functional>
 #include <unordered_map>
+#include <deque>
 
 
 /**
  * All supported commands, includes interface to get it from hashtable
  * (that store all commands)
  *
- * TODO: add conception of database/key-space
+ * Db commands are executed on key-space, that selected for connection
+ * (see CommandHandler::keySpace()).
+ *
  * TODO: maybe it is not good to delegate all response for command callback?
  *
  * TODO: check number of arguments inside the commands callback
@@ -42,12 +50,30 @@ class Commands : boost::noncopyable
     friend class Wrapper::Singleton<Commands>;
 
 public:
-    typedef std::function<std::string(const CommandHandler::Arguments&)> Callback;
+    typedef std::function<std::string(const CommandHandler::Arguments&,
+                                      CommandHandler&)> Callback;
 
-    Callback find(const std::string &commandName,
-                  int numberOfArguments) const;
+    enum Flags
+    {
+        /**
+         * Command uses hashtable/avltree of selected key-space
+         */
+        HASHTABLE = 1 << 0,
+        AVLTREE = 1 << 1,
+        /**
+         * Executed immediately, even inside MULTI
+         */
+        TRANSACTION_CONTROL = 1 << 2,
+        /**
+         * Can't be queued inside MULTI
+         */
+        NO_TRANSACTION = 1 << 3,
+        /**
+         * Modifies entries, rejected by replica (see setReadOnly())
+         */
+        WRITE = 1 << 4,
+    };
 
-private:
     struct CallbackInfo
     {
         Callback callback;
@@ -58,18 +84,70 @@ private:
          * @TODO: make it minimum number of arguments required?
          */
         int numberOfArguments;
+        /**
+         * Bitmask of Flags
+         */
+        int flags;
 
-        CallbackInfo(Callback callback = nullptr, int numberOfArguments = 0)
+        CallbackInfo(Callback callback = nullptr, int numberOfArguments = 0,
+                     int flags = 0)
             : callback(callback)
             , numberOfArguments(numberOfArguments)
+            , flags(flags)
         {}
     };
+
+    Callback find(const std::string &commandName,
+                  int numberOfArguments) const;
+    /**
+     * Return nullptr if there is no such command,
+     * or it has different number of arguments.
+     */
+    const CallbackInfo *lookup(const std::string &commandName,
+                               int numberOfArguments) const;
+
+    Db::KeySpaces &keySpaces()
+    {
+        return m_keySpaces;
+    }
+    Db::Snapshot &snapshot()
+    {
+        return m_snapshot;
+    }
+    Db::Journal &journal()
+    {
+        return m_journal;
+    }
+    Stats &stats()
+    {
+        return m_stats;
+    }
+    SlowLog &slowLog()
+    {
+        return m_slowLog;
+    }
+    Clients &clients()
+    {
+        return m_clients;
+    }
+
+    /**
+     * Reject commands with WRITE flag (i.e. on replica).
+     * Must be called before server is started.
+     */
+    void setReadOnly(bool readOnly)
+    {
+        m_readOnly = readOnly;
+    }
+
+private:
     typedef std::unordered_map<std::string, CallbackInfo> HashTable;
     typedef std::pair<std::string, CallbackInfo> HashTablePair;
     /**
      * Hashtable of all supported commands
      */
     HashTable m_commands;
+    bool m_readOnly;
 
     /**
      * Just print warning, that such command not supported yet.
@@ -82,6 +160,8 @@ private:
      */
     static std::string malformedArgumentsCallback(const CommandHandler::Arguments &arguments,
                                                   int inputArguments, int expectedArguments);
+    static std::string readOnlyCallback(const CommandHandler::Arguments &arguments);
+    static std::string readOnlyKeySpaceCallback(const CommandHandler::Arguments &arguments);
 
     /**
      * Print list of commands
@@ -90,15 +170,165 @@ private:
     std::string commandsList(const CommandHandler::Arguments &arguments);
     std::string pingPong(const CommandHandler::Arguments &arguments);
     std::string version(const CommandHandler::Arguments &arguments);
+    /**
+     * INFO [ section ], "memory" section (not included by default) takes
+     * shared locks of all engines one by one, and walks over all entries.
+     */
+    std::string info(const CommandHandler::Arguments &arguments);
+
+    /**
+     * Counters of connections and commands (see wrapCommands())
+     */
+    Stats m_stats;
+
+    /**
+     * GET [ count ] | LEN | RESET
+     */
+    SlowLog m_slowLog;
+    std::string slowLogQuery(const CommandHandler::Arguments &arguments);
+
+    /**
+     * LIST | KILL <address> | KILL ID <id>
+     */
+    Clients m_clients;
+    std::string client(const CommandHandler::Arguments &arguments);
 
     /******* DB ******/
-    Db::HashTable m_dbHashTable;
-    Db::AvlTree m_dbAvlTree;
+    /**
+     * Must be initialized before key-spaces, that log to it
+     */
+    Db::Journal m_journal;
+    Db::KeySpaces m_keySpaces;
+
+    typedef std::string (Db::HashTable::*HashTableMethod)(const CommandHandler::Arguments&);
+    typedef std::string (Db::AvlTree::*AvlTreeMethod)(const CommandHandler::Arguments&);
+    /**
+     * Dispatch db command to engine of selected key-space
+     */
+    static std::string onHashTable(HashTableMethod method,
+                                   const CommandHandler::Arguments &arguments,
+                                   CommandHandler &handler);
+    static std::string onAvlTree(AvlTreeMethod method,
+                                 const CommandHandler::Arguments &arguments,
+                                 CommandHandler &handler);
+    /**
+     * Hashtable commands of read-only key-space, only HGET and HSTRLEN
+     * are supported
+     */
+    static std::string onDataset(HashTableMethod method,
+                                 const CommandHandler::Arguments &arguments,
+                                 const Db::Dataset &dataset);
+    /**
+     * Reply for other commands of read-only key-space (i.e. AT*), that
+     * must not silently use its empty engines
+     */
+    static std::string notSupportedOnDataset(const CommandHandler::Arguments &arguments);
+
+    /**
+     * HFOR/ATFOR, can reply later (see ChunkedForeach)
+     */
+    std::string hashTableForeach(const CommandHandler::Arguments &arguments,
+                                 CommandHandler &handler);
+    std::string avlTreeForeach(const CommandHandler::Arguments &arguments,
+                               CommandHandler &handler);
+
+    /**
+     * Stored scripts
+     */
+    Scripts m_scripts;
+
+    static const char *REPLY_ERROR_NOSCRIPT;
+
+    std::string script(const CommandHandler::Arguments &arguments);
+    std::string hashTableEvalSha(const CommandHandler::Arguments &arguments,
+                                 CommandHandler &handler);
+    std::string avlTreeEvalSha(const CommandHandler::Arguments &arguments,
+                               CommandHandler &handler);
+    /**
+     * Parse "<sha1> <numkeys> [ key ... ] [ arg ... ]"
+     * Return error reply, or empty string on success.
+     */
+    std::string parseEvalSha(const CommandHandler::Arguments &arguments,
+                             std::string &code,
+                             std::vector<std::string> &keys,
+                             std::vector<std::string> &args);
+
+    /**
+     * Key-space commands
+     */
+    std::string select(const CommandHandler::Arguments &arguments,
+                       CommandHandler &handler);
+    std::string flushKeySpace(const CommandHandler::Arguments &arguments,
+                              CommandHandler &handler);
+    std::string keySpacesList(const CommandHandler::Arguments &arguments);
+    /**
+     * HOTKEYS [ count ] | RESET, hottest keys of selected key-space
+     * (see Db::HotKeys), with estimated number of accesses.
+     */
+    std::string hotKeys(const CommandHandler::Arguments &arguments,
+                        CommandHandler &handler);
+
+    /**
+     * Snapshots of all key-spaces (see Db::Snapshot), and rewrite of journal
+     */
+    Db::Snapshot m_snapshot;
+
+    std::string save(const CommandHandler::Arguments &arguments);
+    std::string backgroundSave(const CommandHandler::Arguments &arguments);
+    std::string lastSave(const CommandHandler::Arguments &arguments);
+    std::string rewriteJournal(const CommandHandler::Arguments &arguments);
+
+    /**
+     * Feed replica (see ReplicaFeed)
+     */
+    std::string psync(const CommandHandler::Arguments &arguments,
+                      CommandHandler &handler);
+
+    /**
+     * Transaction commands (see Transaction)
+     */
+    std::string multi(const CommandHandler::Arguments &arguments,
+                      CommandHandler &handler);
+    std::string exec(const CommandHandler::Arguments &arguments,
+                     CommandHandler &handler);
+    std::string discard(const CommandHandler::Arguments &arguments,
+                        CommandHandler &handler);
+    std::string watch(const CommandHandler::Arguments &arguments,
+                      CommandHandler &handler);
+    std::string unwatch(const CommandHandler::Arguments &arguments,
+                        CommandHandler &handler);
 
 
     Commands();
     void addGenericCommands();
     void addDbCommands();
+    void addKeySpaceCommands();
+    void addTransactionCommands();
+    void addScriptCommands();
+    void addPersistenceCommands();
+    void addReplicationCommands();
+
+    /**
+     * Original callback of command, that is wrapped by wrapCommands()
+     * (addresses are stable, so wrapper fits into std::function without
+     * allocation)
+     */
+    struct WrappedCommand
+    {
+        Callback callback;
+        size_t id;
+        bool write;
+        /** Works with engine of key-space (counted by KeySpace::recordCommand()) */
+        bool keySpace;
+    };
+    std::deque<WrappedCommand> m_wrappedCommands;
+
+    /**
+     * Reject commands with WRITE flag on read-only key-spaces
+     * (see Db::KeySpaces::attach()), and record stats of all commands.
+     * Must be called after all commands are added.
+     */
+    void wrapCommands();
 };
 
 typedef Wrapper::Singleton<Commands> TheCommands;
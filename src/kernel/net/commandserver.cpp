@@ -64,6 +64,14 @@ void CommandServer::setupStopSignals()
 
 void CommandServer::createTcpEndpoint()
 {
+    if (m_options.tcpFd >= 0) {
+        m_tcpAcceptor.assign(Ip::tcp::v4(), m_options.tcpFd);
+        LOG(info) << "Listening on " << m_tcpAcceptor.local_endpoint() << " (inherited)";
+
+        startAcceptOnTcp();
+        return;
+    }
+
     std::stringstream streamForPort;
     streamForPort << m_options.port;
 
@@ -87,6 +95,14 @@ void CommandServer::createTcpEndpoint()
 
 void CommandServer::createUnixDomainEndpoint()
 {
+    if (m_options.unixDomainFd >= 0) {
+        m_unixDomainAcceptor.assign(Local::stream_protocol(), m_options.unixDomainFd);
+        LOG(info) << "Listening on " << m_unixDomainAcceptor.local_endpoint() << " (inherited)";
+
+        startAcceptOnUnixDomain();
+        return;
+    }
+
     // TODO: unlink only "*.sock"
     ::unlink(m_options.socket.c_str());
 
@@ -103,7 +119,9 @@ void CommandServer::createUnixDomainEndpoint()
 
 void CommandServer::startAcceptOnTcp()
 {
-    TcpSession *newSession = new TcpSession(m_ioServicePool.ioService());
+    size_t worker;
+    boost::asio::io_service &ioService = m_ioServicePool.ioService(&worker);
+    TcpSession *newSession = new TcpSession(ioService, worker);
     m_tcpAcceptor.async_accept(newSession->socket(),
                                std::bind(&CommandServer::handleAcceptOnTcp,
                                          this,
@@ -113,7 +131,9 @@ void CommandServer::startAcceptOnTcp()
 
 void CommandServer::startAcceptOnUnixDomain()
 {
-    UnixDomainSession *newSession = new UnixDomainSession(m_ioServicePool.ioService());
+    size_t worker;
+    boost::asio::io_service &ioService = m_ioServicePool.ioService(&worker);
+    UnixDomainSession *newSession = new UnixDomainSession(ioService, worker);
     m_unixDomainAcceptor.async_accept(newSession->socket(),
                                       std::bind(&CommandServer::handleAcceptOnUnixDomain,
                                                 this,
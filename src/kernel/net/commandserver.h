@@ -37,20 +37,46 @@ public:
         std::string host;
         std::string socket;
         int numOfWorkers;
+        /**
+         * Listening sockets inherited from previous process (see Handoff),
+         * -1 means create new ones
+         */
+        int tcpFd;
+        int unixDomainFd;
 
         Options(short port = 0, std::string host = "",
-                std::string socket = "", int numOfWorkers = 0)
+                std::string socket = "", int numOfWorkers = 0,
+                int tcpFd = -1, int unixDomainFd = -1)
             : port(port)
             , host(host)
             , socket(socket)
             , numOfWorkers(numOfWorkers)
+            , tcpFd(tcpFd)
+            , unixDomainFd(unixDomainFd)
         {}
     };
 
     CommandServer(const Options &options);
     virtual ~CommandServer();
 
+    /**
+     * Blocks until server is stopped
+     */
     void start();
+    /**
+     * Can be called from any thread.
+     * Listening sockets are not closed (see Handoff).
+     */
+    void stop();
+
+    int tcpFd()
+    {
+        return m_tcpAcceptor.native_handle();
+    }
+    int unixDomainFd()
+    {
+        return m_unixDomainAcceptor.native_handle();
+    }
 
 private:
     Options m_options;
@@ -73,6 +99,4 @@ private:
                            const boost::system::error_code &error);
     void handleAcceptOnUnixDomain(UnixDomainSession *newSession,
                                   const boost::system::error_code &error);
-
-    void stop();
 };
\ No newline at end of file
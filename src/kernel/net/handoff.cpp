@@ -0,0 +1,257 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "handoff.h"
+#include "util/log.h"
+
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+const char *Handoff::REQUEST = "TAKEOVER\n";
+
+namespace
+{
+    bool toAddress(const std::string &path, struct sockaddr_un &address)
+    {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            LOG(error) << "Control socket path is too long: " << path;
+            return false;
+        }
+        memcpy(address.sun_path, path.c_str(), path.size());
+        return true;
+    }
+}
+
+bool Handoff::takeOver(const std::string &path, State &state, bool &taken)
+{
+    taken = false;
+
+    struct sockaddr_un address;
+    if (!toAddress(path, address)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG(error) << "Can't create control socket: " << strerror(errno);
+        return false;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        bool first = ((errno == ENOENT) || (errno == ECONNREFUSED));
+        if (!first) {
+            LOG(error) << "Can't connect to " << path << ": " << strerror(errno);
+        }
+        close(fd);
+        return first;
+    }
+
+    LOG(info) << "Taking over running process through " << path;
+    if (send(fd, REQUEST, strlen(REQUEST), MSG_NOSIGNAL) != (ssize_t)strlen(REQUEST)) {
+        LOG(error) << "Can't request takeover: " << strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    // Path of snapshot ends with LF, sockets come with its first byte
+    std::string snapshot;
+    char buffer[MAX_PATH_SIZE];
+    while (snapshot.empty() || (snapshot.back() != '\n')) {
+        struct iovec iov = { buffer, sizeof(buffer) };
+        union
+        {
+            struct cmsghdr header;
+            char data[CMSG_SPACE(2 * sizeof(int))];
+        } control;
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data;
+        message.msg_controllen = sizeof(control.data);
+
+        ssize_t bytes = recvmsg(fd, &message, 0);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(error) << "Can't receive state: " << strerror(errno);
+            close(fd);
+            return false;
+        }
+        if (!bytes) {
+            LOG(error) << "Running process failed to hand its state over";
+            close(fd);
+            return false;
+        }
+
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header;
+             header = CMSG_NXTHDR(&message, header)) {
+            if ((header->cmsg_level != SOL_SOCKET) || (header->cmsg_type != SCM_RIGHTS) ||
+                (header->cmsg_len != CMSG_LEN(2 * sizeof(int)))) {
+                continue;
+            }
+            int fds[2];
+            memcpy(fds, CMSG_DATA(header), sizeof(fds));
+            state.tcpFd = fds[0];
+            state.unixDomainFd = fds[1];
+        }
+        snapshot.append(buffer, bytes);
+        if (snapshot.size() > MAX_PATH_SIZE) {
+            break;
+        }
+    }
+    close(fd);
+
+    if ((state.tcpFd < 0) || (state.unixDomainFd < 0) ||
+        (snapshot.size() > MAX_PATH_SIZE)) {
+        LOG(error) << "Malformed state from running process";
+        return false;
+    }
+    snapshot.resize(snapshot.size() - 1);
+    state.snapshot = snapshot;
+
+    taken = true;
+    return true;
+}
+
+Handoff::Handoff(const std::string &path)
+    : m_path(path)
+    , m_fd(-1)
+    , m_peer(-1)
+{
+}
+
+Handoff::~Handoff()
+{
+    stop();
+    if (m_peer >= 0) {
+        close(m_peer);
+    }
+}
+
+bool Handoff::listen()
+{
+    struct sockaddr_un address;
+    if (!toAddress(m_path, address)) {
+        return false;
+    }
+
+    // Socket of previous process (if any), it does not accept anymore
+    unlink(m_path.c_str());
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((m_fd < 0) ||
+        (bind(m_fd, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+        (::listen(m_fd, 1) != 0)) {
+        LOG(error) << "Can't listen on " << m_path << ": " << strerror(errno);
+        return false;
+    }
+
+    LOG(info) << "Waiting for takeover on " << m_path;
+    m_thread = std::thread(&Handoff::run, this);
+    return true;
+}
+
+void Handoff::stop()
+{
+    if (m_thread.joinable()) {
+        // Wakes up accept()
+        shutdown(m_fd, SHUT_RDWR);
+        m_thread.join();
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool Handoff::handOver(const State &state)
+{
+    std::string payload = state.snapshot + "\n";
+    struct iovec iov = { &payload[0], payload.size() };
+    union
+    {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { state.tcpFd, state.unixDomainFd };
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    ssize_t sent;
+    while (((sent = sendmsg(m_peer, &message, MSG_NOSIGNAL)) < 0) && (errno == EINTR)) {
+    }
+    if (sent != (ssize_t)payload.size()) {
+        LOG(error) << "Can't hand state over: " << strerror(errno);
+        return false;
+    }
+
+    LOG(info) << "State is handed over to new process";
+    return true;
+}
+
+void Handoff::cancel()
+{
+    if (m_peer >= 0) {
+        close(m_peer);
+        m_peer = -1;
+    }
+}
+
+void Handoff::run()
+{
+    for (;;) {
+        int peer = accept(m_fd, nullptr, nullptr);
+        if (peer < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // stop()
+            return;
+        }
+
+        std::string request;
+        char byte;
+        while ((request.size() < strlen(REQUEST)) && (read(peer, &byte, 1) == 1)) {
+            request += byte;
+        }
+        if (request != REQUEST) {
+            LOG(warning) << "Malformed takeover request";
+            close(peer);
+            continue;
+        }
+
+        LOG(info) << "New process takes over, stopping";
+        m_peer = peer;
+        if (m_stopCallback) {
+            m_stopCallback();
+        }
+        return;
+    }
+}
@@ -0,0 +1,102 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <string>
+
+
+/**
+ * @brief Warm restart: hand listening sockets and data over to new process
+ *
+ * Running process listens on control unix socket. New process started
+ * with the same control socket connects to it (see takeOver()), then
+ * running process:
+ * - stops serving (see setStopCallback()), listening sockets stay open,
+ *   so new connections are queued by kernel and are not refused
+ * - saves snapshot into memory-backed directory (i.e. /dev/shm)
+ * - passes listening sockets (SCM_RIGHTS) and path of snapshot to new
+ *   process, and exits (see handOver())
+ *
+ * New process loads snapshot from memory (segments are decoded in
+ * parallel), and accepts on inherited sockets.
+ */
+class Handoff : boost::noncopyable
+{
+public:
+    typedef std::function<void()> StopCallback;
+
+    struct State
+    {
+        int tcpFd;
+        int unixDomainFd;
+        std::string snapshot;
+
+        State()
+            : tcpFd(-1)
+            , unixDomainFd(-1)
+        {}
+    };
+
+    /**
+     * New process side.
+     * @taken is false if nobody listens on @path (i.e. first start).
+     * Return false on errors.
+     */
+    static bool takeOver(const std::string &path, State &state, bool &taken);
+
+    Handoff(const std::string &path);
+    ~Handoff();
+
+    void setStopCallback(const StopCallback &callback)
+    {
+        m_stopCallback = callback;
+    }
+
+    /**
+     * Bind control socket, and wait for new process in separate thread
+     */
+    bool listen();
+    void stop();
+
+    /**
+     * New process is waiting for state, server must be stopped
+     */
+    bool requested() const
+    {
+        return m_peer >= 0;
+    }
+    bool handOver(const State &state);
+    /**
+     * Refuse request of new process (i.e. when state can't be handed
+     * over), new process exits then, and listen() can be called again.
+     */
+    void cancel();
+
+private:
+    enum Constants
+    {
+        MAX_PATH_SIZE = 4096
+    };
+
+    static const char *REQUEST;
+
+    std::string m_path;
+    int m_fd;
+    std::atomic<int> m_peer;
+    StopCallback m_stopCallback;
+    std::thread m_thread;
+
+    void run();
+};
@@ -31,6 +31,9 @@ void IoServicePool::start()
     std::vector< std::shared_ptr<std::thread> > threads;
 
     for (size_t i = 0; i < m_ioServices.size(); ++i) {
+        // After stop(), i.e. when server is resumed
+        m_ioServices[i]->reset();
+
         /**
          * static_cast<> is the work around for std::bind() vs boost::bind()
          * for overloaded functions.
@@ -55,9 +58,12 @@ void IoServicePool::stop()
     }
 }
 
-boost::asio::io_service& IoServicePool::ioService()
+boost::asio::io_service& IoServicePool::ioService(size_t *worker)
 {
     boost::asio::io_service &ioService = *m_ioServices[m_next];
+    if (worker) {
+        *worker = m_next;
+    }
 
     ++m_next;
     if (m_next == m_ioServices.size()) {
@@ -32,8 +32,9 @@ public:
 
     /**
      * Use a round-robin scheme to choose the next io_service to use.
+     * @worker is set to index of it (if not nullptr).
      */
-    boost::asio::io_service& ioService();
+    boost::asio::io_service& ioService(size_t *worker = nullptr);
 
 private:
     typedef std::shared_ptr<boost::asio::io_service> IoServicePtr;
@@ -9,23 +9,73 @@
  */
 
 #include "session.h"
+#include "kernel/commands.h"
+#include "util/probes.h"
 
 #include <boost/asio/write.hpp>
+#include <boost/format.hpp>
 #include <functional>
+#include <unistd.h>
 
 namespace PlaceHolders = std::placeholders;
 namespace Asio = boost::asio;
 
+namespace
+{
+    std::string toAddress(const Asio::ip::tcp::socket &socket)
+    {
+        boost::system::error_code error;
+        Asio::ip::tcp::endpoint endpoint = socket.remote_endpoint(error);
+        if (error) {
+            return std::string();
+        }
+        return str(boost::format("%s:%i") % endpoint.address().to_string() % endpoint.port());
+    }
+    /**
+     * Clients of unix domain sockets are usually not bound, so descriptor
+     * is used, that is unique while connection is open (i.e. for
+     * CLIENT KILL <addr>)
+     */
+    std::string toAddress(Asio::local::stream_protocol::socket &socket)
+    {
+        return str(boost::format("unix:%i") % socket.native_handle());
+    }
+}
+
 template <typename SocketType>
-Session<SocketType>::Session(boost::asio::io_service &ioService)
+Session<SocketType>::Session(boost::asio::io_service &ioService, size_t worker)
     : m_socket(ioService)
 {
+    m_client.worker = worker;
+    m_client.post = [&ioService] (const Clients::Handler &handler)
+                    {
+                        ioService.post(handler);
+                    };
+    m_client.close = [this] ()
+                     {
+                         boost::system::error_code error;
+                         m_socket.close(error);
+                     };
     m_commandHandler.setFinishCallback(std::bind(&Session::asyncWrite, this, PlaceHolders::_1));
+    m_commandHandler.setPostCallback([&ioService] (const CommandHandler::Handler &handler)
+                                     {
+                                         ioService.post(handler);
+                                     });
+    m_commandHandler.setDetachCallback([this] ()
+                                       {
+                                           return dup(m_socket.native_handle());
+                                       });
 }
 
 template <typename SocketType>
 void Session<SocketType>::start()
 {
+    Commands &commands = TheCommands::instance();
+    commands.stats().connectionOpened();
+    m_commandHandler.setAddress(toAddress(m_socket));
+    m_client.address = m_commandHandler.address();
+    commands.clients().add(m_client);
+    PROBE2(accept, &m_commandHandler, m_client.address.c_str());
     asyncRead();
 }
 
@@ -41,36 +91,73 @@ void Session<SocketType>::asyncRead()
 template <typename SocketType>
 void Session<SocketType>::asyncWrite(const std::string &message)
 {
+    m_client.outputBuffer.store(message.size(), std::memory_order_relaxed);
     Asio::async_write(m_socket,
                       Asio::buffer(message),
                       std::bind(&Session::handleWrite, this,
-                                PlaceHolders::_1));
+                                PlaceHolders::_1,
+                                PlaceHolders::_2));
 }
 
 template <typename SocketType>
 void Session<SocketType>::handleRead(const boost::system::error_code &error, size_t bytesTransferred)
 {
     if (error) {
-        delete this;
+        close();
         return;
     }
 
-    if (m_commandHandler.feedAndParseCommand(m_buffer, bytesTransferred)) {
+    PROBE2(read, &m_commandHandler, bytesTransferred);
+    m_client.touch();
+    Clients::Client::increment(m_client.bytesIn, bytesTransferred);
+
+    if (feed(m_buffer, bytesTransferred)) {
         asyncRead();
     }
 }
 
 template <typename SocketType>
-void Session<SocketType>::handleWrite(const boost::system::error_code &error)
+void Session<SocketType>::handleWrite(const boost::system::error_code &error,
+                                      size_t bytesTransferred)
 {
     if (error) {
-        delete this;
+        close();
+        return;
+    }
+
+    PROBE2(write__complete, &m_commandHandler, bytesTransferred);
+    m_client.touch();
+    m_client.outputBuffer.store(0, std::memory_order_relaxed);
+    Clients::Client::increment(m_client.bytesOut, bytesTransferred);
+
+    // Pipelined commands, that was read together with previous one
+    if (m_commandHandler.hasPendingInput() && !feed(nullptr, 0)) {
         return;
     }
 
     asyncRead();
 }
 
+template <typename SocketType>
+bool Session<SocketType>::feed(const char *buffer, size_t size)
+{
+    bool needMore = m_commandHandler.feedAndParseCommand(buffer, size);
+    m_client.inputBuffer.store(m_commandHandler.bufferCapacity(), std::memory_order_relaxed);
+    if (!needMore) {
+        Clients::Client::increment(m_client.commands, 1);
+    }
+    return needMore;
+}
+
+template <typename SocketType>
+void Session<SocketType>::close()
+{
+    Commands &commands = TheCommands::instance();
+    commands.clients().remove(m_client);
+    commands.stats().connectionClosed();
+    delete this;
+}
+
 
 // Explicit instantiations
 template class Session<boost::asio::local::stream_protocol::socket>;
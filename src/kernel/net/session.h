@@ -11,6 +11,7 @@
 #pragma once
 
 #include "kernel/commandhandler.h"
+#include "kernel/clients.h"
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
@@ -25,7 +26,10 @@ template <typename SocketType>
 class Session : boost::noncopyable
 {
 public:
-    Session(boost::asio::io_service &ioService);
+    /**
+     * @worker is index of @ioService in pool (see Clients::Client)
+     */
+    Session(boost::asio::io_service &ioService, size_t worker = 0);
 
     void start();
 
@@ -45,11 +49,20 @@ private:
     };
     char m_buffer[MAX_BUFFER_LENGTH];
     CommandHandler m_commandHandler;
+    Clients::Client m_client;
 
     void asyncRead();
     void asyncWrite(const std::string &message);
     void handleRead(const boost::system::error_code &error, size_t bytesTransferred);
-    void handleWrite(const boost::system::error_code &error);
+    void handleWrite(const boost::system::error_code &error, size_t bytesTransferred);
+    /**
+     * Return true if more data needed (i.e. command was not executed)
+     */
+    bool feed(const char *buffer, size_t size);
+    /**
+     * Connection is closed by client, or on error
+     */
+    void close();
 };
 
 typedef Session<boost::asio::local::stream_protocol::socket> UnixDomainSession;
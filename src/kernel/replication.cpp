@@ -0,0 +1,521 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "replication.h"
+#include "db/keyspace.h"
+#include "util/log.h"
+
+#include <fstream>
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+
+std::mutex ReplicaFeed::s_mutex;
+std::condition_variable ReplicaFeed::s_finishedCondition;
+size_t ReplicaFeed::s_running = 0;
+
+std::string ReplicaFeed::start(Db::Journal &journal,
+                               const CommandHandler::Arguments &arguments,
+                               CommandHandler &handler)
+{
+    if (!journal.enabled() || !journal.backlogSize()) {
+        return CommandHandler::toErrorReplyString("replication is disabled");
+    }
+
+    long long offset;
+    if (!CommandHandler::toInteger(arguments[2], offset)) {
+        return CommandHandler::toErrorReplyString("invalid offset");
+    }
+
+    int fd = handler.detach();
+    if (fd < 0) {
+        return CommandHandler::toErrorReplyString("can't replicate over this connection");
+    }
+
+    // Negative offset means that replica has nothing to continue
+    std::shared_ptr<ReplicaFeed> feed(
+        new ReplicaFeed(journal, handler, fd,
+                        (offset < 0) ? std::string() : arguments[1],
+                        (offset < 0) ? 0 : offset));
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        ++s_running;
+    }
+    std::thread(&ReplicaFeed::run, feed).detach();
+
+    return CommandHandler::REPLY_DEFERRED;
+}
+
+void ReplicaFeed::waitAll()
+{
+    std::unique_lock<std::mutex> lock(s_mutex);
+    s_finishedCondition.wait(lock, [] { return !s_running; });
+}
+
+ReplicaFeed::ReplicaFeed(Db::Journal &journal, CommandHandler &handler, int fd,
+                         const std::string &replicationId, uint64_t offset)
+    : m_journal(journal)
+    , m_handler(handler)
+    , m_fd(fd)
+    , m_replicationId(replicationId)
+    , m_offset(offset)
+{
+}
+
+void ReplicaFeed::run()
+{
+    bool synced;
+    if (m_journal.canContinue(m_replicationId, m_offset)) {
+        LOG(info) << "Replica continues from " << m_offset;
+        synced = send("+CONTINUE\r\n");
+    } else {
+        synced = fullResync();
+    }
+    if (synced) {
+        stream();
+    }
+
+    LOG(info) << "Replica disconnected at " << m_offset;
+    shutdown(m_fd, SHUT_RDWR);
+    ::close(m_fd);
+
+    /**
+     * Nothing to reply, so connection will fail on next read, and will
+     * be closed by its event loop.
+     */
+    CommandHandler *handler = &m_handler;
+    m_handler.post([handler] { handler->finish(std::string()); });
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if (!--s_running) {
+        s_finishedCondition.notify_all();
+    }
+}
+
+bool ReplicaFeed::fullResync()
+{
+    int fd;
+    uint64_t offset;
+    pid_t child = m_journal.dump(fd, offset);
+    if (child < 0) {
+        send(CommandHandler::REPLY_ERROR);
+        return false;
+    }
+    LOG(info) << "Full resync of replica started by " << child;
+
+    bool sent = send("+FULLRESYNC " + m_journal.replicationId() +
+                     " " + std::to_string(offset) + "\r\n");
+    std::vector<char> buffer(DUMP_BUFFER_SIZE);
+    while (sent) {
+        ssize_t size = read(fd, buffer.data(), buffer.size());
+        if ((size < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (size <= 0) {
+            sent = !size;
+            break;
+        }
+        sent = send(buffer.data(), size);
+    }
+    // Child gets EPIPE, if replica is gone
+    ::close(fd);
+
+    int status;
+    while ((waitpid(child, &status, 0) < 0) && (errno == EINTR)) {
+    }
+    if (!sent || !WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS)) {
+        LOG(error) << "Full resync of replica failed";
+        return false;
+    }
+
+    m_offset = offset;
+    return send("E", 1);
+}
+
+void ReplicaFeed::stream()
+{
+    std::string data;
+    while (m_journal.readStream(m_offset, data)) {
+        if (data.empty()) {
+            if (!send("P", 1)) {
+                return;
+            }
+            continue;
+        }
+
+        if (!send(data)) {
+            return;
+        }
+        m_offset += data.size();
+    }
+    if (m_journal.enabled()) {
+        LOG(warning) << "Offset " << m_offset << " of replica is not in backlog";
+    }
+}
+
+bool ReplicaFeed::send(const char *data, size_t size)
+{
+    while (size) {
+        ssize_t sent = ::send(m_fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Socket is shared with event loop, that uses non-blocking IO
+            struct pollfd pollFd = { m_fd, POLLOUT, 0 };
+            if (((errno == EAGAIN) || (errno == EWOULDBLOCK)) &&
+                (poll(&pollFd, 1, SEND_TIMEOUT) > 0)) {
+                continue;
+            }
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+
+Replica::Replica(Db::KeySpaces &keySpaces)
+    : m_keySpaces(keySpaces)
+    , m_stopped(true)
+    , m_offset(0)
+{
+}
+
+Replica::~Replica()
+{
+    stop();
+}
+
+void Replica::start(const std::string &primary)
+{
+    m_primary = primary;
+    m_stopped = false;
+    m_thread = std::thread(&Replica::run, this);
+}
+
+void Replica::stop()
+{
+    m_stopped = true;
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+bool Replica::save(const std::string &path) const
+{
+    if (m_replicationId.empty()) {
+        return false;
+    }
+
+    std::ofstream file(path.c_str());
+    file << m_replicationId << ' ' << m_offset << '\n';
+    for (const std::pair<const uint64_t, Shard> &shard : m_shards) {
+        const std::string &name = shard.second.first->name();
+        // Name is the rest of line
+        if (name.find('\n') != std::string::npos) {
+            file.setstate(std::ios::failbit);
+            break;
+        }
+        file << shard.first << ' ' << shard.second.second << ' ' << name << '\n';
+    }
+    file.close();
+
+    if (!file) {
+        LOG(error) << "Can't save replication position to " << path;
+        unlink(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Replica::load(const std::string &path)
+{
+    std::ifstream file(path.c_str());
+    std::string replicationId;
+    uint64_t offset;
+    if (!(file >> replicationId >> offset)) {
+        return false;
+    }
+
+    std::unordered_map<uint64_t, Shard> shards;
+    uint64_t id;
+    char engine;
+    std::string name;
+    while ((file >> id >> engine) && (file.get() == ' ') && std::getline(file, name)) {
+        Db::KeySpace *keySpace = m_keySpaces.findOrCreate(name);
+        if (!keySpace || ((engine != 'H') && (engine != 'A'))) {
+            return false;
+        }
+        shards[id] = Shard(keySpace, engine);
+    }
+    if (!file.eof()) {
+        return false;
+    }
+
+    m_replicationId = replicationId;
+    m_offset = offset;
+    m_shards.swap(shards);
+    LOG(info) << "Replication position " << m_offset << " of " << m_replicationId << " loaded";
+    return true;
+}
+
+void Replica::run()
+{
+    while (!m_stopped) {
+        int fd = connect();
+        if (fd >= 0) {
+            sync(fd);
+            ::close(fd);
+        }
+
+        if (!m_stopped) {
+            std::this_thread::sleep_for(std::chrono::seconds(RECONNECT_INTERVAL));
+        }
+    }
+}
+
+int Replica::connect()
+{
+    int fd = -1;
+
+    size_t colon = m_primary.rfind(':');
+    if (colon == std::string::npos) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, m_primary.c_str(), sizeof(address.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((fd >= 0) &&
+            (::connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)) {
+            ::close(fd);
+            fd = -1;
+        }
+    } else {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo *addresses;
+        const std::string host = m_primary.substr(0, colon);
+        const std::string port = m_primary.substr(colon + 1);
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+            LOG(error) << "Can't resolve primary " << m_primary;
+            return -1;
+        }
+        for (struct addrinfo *address = addresses; address; address = address->ai_next) {
+            fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+                break;
+            }
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addresses);
+    }
+
+    if (fd < 0) {
+        LOG(error) << "Can't connect to primary " << m_primary << ": " << strerror(errno);
+        return -1;
+    }
+
+    struct timeval timeout = { READ_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+void Replica::sync(int fd)
+{
+    const std::string request = m_replicationId.empty()
+                              ? std::string("PSYNC ? -1\r\n")
+                              : ("PSYNC " + m_replicationId + " " +
+                                 std::to_string(m_offset) + "\r\n");
+    if (::send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+        LOG(error) << "Can't send PSYNC to primary " << m_primary;
+        return;
+    }
+
+    std::string buffer;
+    std::string line;
+    if (!readLine(fd, buffer, line)) {
+        return;
+    }
+
+    /**
+     * Replication id and offset of state, that is received before 'E'
+     */
+    bool dumping = false;
+    std::string dumpId;
+    long long dumpOffset = 0;
+
+    const std::string fullResync = "+FULLRESYNC ";
+    if (line == "+CONTINUE") {
+        LOG(info) << "Replication from " << m_primary << " continues from " << m_offset;
+    } else if (!line.compare(0, fullResync.size(), fullResync)) {
+        size_t space = line.find(' ', fullResync.size());
+        if ((space == std::string::npos) ||
+            !CommandHandler::toInteger(line.substr(space + 1), dumpOffset) ||
+            (dumpOffset < 0)) {
+            LOG(error) << "Malformed reply of primary " << m_primary << ": " << line;
+            return;
+        }
+        dumpId = line.substr(fullResync.size(), space - fullResync.size());
+        dumping = true;
+
+        LOG(info) << "Full resync from " << m_primary;
+        // Nothing to continue from, until state is received
+        m_replicationId.clear();
+        m_shards.clear();
+        m_keySpaces.forEach([] (Db::KeySpace &keySpace) { keySpace.flush(); });
+    } else {
+        LOG(error) << "Primary " << m_primary << " refused replication: " << line;
+        return;
+    }
+
+    Db::Journal::Decoder decoder;
+    Db::Journal::Decoder::Decoded decoded;
+    std::vector<Db::Journal::Record> records;
+    Shard current(nullptr, 0);
+    std::vector<char> chunk(READ_BUFFER_SIZE);
+
+    while (!m_stopped) {
+        const char *position = buffer.data();
+        const char *end = position + buffer.size();
+        Db::Journal::Decoder::Result result;
+
+        /**
+         * Records point into buffer, so they are applied before buffer is
+         * consumed.
+         */
+        while (true) {
+            const char *begin = position;
+            result = decoder.next(position, end, decoded);
+            if (result != Db::Journal::Decoder::DECODED) {
+                break;
+            }
+
+            if (decoded.type == 'P') {
+                continue;
+            }
+            if (!dumping) {
+                m_offset += (position - begin);
+            }
+
+            if (decoded.type == 'E') {
+                if (!dumping) {
+                    result = Db::Journal::Decoder::MALFORMED;
+                    break;
+                }
+                dumping = false;
+                m_replicationId = dumpId;
+                m_offset = dumpOffset;
+                LOG(info) << "Full resync from " << m_primary << " finished";
+                continue;
+            }
+            if (decoded.type == 'N') {
+                apply(current, records);
+                records.clear();
+                current = Shard(nullptr, 0);
+
+                Db::KeySpace *keySpace = m_keySpaces.findOrCreate(decoded.keySpace);
+                if (!keySpace) {
+                    result = Db::Journal::Decoder::MALFORMED;
+                    break;
+                }
+                m_shards[decoded.id] = Shard(keySpace, decoded.engine);
+                continue;
+            }
+
+            std::unordered_map<uint64_t, Shard>::const_iterator shard = m_shards.find(decoded.id);
+            if (shard == m_shards.end()) {
+                result = Db::Journal::Decoder::MALFORMED;
+                break;
+            }
+            if (decoded.type == 'B') {
+                continue;
+            }
+            if (shard->second != current) {
+                apply(current, records);
+                records.clear();
+                current = shard->second;
+            }
+            records.push_back(decoded.record);
+        }
+        apply(current, records);
+        records.clear();
+
+        if (result == Db::Journal::Decoder::MALFORMED) {
+            LOG(error) << "Malformed stream from primary " << m_primary;
+            m_replicationId.clear();
+            return;
+        }
+        buffer.erase(0, position - buffer.data());
+
+        ssize_t size = recv(fd, chunk.data(), chunk.size(), 0);
+        if ((size < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (size <= 0) {
+            LOG(warning) << "Lost connection to primary " << m_primary;
+            return;
+        }
+        buffer.append(chunk.data(), size);
+    }
+}
+
+bool Replica::readLine(int fd, std::string &buffer, std::string &line)
+{
+    char chunk[READ_BUFFER_SIZE];
+
+    size_t end;
+    while ((end = buffer.find("\r\n")) == std::string::npos) {
+        ssize_t size = recv(fd, chunk, sizeof(chunk), 0);
+        if ((size < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (size <= 0) {
+            LOG(warning) << "Lost connection to primary " << m_primary;
+            return false;
+        }
+        buffer.append(chunk, size);
+    }
+
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 2);
+    return true;
+}
+
+void Replica::apply(const Shard &shard, const std::vector<Db::Journal::Record> &records)
+{
+    if (records.empty()) {
+        return;
+    }
+
+    if (shard.second == 'H') {
+        shard.first->hashTable().replay(records);
+    } else {
+        shard.first->avlTree().replay(records);
+    }
+}
@@ -0,0 +1,183 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include "commandhandler.h"
+#include "db/journal.h"
+
+#include <boost/noncopyable.hpp>
+#include <unordered_map>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace Db
+{
+    class KeySpace;
+    class KeySpaces;
+}
+
+
+/**
+ * @brief Primary side of replication, feeds one replica
+ *
+ * PSYNC <replication id> <offset>
+ *
+ * If @offset of @id is still in backlog of journal, replies
+ * "+CONTINUE" and streams records after it, otherwise replies
+ * "+FULLRESYNC <id> <offset>", sends state of all key-spaces
+ * (see Db::Journal::dump()) and streams records after that offset.
+ *
+ * Connection is taken over (see CommandHandler::detach()), and fed from
+ * separate thread, so event loop of connection is not blocked.
+ */
+class ReplicaFeed : boost::noncopyable
+{
+public:
+    /**
+     * Return reply for command (i.e. REPLY_DEFERRED)
+     */
+    static std::string start(Db::Journal &journal,
+                             const CommandHandler::Arguments &arguments,
+                             CommandHandler &handler);
+    /**
+     * Wait until all feeds are finished, they use connections, so must be
+     * called before connections are destroyed (and after journal is
+     * closed, so feeds do not wait for new records).
+     */
+    static void waitAll();
+
+private:
+    enum Constants
+    {
+        /**
+         * Replica that does not read for this time is disconnected
+         */
+        SEND_TIMEOUT = 60 * 1000 /* ms */,
+        DUMP_BUFFER_SIZE = 1 << 16 /* 64K */
+    };
+
+    /**
+     * Number of running feeds (see waitAll())
+     */
+    static std::mutex s_mutex;
+    static std::condition_variable s_finishedCondition;
+    static size_t s_running;
+
+    Db::Journal &m_journal;
+    CommandHandler &m_handler;
+    int m_fd;
+    std::string m_replicationId;
+    uint64_t m_offset;
+
+    ReplicaFeed(Db::Journal &journal, CommandHandler &handler, int fd,
+                const std::string &replicationId, uint64_t offset);
+
+    void run();
+    bool fullResync();
+    void stream();
+    bool send(const char *data, size_t size);
+    bool send(const std::string &data)
+    {
+        return send(data.data(), data.size());
+    }
+};
+
+/**
+ * @brief Replica side of replication
+ *
+ * Connects to primary, and applies its stream to engines (the same way
+ * as journal is replayed), reconnects and continues from last offset
+ * if connection is lost.
+ *
+ * Replica does not accept modifications from clients (see
+ * Commands::setReadOnly()).
+ *
+ * Position in stream can be saved on shutdown (with snapshot of
+ * key-spaces), so restarted replica continues from it (see save()/load()).
+ */
+class Replica : boost::noncopyable
+{
+public:
+    Replica(Db::KeySpaces &keySpaces);
+    ~Replica();
+
+    /**
+     * @primary is "host:port", or path of unix socket
+     */
+    void start(const std::string &primary);
+    void stop();
+
+    /**
+     * Replication id, offset and shards of primary, must be called while
+     * replica is stopped.
+     * Return false if there is nothing to continue from (i.e. full
+     * resync is not finished).
+     */
+    bool save(const std::string &path) const;
+    /**
+     * Continue from position of save(), key-spaces must have state of
+     * that moment (i.e. loaded from snapshot).
+     * Must be called before start().
+     */
+    bool load(const std::string &path);
+
+private:
+    enum Constants
+    {
+        READ_BUFFER_SIZE = 1 << 16 /* 64K */,
+        /**
+         * Primary sends pings every second, so connection is considered
+         * dead after this time without any data.
+         */
+        READ_TIMEOUT = 5 /* sec */,
+        RECONNECT_INTERVAL = 1 /* sec */
+    };
+
+    Db::KeySpaces &m_keySpaces;
+    std::string m_primary;
+    std::atomic<bool> m_stopped;
+    std::thread m_thread;
+
+    /**
+     * Position in stream of primary, to continue from
+     */
+    std::string m_replicationId;
+    uint64_t m_offset;
+    /**
+     * Shards of primary, ids are valid only for its replication id
+     */
+    typedef std::pair<Db::KeySpace *, char> Shard;
+    std::unordered_map<uint64_t, Shard> m_shards;
+
+    void run();
+    /**
+     * Return connected socket, -1 on errors
+     */
+    int connect();
+    /**
+     * Send PSYNC and apply stream, until connection is lost
+     */
+    void sync(int fd);
+    /**
+     * Read line of reply, @buffer keeps data after it
+     */
+    bool readLine(int fd, std::string &buffer, std::string &line);
+    /**
+     * Apply records of one shard at once
+     */
+    void apply(const Shard &shard, const std::vector<Db::Journal::Record> &records);
+};
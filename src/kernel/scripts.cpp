@@ -0,0 +1,58 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include "scripts.h"
+
+#include <boost/uuid/detail/sha1.hpp>
+#include <boost/format.hpp>
+
+
+std::string Scripts::sha1(const std::string &code)
+{
+    boost::uuids::detail::sha1 sha1;
+    sha1.process_bytes(code.data(), code.size());
+
+    unsigned int digest[5];
+    sha1.get_digest(digest);
+
+    std::string hex;
+    for (unsigned int word : digest) {
+        hex += str(boost::format("%08x") % word);
+    }
+    return hex;
+}
+
+std::string Scripts::load(const std::string &code)
+{
+    std::string key = sha1(code);
+
+    std::lock_guard<std::mutex> lock(m_access);
+    m_scripts[key] = code;
+
+    return key;
+}
+
+bool Scripts::find(const std::string &sha1, std::string &code)
+{
+    std::lock_guard<std::mutex> lock(m_access);
+
+    Map::const_iterator found = m_scripts.find(sha1);
+    if (found == m_scripts.end()) {
+        return false;
+    }
+    code = found->second;
+    return true;
+}
+
+void Scripts::flush()
+{
+    std::lock_guard<std::mutex> lock(m_access);
+    m_scripts.clear();
+}
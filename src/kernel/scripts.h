@@ -0,0 +1,48 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <unordered_map>
+#include <mutex>
+#include <string>
+
+
+/**
+ * @brief Registry of stored scripts (SCRIPT LOAD), by SHA1 of source
+ *
+ * Only sources are stored here, compiled functions are cached by isolates
+ * of every worker (see JsVmIsolate::compile()).
+ */
+class Scripts : boost::noncopyable
+{
+public:
+    /**
+     * Hex SHA1 of @code
+     */
+    static std::string sha1(const std::string &code);
+
+    /**
+     * Return SHA1 of @code
+     */
+    std::string load(const std::string &code);
+    /**
+     * Return false if there is no such script
+     */
+    bool find(const std::string &sha1, std::string &code);
+    void flush();
+
+private:
+    typedef std::unordered_map<std::string, std::string> Map;
+
+    Map m_scripts;
+    std::mutex m_access;
+};
@@ -0,0 +1,126 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "slowlog.h"
+
+#include <boost/format.hpp>
+#include <algorithm>
+
+
+thread_local SlowLog::Ring *SlowLog::s_ring = nullptr;
+
+SlowLog::SlowLog()
+    : m_threshold(-1)
+    , m_maxLength(0)
+    , m_nextId(0)
+{
+}
+
+void SlowLog::configure(long long threshold, size_t maxLength)
+{
+    m_threshold = threshold;
+    m_maxLength = maxLength;
+}
+
+std::vector<SlowLog::Entry> SlowLog::get(size_t count) const
+{
+    std::vector<Entry> entries;
+    {
+        std::lock_guard<std::mutex> lock(m_ringsMutex);
+
+        for (const std::unique_ptr<Ring> &ring : m_rings) {
+            std::lock_guard<std::mutex> ringLock(ring->mutex);
+            entries.insert(entries.end(), ring->entries.begin(), ring->entries.end());
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [] (const Entry &a, const Entry &b)
+    {
+        return a.id > b.id;
+    });
+    if (entries.size() > count) {
+        entries.resize(count);
+    }
+    return entries;
+}
+
+size_t SlowLog::length() const
+{
+    std::lock_guard<std::mutex> lock(m_ringsMutex);
+
+    size_t length = 0;
+    for (const std::unique_ptr<Ring> &ring : m_rings) {
+        std::lock_guard<std::mutex> ringLock(ring->mutex);
+        length += ring->entries.size();
+    }
+    return length;
+}
+
+void SlowLog::reset()
+{
+    std::lock_guard<std::mutex> lock(m_ringsMutex);
+
+    for (const std::unique_ptr<Ring> &ring : m_rings) {
+        std::lock_guard<std::mutex> ringLock(ring->mutex);
+        ring->entries.clear();
+    }
+}
+
+void SlowLog::record(const std::vector<std::string> &arguments, const std::string &address,
+                     uint64_t duration)
+{
+    Entry entry;
+    entry.id = m_nextId.fetch_add(1, std::memory_order_relaxed);
+    entry.time = time(nullptr);
+    entry.duration = duration;
+    entry.address = address;
+
+    const size_t numberOfArguments = std::min<size_t>(arguments.size(), MAX_ARGUMENTS);
+    entry.arguments.reserve(numberOfArguments);
+    for (size_t i = 0; i < numberOfArguments; ++i) {
+        const std::string &argument = arguments[i];
+
+        // The last one tells how many are omitted
+        if ((i == (MAX_ARGUMENTS - 1)) && (arguments.size() > MAX_ARGUMENTS)) {
+            entry.arguments.push_back(str(boost::format("... (%i more arguments)")
+                                          % (arguments.size() - i)));
+            break;
+        }
+        if (argument.size() > MAX_ARGUMENT_SIZE) {
+            entry.arguments.push_back(argument.substr(0, MAX_ARGUMENT_SIZE) +
+                                      str(boost::format("... (%i more bytes)")
+                                          % (argument.size() - MAX_ARGUMENT_SIZE)));
+            continue;
+        }
+        entry.arguments.push_back(argument);
+    }
+
+    Ring &ring = this->ring();
+    std::lock_guard<std::mutex> lock(ring.mutex);
+
+    ring.entries.push_back(std::move(entry));
+    while (ring.entries.size() > m_maxLength) {
+        ring.entries.pop_front();
+    }
+}
+
+SlowLog::Ring &SlowLog::ring()
+{
+    if (s_ring) {
+        return *s_ring;
+    }
+
+    // Rings are never freed, so entries of exited threads are kept
+    std::lock_guard<std::mutex> lock(m_ringsMutex);
+    m_rings.emplace_back(new Ring);
+    s_ring = m_rings.back().get();
+    return *s_ring;
+}
@@ -0,0 +1,107 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <ctime>
+
+
+/**
+ * @brief Commands, that took more than threshold (SLOWLOG)
+ *
+ * Every thread (i.e. worker) records into its own bounded ring, so
+ * workers do not contend with each other, rings are merged only by
+ * SLOWLOG GET.
+ *
+ * There must be only one instance (see Commands::slowLog()), ring of
+ * thread is cached in thread_local.
+ */
+class SlowLog : boost::noncopyable
+{
+public:
+    struct Entry
+    {
+        uint64_t id;
+        time_t time;
+        uint64_t duration; /* usec */
+        /**
+         * Truncated, see MAX_ARGUMENTS/MAX_ARGUMENT_SIZE
+         */
+        std::vector<std::string> arguments;
+        std::string address;
+    };
+
+    SlowLog();
+
+    /**
+     * Commands that took at least @threshold usec are logged, negative
+     * @threshold disables logging.
+     * Ring of every thread keeps last @maxLength entries.
+     * Must be called before server is started.
+     */
+    void configure(long long threshold, size_t maxLength);
+    bool enabled() const
+    {
+        return m_threshold >= 0;
+    }
+
+    void check(const std::vector<std::string> &arguments, const std::string &address,
+               uint64_t duration)
+    {
+        if ((long long)duration >= m_threshold) {
+            record(arguments, address, duration);
+        }
+    }
+
+    /**
+     * Last @count entries of all threads, newest first
+     */
+    std::vector<Entry> get(size_t count) const;
+    size_t length() const;
+    void reset();
+
+private:
+    enum Constants
+    {
+        MAX_ARGUMENTS = 32,
+        MAX_ARGUMENT_SIZE = 128
+    };
+
+    struct Ring
+    {
+        /**
+         * Taken by owner thread and by readers only, so it is not contended
+         */
+        std::mutex mutex;
+        std::deque<Entry> entries;
+    };
+
+    static thread_local Ring *s_ring;
+
+    long long m_threshold;
+    size_t m_maxLength;
+    std::atomic<uint64_t> m_nextId;
+
+    std::vector< std::unique_ptr<Ring> > m_rings;
+    mutable std::mutex m_ringsMutex;
+
+    void record(const std::vector<std::string> &arguments, const std::string &address,
+                uint64_t duration);
+    Ring &ring();
+};
@@ -0,0 +1,144 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#include "stats.h"
+
+#include <boost/format.hpp>
+#include <algorithm>
+#include <cmath>
+
+
+thread_local Stats::Shard *Stats::s_shard = nullptr;
+
+Stats::Stats()
+    : m_connections(0)
+    , m_totalConnections(0)
+    , m_startTime(time(nullptr))
+{
+}
+
+size_t Stats::addCommand(const std::string &name)
+{
+    m_commands.push_back(name);
+    return (m_commands.size() - 1);
+}
+
+void Stats::record(size_t command, uint64_t nanoseconds)
+{
+    Counters &counters = shard().counters[command];
+
+    // The only writer, so no need in fetch_add()
+    counters.calls.store(counters.calls.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+    counters.nanoseconds.store(counters.nanoseconds.load(std::memory_order_relaxed) + nanoseconds,
+                               std::memory_order_relaxed);
+    std::atomic<uint64_t> &bucketCounter = counters.histogram[bucket(nanoseconds)];
+    bucketCounter.store(bucketCounter.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+}
+
+std::string Stats::commandStats() const
+{
+    static const double PERCENTILES[] = { 0.5, 0.99, 0.999 };
+    static const char *PERCENTILE_NAMES[] = { "p50", "p99", "p999" };
+
+    std::lock_guard<std::mutex> lock(m_shardsMutex);
+
+    std::string stats;
+    std::vector<uint64_t> histogram(HISTOGRAM_BUCKETS);
+    for (size_t command = 0; command < m_commands.size(); ++command) {
+        uint64_t calls = 0;
+        uint64_t nanoseconds = 0;
+        std::fill(histogram.begin(), histogram.end(), 0);
+
+        for (const std::unique_ptr<Shard> &shard : m_shards) {
+            const Counters &counters = shard->counters[command];
+            calls += counters.calls.load(std::memory_order_relaxed);
+            nanoseconds += counters.nanoseconds.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                histogram[i] += counters.histogram[i].load(std::memory_order_relaxed);
+            }
+        }
+        if (!calls) {
+            continue;
+        }
+
+        stats += str(boost::format("cmdstat_%s:calls=%i,usec=%i,usec_per_call=%.2f")
+                     % m_commands[command]
+                     % calls
+                     % (nanoseconds / 1000)
+                     % (nanoseconds / 1000.0 / calls));
+
+        // Shards are not read at once, so total can differ from calls
+        uint64_t total = 0;
+        for (uint64_t count : histogram) {
+            total += count;
+        }
+        size_t i = 0;
+        uint64_t seen = 0;
+        for (size_t p = 0; p < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); ++p) {
+            // First bucket, where at least rank values are seen
+            const uint64_t rank = std::max<uint64_t>(1, std::ceil(PERCENTILES[p] * total));
+            while ((i < (HISTOGRAM_BUCKETS - 1)) && ((seen + histogram[i]) < rank)) {
+                seen += histogram[i];
+                ++i;
+            }
+            stats += str(boost::format(",%s=%.3f")
+                         % PERCENTILE_NAMES[p]
+                         % (bucketUpperBound(i) / 1000.0));
+        }
+        stats += "\r\n";
+    }
+    return stats;
+}
+
+Stats::Shard &Stats::shard()
+{
+    if (s_shard) {
+        return *s_shard;
+    }
+
+    std::unique_ptr<Shard> shard(new Shard);
+    shard->counters.reset(new Counters[m_commands.size()]);
+    for (size_t i = 0; i < m_commands.size(); ++i) {
+        Counters &counters = shard->counters[i];
+        counters.calls = 0;
+        counters.nanoseconds = 0;
+        for (std::atomic<uint64_t> &count : counters.histogram) {
+            count = 0;
+        }
+    }
+
+    // Shards are never freed, so counters of exited threads are kept
+    std::lock_guard<std::mutex> lock(m_shardsMutex);
+    s_shard = shard.get();
+    m_shards.push_back(std::move(shard));
+    return *s_shard;
+}
+
+size_t Stats::bucket(uint64_t value)
+{
+    if (value < 4) {
+        return value;
+    }
+    const int exponent = (63 - __builtin_clzll(value));
+    return (((exponent - 1) * 4) + ((value >> (exponent - 2)) & 3));
+}
+
+uint64_t Stats::bucketUpperBound(size_t bucket)
+{
+    if (bucket < 4) {
+        return bucket;
+    }
+    const int exponent = ((bucket / 4) + 1);
+    const uint64_t lower = ((4 + (bucket % 4)) << (exponent - 2));
+    return (lower + (1ULL << (exponent - 2)) - 1);
+}
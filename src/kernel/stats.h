@@ -0,0 +1,121 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <ctime>
+
+
+/**
+ * @brief Counters for INFO
+ *
+ * Every thread records calls of commands into its own shard, without
+ * locks and atomic read-modify-write (there is only one writer of shard),
+ * shards are merged only when INFO is read.
+ *
+ * Latencies are recorded into log-linear histograms (like HDR histogram):
+ * every power of two is split into 4 buckets, so error is less than 25%.
+ *
+ * There must be only one instance (see Commands::stats()), shard of
+ * thread is cached in thread_local.
+ */
+class Stats : boost::noncopyable
+{
+public:
+    Stats();
+
+    /**
+     * Return id of command for record(), all commands must be added
+     * before anything is recorded.
+     */
+    size_t addCommand(const std::string &name);
+    void record(size_t command, uint64_t nanoseconds);
+    /**
+     * Record call of command, that was started at @start
+     */
+    void recordSince(size_t command, std::chrono::steady_clock::time_point start)
+    {
+        record(command, std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+    void connectionOpened()
+    {
+        m_connections.fetch_add(1, std::memory_order_relaxed);
+        m_totalConnections.fetch_add(1, std::memory_order_relaxed);
+    }
+    void connectionClosed()
+    {
+        m_connections.fetch_sub(1, std::memory_order_relaxed);
+    }
+    uint64_t connections() const
+    {
+        return m_connections.load(std::memory_order_relaxed);
+    }
+    uint64_t totalConnections() const
+    {
+        return m_totalConnections.load(std::memory_order_relaxed);
+    }
+
+    time_t startTime() const
+    {
+        return m_startTime;
+    }
+
+    /**
+     * "cmdstat_<name>:calls=..." line for every called command
+     */
+    std::string commandStats() const;
+
+private:
+    enum Constants
+    {
+        /**
+         * Values less than 4 has own buckets, and 4 buckets for every
+         * power of two after that (up to 2^63)
+         */
+        HISTOGRAM_BUCKETS = 252
+    };
+
+    struct Counters
+    {
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> nanoseconds;
+        std::atomic<uint64_t> histogram[HISTOGRAM_BUCKETS];
+    };
+    struct Shard
+    {
+        std::unique_ptr<Counters[]> counters;
+    };
+
+    static thread_local Shard *s_shard;
+
+    std::vector<std::string> m_commands;
+    std::vector< std::unique_ptr<Shard> > m_shards;
+    mutable std::mutex m_shardsMutex;
+
+    std::atomic<uint64_t> m_connections;
+    std::atomic<uint64_t> m_totalConnections;
+    time_t m_startTime;
+
+    Shard &shard();
+
+    static size_t bucket(uint64_t value);
+    static uint64_t bucketUpperBound(size_t bucket);
+};
@@ -0,0 +1,161 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include "transaction.h"
+
+#include "commands.h"
+#include "db/keyspace.h"
+#include "db/lock.h"
+#include "util/probes.h"
+
+#include <boost/format.hpp>
+
+
+const char *Transaction::REPLY_QUEUED          = "+QUEUED\r\n";
+const char *Transaction::REPLY_ABORTED         = "*-1\r\n";
+const char *Transaction::REPLY_ERROR_EXECABORT = "-EXECABORT Transaction discarded because of previous errors\r\n";
+
+Transaction::Transaction()
+    : m_active(false)
+    , m_dirty(false)
+{
+}
+
+std::string Transaction::begin()
+{
+    if (m_active) {
+        return CommandHandler::toErrorReplyString("MULTI calls can not be nested");
+    }
+
+    m_active = true;
+    return CommandHandler::REPLY_OK;
+}
+
+std::string Transaction::queue(const Arguments &arguments,
+                               CommandHandler &handler)
+{
+    Commands &commands = TheCommands::instance();
+
+    const Commands::CallbackInfo *info = commands.lookup(arguments[0],
+                                                         arguments.size() - 1);
+    if (!info) {
+        m_dirty = true;
+        // Reply with the same error, as without transaction
+        return commands.find(arguments[0], arguments.size() - 1)(arguments, handler);
+    }
+    if (info->flags & Commands::NO_TRANSACTION) {
+        m_dirty = true;
+        return CommandHandler::toErrorReplyString(
+            str(boost::format("%s is not allowed in transaction") % arguments[0]));
+    }
+
+    m_queue.push_back(arguments);
+    return REPLY_QUEUED;
+}
+
+std::string Transaction::exec(CommandHandler &handler)
+{
+    if (!m_active) {
+        return CommandHandler::toErrorReplyString("EXEC without MULTI");
+    }
+
+    Queue queue;
+    Watches watches;
+    bool dirty = m_dirty;
+    queue.swap(m_queue);
+    watches.swap(m_watches);
+    m_active = m_dirty = false;
+
+    if (dirty) {
+        return REPLY_ERROR_EXECABORT;
+    }
+
+    Commands &commands = TheCommands::instance();
+    Db::KeySpace &keySpace = handler.keySpace();
+
+    std::vector<Db::Mutex *> mutexes;
+    for (const CommandHandler::Arguments &arguments : queue) {
+        const int flags = commands.lookup(arguments[0], arguments.size() - 1)->flags;
+
+        if (flags & Commands::HASHTABLE) {
+            mutexes.push_back(&keySpace.hashTable().mutex());
+        }
+        if (flags & Commands::AVLTREE) {
+            mutexes.push_back(&keySpace.avlTree().mutex());
+        }
+    }
+    for (const Watch &watch : watches) {
+        mutexes.push_back(&watch.keySpace->hashTable().mutex());
+        mutexes.push_back(&watch.keySpace->avlTree().mutex());
+    }
+
+    Db::BatchLock lock(mutexes);
+
+    for (const Watch &watch : watches) {
+        if (changed(watch)) {
+            return REPLY_ABORTED;
+        }
+    }
+
+    std::vector<std::string> replies;
+    replies.reserve(queue.size());
+    for (const CommandHandler::Arguments &arguments : queue) {
+        const std::string &name = arguments[0];
+        const size_t keyLength = ((arguments.size() > 1) ? arguments[1].size() : 0);
+
+        // Like for commands outside of transaction (see CommandHandler)
+        PROBE3(command__start, &handler, name.c_str(), keyLength);
+        replies.push_back(commands.find(name, arguments.size() - 1)
+                          (arguments, handler));
+        PROBE3(command__done, &handler, name.c_str(), keyLength);
+    }
+    return CommandHandler::toMultiBulkReplyString(replies);
+}
+
+std::string Transaction::discard()
+{
+    if (!m_active) {
+        return CommandHandler::toErrorReplyString("DISCARD without MULTI");
+    }
+
+    m_queue.clear();
+    m_watches.clear();
+    m_active = m_dirty = false;
+    return CommandHandler::REPLY_OK;
+}
+
+std::string Transaction::watch(const Arguments &arguments,
+                               Db::KeySpace &keySpace)
+{
+    if (m_active) {
+        return CommandHandler::toErrorReplyString("WATCH inside MULTI is not allowed");
+    }
+
+    for (size_t i = 1; i < arguments.size(); ++i) {
+        const std::string &key = arguments[i];
+        m_watches.push_back(Watch {
+            &keySpace, key,
+            keySpace.hashTable().versionOf(key),
+            keySpace.avlTree().versionOf(key)
+        });
+    }
+    return CommandHandler::REPLY_OK;
+}
+
+void Transaction::unwatch()
+{
+    m_watches.clear();
+}
+
+bool Transaction::changed(const Watch &watch)
+{
+    return (watch.keySpace->hashTable().versionOf(watch.key) != watch.hashTableVersion) ||
+           (watch.keySpace->avlTree().versionOf(watch.key) != watch.avlTreeVersion);
+}
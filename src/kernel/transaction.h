@@ -0,0 +1,84 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class CommandHandler;
+namespace Db
+{
+    class KeySpace;
+}
+
+/**
+ * @brief MULTI/EXEC transaction of connection
+ *
+ * Commands after MULTI are queued, and executed at EXEC as one batch,
+ * with only one lock acquisition per engine involved (see Db::BatchLock).
+ *
+ * WATCH is optimistic, it remembers versions of keys (in all engines of
+ * key-space), and EXEC is aborted if any of them changed.
+ */
+class Transaction : boost::noncopyable
+{
+public:
+    /**
+     * The same as CommandHandler::Arguments (that can't be included here,
+     * since CommandHandler owns Transaction)
+     */
+    typedef std::vector<std::string> Arguments;
+
+    static const char *REPLY_QUEUED;
+    static const char *REPLY_ABORTED;
+    static const char *REPLY_ERROR_EXECABORT;
+
+    Transaction();
+
+    bool isActive() const
+    {
+        return m_active;
+    }
+
+    std::string begin();
+    std::string queue(const Arguments &arguments,
+                      CommandHandler &handler);
+    std::string exec(CommandHandler &handler);
+    std::string discard();
+
+    std::string watch(const Arguments &arguments,
+                      Db::KeySpace &keySpace);
+    void unwatch();
+
+private:
+    struct Watch
+    {
+        Db::KeySpace *keySpace;
+        std::string key;
+        uint64_t hashTableVersion;
+        uint64_t avlTreeVersion;
+    };
+    typedef std::vector<Watch> Watches;
+    typedef std::vector<Arguments> Queue;
+
+    bool m_active;
+    /**
+     * Some of commands was not queued because of errors,
+     * EXEC will be discarded.
+     */
+    bool m_dirty;
+    Queue m_queue;
+    Watches m_watches;
+
+    static bool changed(const Watch &watch);
+};
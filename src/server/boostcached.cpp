@@ -9,10 +9,23 @@
  */
 
 #include "server/options.h"
+#include "server/jsworkers.h"
+#include "server/jsvm.h"
 #include "util/log.h"
 #include "kernel/net/commandserver.h"
+#include "kernel/commands.h"
+#include "kernel/replication.h"
+#include "kernel/net/handoff.h"
+#include "db/tier.h"
+#include "db/tiercompactor.h"
+#include "db/hotkeys.h"
 
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <algorithm>
 #include <exception>
+#include <vector>
+#include <string>
 #include <unistd.h>
 #include <v8.h>
 
@@ -31,20 +44,187 @@ int main(int argc, char **argv)
     v8::V8::Initialize();
     LOG(trace) << "v8 vm initialized (" << v8::V8::GetVersion() << ")";
 
+    TheJsWorkers::instance().start(options.getValue<int>("js-workers"));
+
+    std::string tierDirectory = options.getValue<std::string>("tier-directory");
+    if (tierDirectory.size()) {
+        Db::Tier::configure(tierDirectory,
+                            options.getValue<int>("tier-min-value-size"),
+                            options.getValue<int>("tier-idle"));
+    }
+    Db::HotKeys::configure(std::max(options.getValue<int>("hotkeys-sample-rate"), 0));
+
+    Commands &commands = TheCommands::instance();
+    commands.snapshot().setPath(options.getValue<std::string>("snapshot"));
+    commands.slowLog().configure(options.getValue<int>("slowlog-threshold"),
+                                 std::max(options.getValue<int>("slowlog-max-len"), 0));
+
+    std::string journal = options.getValue<std::string>("journal");
+    std::string primary = options.getValue<std::string>("replica-of");
+    int backlogSize = options.getValue<int>("replication-backlog");
+    Replica replica(commands.keySpaces());
+    // Saved with snapshot on shutdown of replica
+    const std::string replicationPosition = options.getValue<std::string>("snapshot") + ".replica";
+
+    std::string handoffSocket = options.getValue<std::string>("handoff-socket");
+    Handoff::State inherited;
+    bool tookOver = false;
+    if (handoffSocket.size()) {
+        // Journal is replayed anyway, and replica resyncs with primary
+        if (journal.size() || primary.size()) {
+            LOG(fatal) << "Warm restart is not supported with journal or on replica";
+            return EXIT_FAILURE;
+        }
+        if (!Handoff::takeOver(handoffSocket, inherited, tookOver)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (primary.size()) {
+        // Modifications come only from primary, they are not logged
+        if (journal.size() || backlogSize) {
+            LOG(fatal) << "Journal and replication backlog are not supported on replica";
+            return EXIT_FAILURE;
+        }
+        commands.setReadOnly(true);
+
+        // Otherwise there is nothing to continue from, and it will be full resync
+        if (access(replicationPosition.c_str(), F_OK) == 0) {
+            if (!commands.snapshot().load()) {
+                return EXIT_FAILURE;
+            }
+            replica.load(replicationPosition);
+            // Snapshot is not up to date after this run modified key-spaces
+            unlink(replicationPosition.c_str());
+        }
+        replica.start(primary);
+    } else if (journal.size()) {
+        Db::Journal::FsyncPolicy policy;
+        if (!Db::Journal::parseFsyncPolicy(options.getValue<std::string>("journal-fsync"),
+                                           policy)) {
+            LOG(fatal) << "Unknown fsync policy";
+            return EXIT_FAILURE;
+        }
+
+        // Journal has all modifications, so snapshot is not loaded
+        commands.journal().setBacklogSize(backlogSize);
+        if (!commands.journal().replay(journal, commands.keySpaces()) ||
+            !commands.journal().open(journal, policy, commands.keySpaces())) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        bool loaded;
+        if (tookOver) {
+            // Snapshot that is handed over is in memory, and is not needed after
+            commands.snapshot().setPath(inherited.snapshot);
+            loaded = commands.snapshot().load();
+            unlink(inherited.snapshot.c_str());
+            commands.snapshot().setPath(options.getValue<std::string>("snapshot"));
+        } else {
+            loaded = commands.snapshot().load();
+        }
+        if (!loaded) {
+            return EXIT_FAILURE;
+        }
+
+        // Records are only streamed to replicas
+        if (backlogSize) {
+            commands.journal().setBacklogSize(backlogSize);
+            if (!commands.journal().open(std::string(), Db::Journal::FSYNC_NO,
+                                         commands.keySpaces())) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // After snapshot/journal, that can't have such key-spaces
+    std::vector<std::string> datasets;
+    std::string datasetsOption = options.getValue<std::string>("dataset");
+    if (datasetsOption.size()) {
+        boost::split(datasets, datasetsOption, boost::is_any_of(","));
+    }
+    for (const std::string &dataset : datasets) {
+        size_t separator = dataset.find('=');
+        if ((separator == std::string::npos) || !separator) {
+            LOG(fatal) << "Malformed dataset " << dataset << ", name=path expected";
+            return EXIT_FAILURE;
+        }
+        if (!commands.keySpaces().attach(dataset.substr(0, separator),
+                                         dataset.substr(separator + 1))) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    Db::TierCompactor tierCompactor(commands.keySpaces());
+    if (Db::Tier::enabled()) {
+        tierCompactor.start();
+    }
+
     try {
         CommandServer server(CommandServer::Options(
             options.getValue<int>("port"),
             options.getValue<std::string>("host"),
             options.getValue<std::string>("socket"),
-            options.getValue<int>("workers")
+            options.getValue<int>("workers"),
+            inherited.tcpFd,
+            inherited.unixDomainFd
         ));
-        server.start();
+
+        Handoff handoff(handoffSocket);
+        handoff.setStopCallback([&server] { server.stop(); });
+        if (handoffSocket.size() && !handoff.listen()) {
+            return EXIT_FAILURE;
+        }
+
+        for (;;) {
+            server.start();
+
+            handoff.stop();
+            if (!handoff.requested()) {
+                break;
+            }
+
+            // Workers are stopped, so snapshot has all modifications
+            Handoff::State state;
+            state.tcpFd = server.tcpFd();
+            state.unixDomainFd = server.unixDomainFd();
+            state.snapshot = str(boost::format("%s/boostcached-%i.snapshot")
+                                 % options.getValue<std::string>("handoff-directory")
+                                 % getpid());
+            commands.snapshot().setPath(state.snapshot);
+            bool saved = commands.snapshot().save();
+            commands.snapshot().setPath(options.getValue<std::string>("snapshot"));
+            if (saved && handoff.handOver(state)) {
+                break;
+            }
+
+            // New process exits, and this one serves clients again
+            LOG(error) << "Warm restart failed, resuming";
+            unlink(state.snapshot.c_str());
+            handoff.cancel();
+            if (!handoff.listen()) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Feeds of replicas stop streaming, and do not outlive connections
+        commands.journal().close();
+        ReplicaFeed::waitAll();
     } catch (const std::exception &exception) {
         LOG(fatal) << exception.what();
 
         return EXIT_FAILURE;
     }
 
+    replica.stop();
+    if (primary.size() && commands.snapshot().save()) {
+        replica.save(replicationPosition);
+    }
+    tierCompactor.stop();
+
+    // Isolates of workers must be disposed before v8
+    TheJsWorkers::instance().stop();
+
     LOG(trace) << "Freeing v8 vm resources";
     v8::V8::Dispose();
 
@@ -13,6 +13,8 @@
 #include "kernel/exception.h"
 #include "config.h" /** HAVE_* */
 
+#include <cmath>
+
 
 /**
  * XXX: get rid of support for old v8
@@ -69,10 +71,28 @@ namespace Js
 
 namespace {
 #ifdef HAVE_V8_WITH_MOST_CONSTRUCTORS_ISOLATE
-    v8::Local<v8::String> newUtf8String(const char *data)
+    v8::Local<v8::String> newUtf8String(const char *data, int length = -1)
+    {
+        return v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), data,
+                                       v8::String::kNormalString, length);
+    }
+    v8::Handle<v8::Primitive> newUndefined()
+    {
+        return v8::Undefined(v8::Isolate::GetCurrent());
+    }
+    v8::Handle<v8::Primitive> newNull()
     {
-        return v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), data);
+        return v8::Null(v8::Isolate::GetCurrent());
     }
+    v8::Local<v8::Array> newArray(int length)
+    {
+        return v8::Array::New(v8::Isolate::GetCurrent(), length);
+    }
+    class HandleScope : public v8::HandleScope
+    {
+    public:
+        HandleScope() : v8::HandleScope(v8::Isolate::GetCurrent()) {}
+    };
     v8::Local<v8::FunctionTemplate> newFunctionTemplate(v8::FunctionCallback callback = NULL)
     {
         return v8::FunctionTemplate::New(v8::Isolate::GetCurrent(), callback);
@@ -82,11 +102,40 @@ namespace {
     {
         return v8::Context::New(v8::Isolate::GetCurrent(), extensions, global_template);
     }
+
+    template <class T>
+    void persist(v8::Persistent<T> &persistent, v8::Handle<T> handle)
+    {
+        persistent.Reset(v8::Isolate::GetCurrent(), handle);
+    }
+    template <class T>
+    v8::Local<T> unpersist(const v8::Persistent<T> &persistent)
+    {
+        return v8::Local<T>::New(v8::Isolate::GetCurrent(), persistent);
+    }
+    template <class T>
+    void dispose(v8::Persistent<T> &persistent)
+    {
+        persistent.Reset();
+    }
 #else
-    v8::Local<v8::String> newUtf8String(const char *data)
+    v8::Local<v8::String> newUtf8String(const char *data, int length = -1)
+    {
+        return v8::String::New(data, length);
+    }
+    v8::Handle<v8::Primitive> newUndefined()
+    {
+        return v8::Undefined();
+    }
+    v8::Handle<v8::Primitive> newNull()
     {
-        return v8::String::New(data);
+        return v8::Null();
     }
+    v8::Local<v8::Array> newArray(int length)
+    {
+        return v8::Array::New(length);
+    }
+    typedef v8::HandleScope HandleScope;
     v8::Local<v8::FunctionTemplate> newFunctionTemplate(v8::InvocationCallback callback = NULL)
     {
         return v8::FunctionTemplate::New(callback);
@@ -96,77 +145,361 @@ namespace {
     {
         return v8::Context::New(extensions, global_template);
     }
+
+    template <class T>
+    void persist(v8::Persistent<T> &persistent, v8::Handle<T> handle)
+    {
+        persistent = v8::Persistent<T>::New(handle);
+    }
+    /**
+     * Context::New() already returns persistent handle
+     */
+    void persist(v8::Persistent<v8::Context> &persistent, v8::Persistent<v8::Context> handle)
+    {
+        persistent = handle;
+    }
+    template <class T>
+    v8::Local<T> unpersist(const v8::Persistent<T> &persistent)
+    {
+        return v8::Local<T>::New(persistent);
+    }
+    template <class T>
+    void dispose(v8::Persistent<T> &persistent)
+    {
+        persistent.Dispose();
+        persistent.Clear();
+    }
 #endif
 }
 
-JsVm::JsVm(const std::string &code)
+JsVmIsolate::JsVmIsolate()
     : m_isolate(v8::Isolate::New())
-    , m_isolateScope(m_isolate)
-    , m_locker(m_isolate)
+{
+    v8::Isolate::Scope isolateScope(m_isolate);
+    v8::Locker locker(m_isolate);
 #ifdef HAVE_V8_WITH_MOST_CONSTRUCTORS_ISOLATE
-    , m_scope(m_isolate)
+    v8::HandleScope scope(m_isolate);
+#else
+    v8::HandleScope scope;
 #endif
-    , m_global(v8::ObjectTemplate::New())
-{
+
+    v8::Handle<v8::ObjectTemplate> global = v8::ObjectTemplate::New();
     v8::Handle<v8::ObjectTemplate> console = v8::ObjectTemplate::New();
-    m_global->Set(newUtf8String("console"), console);
+    global->Set(newUtf8String("console"), console);
 
     console->Set(newUtf8String("log"),
                  newFunctionTemplate(&Js::log));
     console->Set(newUtf8String("error"),
                  newFunctionTemplate(&Js::error));
 
+    persist(m_global, global);
+}
+JsVmIsolate::~JsVmIsolate()
+{
+    {
+        v8::Isolate::Scope isolateScope(m_isolate);
+        v8::Locker locker(m_isolate);
+
+        m_scripts.clear();
+        dispose(m_global);
+    }
+    m_isolate->Dispose();
+}
+
+JsVmIsolate::Script::~Script()
+{
+    dispose(script);
+}
+
+v8::Local<v8::Context> JsVmIsolate::createContext()
+{
     /**
-     * We can't do this inside initialization list, since we are modifying
-     * "m_global", and during ths gc can update references to it, since we are
-     * adding _properties_ to it.
-     *
-     * And also to avoid Context::Scope for every call(), just enter context
+     * Old v8 returns persistent handle, that must be disposed,
+     * local handle keeps context alive for current handle scope.
+     */
+    v8::Persistent<v8::Context> persistent;
+    persist(persistent, newContext(NULL, unpersist(m_global)));
+    v8::Local<v8::Context> context = unpersist(persistent);
+    dispose(persistent);
+    return context;
+}
+
+v8::Local<v8::Function> JsVmIsolate::compile(const std::string &code)
+{
+    const size_t hash = std::hash<std::string>()(code);
+
+    Scripts::const_iterator found = m_scripts.find(hash);
+    const bool hit = ((found != m_scripts.end()) && (found->second->code == code));
+
+    /**
+     * Not bound to context (unlike Script::Compile()), so it can be run
+     * in context of every JsVm.
+     */
+    v8::Local<v8::Script> script = (hit ? unpersist(found->second->script)
+                                        : v8::Script::New(newUtf8String(code.c_str())));
+    if (script.IsEmpty()) {
+        return v8::Local<v8::Function>();
+    }
+
+    v8::Local<v8::Value> sourceResult = script->Run();
+    if (sourceResult.IsEmpty() || !sourceResult->IsFunction()) {
+        return v8::Local<v8::Function>();
+    }
+
+    if (!hit) {
+        if (m_scripts.size() >= MAX_SCRIPTS) {
+            m_scripts.clear();
+        }
+        std::unique_ptr<Script> &cached = m_scripts[hash];
+        cached.reset(new Script);
+        cached->code = code;
+        persist(cached->script, v8::Handle<v8::Script>(script));
+    }
+
+    return v8::Local<v8::Function>::Cast(sourceResult);
+}
+
+JsVmPool &JsVmPool::local()
+{
+    static thread_local JsVmPool pool;
+    return pool;
+}
+
+JsVmIsolate *JsVmPool::acquire()
+{
+    if (m_idle.empty()) {
+        return new JsVmIsolate;
+    }
+
+    JsVmIsolate *isolate = m_idle.back().release();
+    m_idle.pop_back();
+    return isolate;
+}
+
+void JsVmPool::release(JsVmIsolate *isolate)
+{
+    if (m_idle.size() >= MAX_IDLE) {
+        delete isolate;
+        return;
+    }
+    m_idle.push_back(std::unique_ptr<JsVmIsolate>(isolate));
+}
+
+JsVm::JsVm(const std::string &code)
+    : m_vmIsolate(JsVmPool::local().acquire())
+    , m_isolateScope(m_vmIsolate->isolate())
+    , m_locker(m_vmIsolate->isolate())
+#ifdef HAVE_V8_WITH_MOST_CONSTRUCTORS_ISOLATE
+    , m_scope(m_vmIsolate->isolate())
+#endif
+    , m_context(m_vmIsolate->createContext())
+    , m_code(code)
+{
+    /**
+     * To avoid Context::Scope for every call(), just enter context
      * here, since this module already provides "box" for executing
      * user-specific code in current thread.
      */
-    m_context = newContext(NULL, m_global);
     m_context->Enter();
-
-    m_source = newUtf8String(code.c_str());
 }
 JsVm::~JsVm()
 {
+    dispose(m_accumulator);
     m_context->Exit();
 }
 
 bool JsVm::init()
 {
-    v8::Handle<v8::Script> script = v8::Script::Compile(m_source);
-    if (!*script) {
+    m_function = m_vmIsolate->compile(m_code);
+    if (m_function.IsEmpty()) {
         fillTryCatch();
         return false;
     }
+    return true;
+}
 
-    v8::Handle<v8::Value> sourceResult = script->Run();
-    if (sourceResult.IsEmpty()) {
+bool JsVm::call(const Db::Interface::Key &key, Db::Interface::Value &value)
+{
+    /**
+     * Otherwise handles will be freed only after the whole HFOR chunk
+     */
+    HandleScope scope;
+
+    v8::Local<v8::String> valueString = toString(value);
+    v8::Local<v8::Value> args[] = {
+        toString(key),
+        valueString
+    };
+
+    v8::Local<v8::Value> ret = m_function->Call(m_context->Global(), 2, args);
+    if (ret.IsEmpty()) {
         fillTryCatch();
+        throw Exception("Error while calling function");
+    }
+    if (ret->StrictEquals(valueString)) {
         return false;
     }
 
-    m_function = v8::Handle<v8::Function>::Cast(sourceResult);
+    v8::Local<v8::String> newValue = ret->ToString();
+    if (newValue.IsEmpty()) {
+        fillTryCatch();
+        throw Exception("Error while converting result of function");
+    }
+
+    const int length = newValue->Utf8Length();
+    value.resize(length);
+    if (length) {
+        newValue->WriteUtf8(&value[0], length, NULL, v8::String::NO_NULL_TERMINATION);
+    }
     return true;
 }
 
-std::string JsVm::call(const Db::Interface::Key &key, const Db::Interface::Value &value)
+v8::Local<v8::String> JsVm::toString(const std::string &string)
 {
+    return newUtf8String(string.data(), string.size());
+}
+
+bool JsVm::setAccumulator(const std::string &initial)
+{
+    HandleScope scope;
+
+    v8::Local<v8::Value> accumulator = newUndefined();
+    if (!initial.empty()) {
+        accumulator = callJson("parse", newUtf8String(initial.data(), initial.size()));
+        if (accumulator.IsEmpty()) {
+            fillTryCatch();
+            return false;
+        }
+    }
+
+    dispose(m_accumulator);
+    persist(m_accumulator, v8::Handle<v8::Value>(accumulator));
+    return true;
+}
+
+void JsVm::reduce(const Db::Interface::Key &key, const Db::Interface::Value &value)
+{
+    HandleScope scope;
+
     v8::Local<v8::Value> args[] = {
-        newUtf8String(key.c_str()),
-        newUtf8String(value.c_str())
+        toString(key),
+        toString(value),
+        unpersist(m_accumulator)
     };
 
-    v8::Local<v8::Value> ret = m_function->Call(m_context->Global(), 2, args);
+    v8::Local<v8::Value> ret = m_function->Call(m_context->Global(), 3, args);
+    if (ret.IsEmpty()) {
+        fillTryCatch();
+        throw Exception("Error while calling function");
+    }
+
+    dispose(m_accumulator);
+    persist(m_accumulator, v8::Handle<v8::Value>(ret));
+}
+
+std::string JsVm::accumulatorReply()
+{
+    HandleScope scope;
+    return toReply(unpersist(m_accumulator));
+}
+
+std::string JsVm::eval(const std::vector<Db::Interface::Key> &keys,
+                       const std::vector<const Db::Interface::Value *> &values,
+                       const std::vector<std::string> &args,
+                       Writes &writes)
+{
+    HandleScope scope;
+
+    v8::Local<v8::Array> keysArray = newArray(keys.size());
+    v8::Local<v8::Array> valuesArray = newArray(values.size());
+    v8::Local<v8::Array> argsArray = newArray(args.size());
+    std::vector< v8::Local<v8::Value> > originalValues;
+    originalValues.reserve(values.size());
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keysArray->Set(i, toString(keys[i]));
+    }
+    for (size_t i = 0; i < values.size(); ++i) {
+        originalValues.push_back(values[i]
+                                 ? v8::Local<v8::Value>(toString(*values[i]))
+                                 : v8::Local<v8::Value>(newNull()));
+        valuesArray->Set(i, originalValues.back());
+    }
+    for (size_t i = 0; i < args.size(); ++i) {
+        argsArray->Set(i, toString(args[i]));
+    }
+
+    v8::Local<v8::Value> argv[] = {
+        keysArray,
+        valuesArray,
+        argsArray
+    };
+    v8::Local<v8::Value> ret = m_function->Call(m_context->Global(), 3, argv);
     if (ret.IsEmpty()) {
         fillTryCatch();
         throw Exception("Error while calling function");
     }
-    v8::String::Utf8Value newValue(ret);
-    return std::string(*newValue);
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        v8::Local<v8::Value> value = valuesArray->Get(i);
+        if (value->StrictEquals(originalValues[i])) {
+            continue;
+        }
+
+        Write write;
+        write.index = i;
+        write.deleted = (value->IsUndefined() || value->IsNull());
+        if (write.deleted && !values[i]) {
+            continue;
+        }
+        if (!write.deleted) {
+            v8::String::Utf8Value string(value);
+            write.value.assign(*string, string.length());
+        }
+        writes.push_back(write);
+    }
+
+    return toReply(ret);
+}
+
+std::string JsVm::toReply(v8::Local<v8::Value> value)
+{
+    if (value->IsUndefined() || value->IsNull()) {
+        return CommandHandler::REPLY_NIL;
+    }
+    if (value->IsBoolean()) {
+        return value->BooleanValue() ? CommandHandler::REPLY_TRUE
+                                     : CommandHandler::REPLY_FALSE;
+    }
+    if (value->IsNumber()) {
+        const double number = value->NumberValue();
+        if ((std::floor(number) == number) && (std::fabs(number) < MAX_INTEGER_REPLY)) {
+            return CommandHandler::toIntegerReplyString(value->IntegerValue());
+        }
+    } else if (!value->IsString()) {
+        value = callJson("stringify", value);
+        if (value.IsEmpty()) {
+            fillTryCatch();
+            return CommandHandler::REPLY_ERROR;
+        }
+        // i.e. functions
+        if (value->IsUndefined()) {
+            return CommandHandler::REPLY_NIL;
+        }
+    }
+
+    v8::String::Utf8Value string(value);
+    return CommandHandler::toReplyString(std::string(*string, string.length()));
+}
+
+v8::Local<v8::Value> JsVm::callJson(const char *method, v8::Local<v8::Value> argument)
+{
+    v8::Local<v8::Object> json = m_context->Global()->Get(newUtf8String("JSON"))->ToObject();
+    v8::Local<v8::Function> function =
+        v8::Local<v8::Function>::Cast(json->Get(newUtf8String(method)));
+
+    v8::Local<v8::Value> args[] = { argument };
+    return function->Call(json, 1, args);
 }
 
 void JsVm::fillTryCatch()
@@ -11,39 +11,216 @@
 #pragma once
 
 #include "db/interface.h"
+#include <boost/noncopyable.hpp>
+#include <unordered_map>
+#include <memory>
+#include <vector>
 #include <string>
 #include <v8.h>
 
+/**
+ * @brief Warm v8 isolate, with cache of compiled scripts.
+ *
+ * Creating of isolate and compiling of script are expensive, so
+ * isolates are reused between HFOR/ATFOR (see JsVmPool), and compiled
+ * scripts are cached by hash of source.
+ * Scripts are not bound to context, and every JsVm has its own context,
+ * so globals of one script are not visible to the next one.
+ */
+class JsVmIsolate : boost::noncopyable
+{
+public:
+    JsVmIsolate();
+    ~JsVmIsolate();
+
+    v8::Isolate *isolate()
+    {
+        return m_isolate;
+    }
+    /**
+     * New context with console object.
+     * Must be called after entering isolate.
+     */
+    v8::Local<v8::Context> createContext();
+    /**
+     * Run script from cache (or compile it), in current context,
+     * and return function, that it evaluates to.
+     * Empty handle on error.
+     *
+     * Must be called after entering isolate and context.
+     */
+    v8::Local<v8::Function> compile(const std::string &code);
+
+private:
+    enum Constants
+    {
+        /**
+         * When cache is full, it is dropped completely.
+         */
+        MAX_SCRIPTS = 1 << 7 /* 128 */
+    };
+
+    struct Script : boost::noncopyable
+    {
+        std::string code;
+        v8::Persistent<v8::Script> script;
+
+        ~Script();
+    };
+    typedef std::unordered_map< size_t, std::unique_ptr<Script> > Scripts;
+
+    v8::Isolate *m_isolate;
+    v8::Persistent<v8::ObjectTemplate> m_global;
+    Scripts m_scripts;
+};
+
+/**
+ * @brief Pool of warm isolates of current thread (worker).
+ *
+ * More then one isolate can be used in one thread at a time (i.e. when
+ * one HFOR yields to io_service), that's why this is a pool.
+ */
+class JsVmPool : boost::noncopyable
+{
+public:
+    /**
+     * Pool of current thread
+     */
+    static JsVmPool &local();
+
+    JsVmIsolate *acquire();
+    void release(JsVmIsolate *isolate);
+
+    /**
+     * Deleter for std::unique_ptr, that returns isolate to pool
+     */
+    struct Releaser
+    {
+        void operator()(JsVmIsolate *isolate) const
+        {
+            JsVmPool::local().release(isolate);
+        }
+    };
+    typedef std::unique_ptr<JsVmIsolate, Releaser> Lease;
+
+private:
+    enum Constants
+    {
+        MAX_IDLE = 1 << 2 /* 4 */
+    };
+
+    std::vector< std::unique_ptr<JsVmIsolate> > m_idle;
+};
+
 /**
  * @brief Wrapper for JS VM (v8).
  *
  * Create and run this module in the same thread.
+ * Isolate is acquired from JsVmPool of current thread, and is entered
+ * while this object alive.
  *
  * XXX: more debugging/profiling/testing
  */
-class JsVm
+class JsVm : boost::noncopyable
 {
 public:
     JsVm(const std::string &code);
     ~JsVm();
     bool init();
 
-    std::string call(const Db::Interface::Key &key, const Db::Interface::Value &value);
+    /**
+     * Call function with @key and @value, and write result into @value.
+     * Return false if function returned the same value (@value is not
+     * modified then).
+     * Throws Exception on errors.
+     */
+    bool call(const Db::Interface::Key &key, Db::Interface::Value &value);
+
+    /**
+     * Reduce: accumulator = function(key, value, accumulator)
+     *
+     * @initial is JSON, empty means undefined.
+     * Return false if @initial is malformed.
+     */
+    bool setAccumulator(const std::string &initial);
+    /**
+     * Throws Exception on errors.
+     */
+    void reduce(const Db::Interface::Key &key, const Db::Interface::Value &value);
+    /**
+     * Accumulator converted to reply (see toReply())
+     */
+    std::string accumulatorReply();
+
+    /**
+     * Value of key, that was changed by script of eval()
+     */
+    struct Write
+    {
+        /**
+         * Index in keys
+         */
+        size_t index;
+        /**
+         * Script set value to null/undefined
+         */
+        bool deleted;
+        Db::Interface::Value value;
+    };
+    typedef std::vector<Write> Writes;
+    /**
+     * Stored scripts: function(keys, values, args)
+     *
+     * @values are current values of @keys (nullptr if there is no such
+     * key), script can modify values array (null/undefined - delete key),
+     * modifications are returned in @writes.
+     *
+     * Return reply (see toReply()).
+     * Throws Exception on errors.
+     */
+    std::string eval(const std::vector<Db::Interface::Key> &keys,
+                     const std::vector<const Db::Interface::Value *> &values,
+                     const std::vector<std::string> &args,
+                     Writes &writes);
 
 private:
-    v8::Isolate *m_isolate;
+    /**
+     * Must be the first, since other members depends on it,
+     * and it must be returned to pool after leaving isolate.
+     */
+    JsVmPool::Lease m_vmIsolate;
+
     v8::Isolate::Scope m_isolateScope;
     v8::Locker m_locker;
 
     v8::TryCatch m_trycatch;
 
     v8::HandleScope m_scope;
-    v8::Handle<v8::ObjectTemplate> m_global;
     v8::Handle<v8::Context> m_context;
 
-    v8::Handle<v8::String> m_source;
+    std::string m_code;
     v8::Handle<v8::Function> m_function;
 
+    v8::Persistent<v8::Value> m_accumulator;
+
+
+    /**
+     * Integers that can be represented by double exactly
+     */
+    static constexpr double MAX_INTEGER_REPLY = 9007199254740992.0 /* 2^53 */;
 
     void fillTryCatch();
+    v8::Local<v8::String> toString(const std::string &string);
+    /**
+     * - undefined/null -> nil
+     * - boolean -> 1/0
+     * - integer -> integer
+     * - string, other number -> bulk
+     * - other (objects, arrays) -> bulk with JSON
+     */
+    std::string toReply(v8::Local<v8::Value> value);
+    /**
+     * Call JSON.@method(@argument)
+     */
+    v8::Local<v8::Value> callJson(const char *method, v8::Local<v8::Value> argument);
 };
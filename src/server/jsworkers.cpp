@@ -0,0 +1,106 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include "jsworkers.h"
+#include "util/log.h"
+
+
+JsWorkers::JsWorkers()
+    : m_stopped(false)
+{
+}
+JsWorkers::~JsWorkers()
+{
+    stop();
+}
+
+void JsWorkers::start(size_t size)
+{
+    LOG(debug) << "Starting " << size << " js workers";
+
+    for (size_t i = 0; i < size; ++i) {
+        m_threads.push_back(std::thread(&JsWorkers::work, this));
+    }
+}
+
+void JsWorkers::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopped = true;
+    }
+    m_condition.notify_all();
+
+    for (std::thread &thread : m_threads) {
+        thread.join();
+    }
+    m_threads.clear();
+}
+
+void JsWorkers::run(const std::vector<Task> &tasks)
+{
+    if (tasks.empty()) {
+        return;
+    }
+    if (m_threads.empty()) {
+        for (const Task &task : tasks) {
+            task();
+        }
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t left = tasks.size() - 1;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 1; i < tasks.size(); ++i) {
+            const Task &task = tasks[i];
+            m_queue.push_back([&task, &mutex, &finished, &left] ()
+                              {
+                                  task();
+
+                                  /**
+                                   * Notify under lock, since caller can
+                                   * return (and destroy @finished) right
+                                   * after it acquired @mutex.
+                                   */
+                                  std::lock_guard<std::mutex> lock(mutex);
+                                  if (!--left) {
+                                      finished.notify_one();
+                                  }
+                              });
+        }
+    }
+    m_condition.notify_all();
+
+    tasks[0]();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&left] { return !left; });
+}
+
+void JsWorkers::work()
+{
+    while (true) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this] { return m_stopped || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                return;
+            }
+            task = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,68 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#pragma once
+
+#include "wrapper/singleton.h"
+
+#include <boost/noncopyable.hpp>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+
+
+/**
+ * @brief Threads for running scripts in parallel (i.e. HFOR THREADS <n>)
+ *
+ * This is not io_service threads, since caller waits for tasks with lock
+ * of engine held, and io_service threads can wait for that lock.
+ *
+ * Every thread has its own isolates (see JsVmPool).
+ */
+class JsWorkers : boost::noncopyable
+{
+    friend class Wrapper::Singleton<JsWorkers>;
+
+public:
+    typedef std::function<void()> Task;
+
+    void start(size_t size);
+    void stop();
+
+    size_t size() const
+    {
+        return m_threads.size();
+    }
+
+    /**
+     * Run first task in current thread, others in workers,
+     * and wait for all of them.
+     *
+     * Tasks must not throw.
+     */
+    void run(const std::vector<Task> &tasks);
+
+private:
+    std::vector<std::thread> m_threads;
+    std::deque<Task> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopped;
+
+    JsWorkers();
+    ~JsWorkers();
+
+    void work();
+};
+
+typedef Wrapper::Singleton<JsWorkers> TheJsWorkers;
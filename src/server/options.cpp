@@ -10,6 +10,8 @@
 
 #include "server/options.h"
 
+#include <thread>
+
 namespace Server
 {
     void Options::additionalOptions()
@@ -24,6 +26,41 @@ namespace Server
             ("fork,f", "Fork server process")
             ("workers,w", boost::program_options::value<int>()->default_value(2),
              "Number of workers-threads")
+            ("snapshot,S", boost::program_options::value<std::string>()->default_value("boostcached.snapshot"),
+             "Snapshot file (loaded on start, written by SAVE/BGSAVE)")
+            ("journal,J", boost::program_options::value<std::string>(),
+             "Append-only journal of modifications (replayed on start instead of snapshot)")
+            ("journal-fsync", boost::program_options::value<std::string>()->default_value("everysec"),
+             "When journal is synced: always, everysec or no")
+            ("replication-backlog", boost::program_options::value<int>()->default_value(0),
+             "Size of replication backlog in bytes, 0 disables replication (PSYNC)")
+            ("replica-of,R", boost::program_options::value<std::string>(),
+             "Replicate primary (host:port or unix socket), and reject modifications "
+             "(snapshot is saved on shutdown, to continue from it after restart)")
+            ("handoff-socket", boost::program_options::value<std::string>(),
+             "Control socket for warm restart: new process started with the same "
+             "socket takes over listening sockets and data of running one")
+            ("handoff-directory", boost::program_options::value<std::string>()->default_value("/dev/shm"),
+             "Memory-backed directory for snapshot, that is handed over on warm restart")
+            ("dataset,D", boost::program_options::value<std::string>(),
+             "Attach prebuilt read-only datasets (see bc-dataset) as key-spaces: "
+             "name=path[,name=path...]")
+            ("tier-directory", boost::program_options::value<std::string>(),
+             "Directory for extent files of cold values (i.e. on local SSD), disabled by default")
+            ("tier-min-value-size", boost::program_options::value<int>()->default_value(4096),
+             "Only values of at least this size are spilled to extent files")
+            ("tier-idle", boost::program_options::value<int>()->default_value(3600),
+             "Values that was not accessed for this number of seconds are spilled")
+            ("slowlog-threshold", boost::program_options::value<int>()->default_value(10000),
+             "Commands that took at least this number of microseconds are logged "
+             "(SLOWLOG), negative disables")
+            ("slowlog-max-len", boost::program_options::value<int>()->default_value(128),
+             "Number of entries in SLOWLOG of every worker")
+            ("hotkeys-sample-rate", boost::program_options::value<int>()->default_value(0),
+             "Sample every N'th read/write of keys for HOTKEYS, 0 disables")
+            ("js-workers,j", boost::program_options::value<int>()->default_value(
+                std::thread::hardware_concurrency()),
+             "Number of threads for parallel scripts (i.e. HFOR THREADS <n>)")
         ;
     }
 }
@@ -0,0 +1,60 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+/**
+ * Build dataset file for boostcached --dataset (see Db::Dataset)
+ *
+ * Reads "<key> TAB <value>" lines from stdin, value is the rest of line,
+ * so keys can't have tabs, and values can't have newlines.
+ */
+
+#include "db/dataset.h"
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <dataset> < <key TAB value lines>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    Db::DatasetBuilder builder;
+    if (!builder.open(argv[1])) {
+        return EXIT_FAILURE;
+    }
+
+    std::string line;
+    uint64_t lineNumber = 0;
+    while (std::getline(std::cin, line)) {
+        ++lineNumber;
+
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos) {
+            std::cerr << "Line " << lineNumber << " has no TAB, skipped" << std::endl;
+            continue;
+        }
+        if (!builder.add(line.substr(0, tab), line.substr(tab + 1))) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!builder.finish()) {
+        return EXIT_FAILURE;
+    }
+    std::cerr << builder.entries() << " entries written to " << argv[1] << std::endl;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include "asynclogbackend.h"
+
+#include <boost/log/utility/formatting_ostream.hpp>
+#include <boost/format.hpp>
+
+namespace Util
+{
+    AsyncLogBackend::AsyncLogBackend(const boost::shared_ptr<FileBackend> &file,
+                                     const boost::log::formatter &formatter,
+                                     size_t size)
+        : m_file(file)
+        , m_formatter(formatter)
+        , m_mask(2) /* sequence of free and full cell must differ */
+        , m_enqueuePosition(0)
+        , m_dequeuePosition(0)
+        , m_dropped(0)
+        , m_flushedPosition(0)
+        , m_sleeping(false)
+        , m_stop(false)
+    {
+        while (m_mask < size) {
+            m_mask <<= 1;
+        }
+        m_cells.reset(new Cell[m_mask]);
+        for (uint64_t i = 0; i < m_mask; ++i) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        --m_mask;
+
+        m_writer = std::thread(&AsyncLogBackend::write, this);
+    }
+
+    AsyncLogBackend::~AsyncLogBackend()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wakeupCondition.notify_one();
+        m_writer.join();
+    }
+
+    void AsyncLogBackend::consume(const boost::log::record_view &record)
+    {
+        // Capacity is reused, since it is swapped with message of cell
+        static thread_local std::string message;
+        message.clear();
+        {
+            boost::log::formatting_ostream stream(message);
+            m_formatter(record, stream);
+            stream.flush();
+        }
+
+        uint64_t position = m_enqueuePosition.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &m_cells[position & m_mask];
+            const uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const int64_t difference = (int64_t)(sequence - position);
+
+            if (!difference) {
+                if (m_enqueuePosition.compare_exchange_weak(position, position + 1,
+                                                            std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                // Full, writer is behind for the whole ring
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                position = m_enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->record = record;
+        cell->message.swap(message);
+        cell->sequence.store(position + 1, std::memory_order_release);
+
+        /**
+         * Pairs with fence in write(): either writer sees this record
+         * before it sleeps, or we see that it sleeps.
+         */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_wakeupCondition.notify_one();
+        }
+    }
+
+    void AsyncLogBackend::flush()
+    {
+        const uint64_t position = m_enqueuePosition.load(std::memory_order_acquire);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_flushedCondition.wait(lock, [this, position] { return m_flushedPosition >= position; });
+    }
+
+    bool AsyncLogBackend::ready() const
+    {
+        const Cell &cell = m_cells[m_dequeuePosition & m_mask];
+        return cell.sequence.load(std::memory_order_acquire) == (m_dequeuePosition + 1);
+    }
+
+    bool AsyncLogBackend::pop(boost::log::record_view &record, std::string &message)
+    {
+        if (!ready()) {
+            return false;
+        }
+
+        Cell &cell = m_cells[m_dequeuePosition & m_mask];
+        record.swap(cell.record);
+        cell.record.reset();
+        message.swap(cell.message);
+        cell.sequence.store(m_dequeuePosition + m_mask + 1, std::memory_order_release);
+        ++m_dequeuePosition;
+        return true;
+    }
+
+    void AsyncLogBackend::writeDropped(const boost::log::record_view &record)
+    {
+        uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            m_file->consume(record, str(boost::format("%i log records dropped "
+                                                      "(ring is full)") % dropped));
+        }
+    }
+
+    void AsyncLogBackend::write()
+    {
+        boost::log::record_view record;
+        std::string message;
+        bool written = false;
+
+        for (;;) {
+            if (pop(record, message)) {
+                m_file->consume(record, message);
+                writeDropped(record);
+                written = true;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            // Remaining records are already written
+            if (m_stop) {
+                break;
+            }
+            lock.unlock();
+
+            if (written) {
+                m_file->flush();
+                written = false;
+            }
+
+            lock.lock();
+            m_flushedPosition = m_dequeuePosition;
+            m_flushedCondition.notify_all();
+
+            m_sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ready() && !m_stop) {
+                m_wakeupCondition.wait(lock);
+            }
+            m_sleeping.store(false, std::memory_order_relaxed);
+        }
+
+        // Records that was dropped after the last one
+        if (record) {
+            writeDropped(record);
+        }
+        m_file->flush();
+    }
+}
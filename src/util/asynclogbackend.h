@@ -0,0 +1,110 @@
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#pragma once
+
+#include "log.h"
+
+#include <boost/log/sinks/basic_sink_backend.hpp>
+#include <boost/log/sinks/frontend_requirements.hpp>
+#include <boost/log/sinks/text_file_backend.hpp>
+#include <boost/log/expressions/formatter.hpp>
+#include <boost/shared_ptr.hpp>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <cstdint>
+
+namespace Util
+{
+    /**
+     * @brief Log backend, that writes to file from background thread
+     *
+     * Records are formatted by logging thread, and pushed to bounded
+     * lock-free ring (multiple producers/single consumer, based on bounded
+     * MPMC queue of Dmitry Vyukov), so logging thread never waits for
+     * disk or for other logging threads.
+     * If ring is full, record is dropped, and number of dropped records
+     * is written after the next one (or on exit).
+     * Writer thread sleeps on condition variable while ring is empty, and
+     * logging thread wakes it up only if it sleeps.
+     *
+     * Must be used with unlocked_sink (consume() is thread-safe).
+     */
+    class AsyncLogBackend : public boost::log::sinks::basic_sink_backend<
+        boost::log::sinks::combine_requirements<
+            boost::log::sinks::concurrent_feeding,
+            boost::log::sinks::flushing
+        >::type
+    >
+    {
+    public:
+        typedef boost::log::sinks::text_file_backend FileBackend;
+
+        /**
+         * @size is rounded up to power of two (at least 2)
+         */
+        AsyncLogBackend(const boost::shared_ptr<FileBackend> &file,
+                        const boost::log::formatter &formatter,
+                        size_t size);
+        ~AsyncLogBackend();
+
+        void consume(const boost::log::record_view &record);
+        /**
+         * Wait until all consumed records are written
+         */
+        void flush();
+
+    private:
+        struct Cell
+        {
+            std::atomic<uint64_t> sequence;
+            boost::log::record_view record;
+            std::string message;
+        };
+
+        boost::shared_ptr<FileBackend> m_file;
+        boost::log::formatter m_formatter;
+
+        std::unique_ptr<Cell[]> m_cells;
+        uint64_t m_mask;
+        std::atomic<uint64_t> m_enqueuePosition;
+        /**
+         * Only for writer thread
+         */
+        uint64_t m_dequeuePosition;
+        std::atomic<uint64_t> m_dropped;
+
+        /**
+         * Protects members below, logging thread takes it only to wake up
+         * sleeping writer
+         */
+        std::mutex m_mutex;
+        std::condition_variable m_wakeupCondition;
+        std::condition_variable m_flushedCondition;
+        /**
+         * Records before it are written and flushed
+         */
+        uint64_t m_flushedPosition;
+        std::atomic<bool> m_sleeping;
+        bool m_stop;
+        std::thread m_writer;
+
+        /**
+         * Next record is pushed completely (only for writer thread)
+         */
+        bool ready() const;
+        bool pop(boost::log::record_view &record, std::string &message);
+        void writeDropped(const boost::log::record_view &record);
+        void write();
+    };
+}
@@ -9,6 +9,7 @@
  */
 
 #include "log.h"
+#include "asynclogbackend.h"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/log/core/core.hpp>
@@ -16,6 +17,8 @@
 #include <boost/log/support/date_time.hpp>
 #include <boost/log/utility/setup/file.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
+#include <boost/log/sinks/unlocked_frontend.hpp>
+#include <boost/make_shared.hpp>
 
 #if !defined(BOOST_LOG_NO_THREADS)
 #include <boost/log/attributes/current_thread_id.hpp>
@@ -63,30 +66,49 @@ namespace Util
 #undef CASE_SEVERITY_LEVEL
     }
 
-    void installLoggerFile(const std::string &fileFormat)
+    void installLoggerFile(const std::string &fileFormat, size_t asyncRingSize)
     {
         using namespace boost::log;
 
         add_common_attributes();
 
-        add_file_log
-        (
-            keywords::file_name = fileFormat,
-            keywords::rotation_size = LOGGER_ROTATION_SIZE,
-            keywords::auto_flush = true,
-            keywords::open_mode = (std::ios::out | std::ios::app),
-            keywords::time_based_rotation = sinks::file::rotation_at_time_point(0, 0, 0),
-            keywords::format = (
-                expressions::stream
-                    << "[" << expressions::format_date_time< boost::posix_time::ptime >("TimeStamp", "%Y-%m-%d %H:%M:%S.%f") << "] "
+        formatter format = (
+            expressions::stream
+                << "[" << expressions::format_date_time< boost::posix_time::ptime >("TimeStamp", "%Y-%m-%d %H:%M:%S.%f") << "] "
 #if !defined(BOOST_LOG_NO_THREADS)
-                    // TODO: make it like in logger to tty/console
-                    << "[" << expressions::attr< thread_id >("ThreadID") << "] "
+                // TODO: make it like in logger to tty/console
+                << "[" << expressions::attr< thread_id >("ThreadID") << "] "
 #endif
-                    << "[" << trivial::severity << "]    "
-                    << expressions::message
-            )
+                << "[" << trivial::severity << "]    "
+                << expressions::message
         );
+
+        if (!asyncRingSize) {
+            add_file_log
+            (
+                keywords::file_name = fileFormat,
+                keywords::rotation_size = LOGGER_ROTATION_SIZE,
+                keywords::auto_flush = true,
+                keywords::open_mode = (std::ios::out | std::ios::app),
+                keywords::time_based_rotation = sinks::file::rotation_at_time_point(0, 0, 0),
+                keywords::format = format
+            );
+            return;
+        }
+
+        // Flushed by writer thread, when there is nothing to write
+        boost::shared_ptr<sinks::text_file_backend> file =
+            boost::make_shared<sinks::text_file_backend>
+            (
+                keywords::file_name = fileFormat,
+                keywords::rotation_size = LOGGER_ROTATION_SIZE,
+                keywords::auto_flush = false,
+                keywords::open_mode = (std::ios::out | std::ios::app),
+                keywords::time_based_rotation = sinks::file::rotation_at_time_point(0, 0, 0)
+            );
+        typedef sinks::unlocked_sink<AsyncLogBackend> AsyncSink;
+        core::get()->add_sink(boost::make_shared<AsyncSink>(
+            boost::make_shared<AsyncLogBackend>(file, format, asyncRingSize)));
     }
 }
 
@@ -16,7 +16,25 @@
 // #define BOOST_LOG_NO_THREADS
 #include <boost/log/trivial.hpp>
 
-#define LOG(...) BOOST_LOG_TRIVIAL(__VA_ARGS__)
+/**
+ * Levels below LOG_MIN_LEVEL are removed at compile time (condition is a
+ * constant, so even filter of Boost.Log is not checked), i.e. for
+ * release builds: -DLOG_MIN_LEVEL=LOG_LEVEL_info
+ *
+ * Numbers are the same as boost::log::trivial::severity_level.
+ */
+#define LOG_LEVEL_trace 0
+#define LOG_LEVEL_debug 1
+#define LOG_LEVEL_info 2
+#define LOG_LEVEL_warning 3
+#define LOG_LEVEL_error 4
+#define LOG_LEVEL_fatal 5
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_trace
+#endif
+
+#define LOG(level) \
+    if (LOG_LEVEL_ ## level < LOG_MIN_LEVEL) {} else BOOST_LOG_TRIVIAL(level)
 
 /**
  * TODO: This is not so pretty as could be
@@ -28,5 +46,9 @@ namespace Util
     };
 
     void installLoggerLevel(int level);
-    void installLoggerFile(const std::string &fileFormat);
+    /**
+     * If @asyncRingSize is not zero, log is written from background
+     * thread (see AsyncLogBackend)
+     */
+    void installLoggerFile(const std::string &fileFormat, size_t asyncRingSize = 0);
 }
\ No newline at end of file
@@ -11,6 +11,7 @@
 #include <fstream>
 #include <iostream>
 #include <limits.h>
+#include <algorithm>
 
 #include <boost/algorithm/string/trim.hpp>
 #include <boost/algorithm/string/replace.hpp>
@@ -78,7 +79,8 @@ namespace Util
 
             std::string fileFormat = getValue<std::string>("logFile");
             if (fileFormat.size()) {
-                Util::installLoggerFile(fileFormat);
+                Util::installLoggerFile(fileFormat,
+                                        std::max(getValue<int>("logAsync"), 0));
             }
         } catch(const std::exception &exception) {
             if (PRINT_HELP_ON_ERROR) {
@@ -108,6 +110,9 @@ namespace Util
              "Setup custom config file")
             ("logFile,l", po::value<std::string>(),
              "Output log (used instead of stdout, can contain modifiers)")
+            ("logAsync", po::value<int>()->default_value(0),
+             "Write log file from background thread, through lock-free ring of this "
+             "number of records (records are dropped when it is full), 0 writes synchronously")
         ;
 
         additionalOptions();
@@ -0,0 +1,48 @@
+
+/**
+ * This file is part of the boostcache package.
+ *
+ * (c) Azat Khuzhin <a3at.mail@gmail.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+/**
+ * USDT probes of "boostcache" provider (see utils/bpftrace-scripts and
+ * utils/systemtap-scripts)
+ *
+ * Probe is a single nop, until tracer attaches to it, arguments must be
+ * cheap to evaluate (integers and pointers only).
+ *
+ * All probes of connection has address of its CommandHandler as first
+ * argument:
+ * - accept(conn, address)
+ * - read(conn, bytes)
+ * - parse__complete(conn, number of arguments)
+ * - command__start(conn, name, key length)
+ * - command__done(conn, name, key length)
+ *   (also for every command of EXEC, inside of EXEC itself)
+ * - write__complete(conn, bytes)
+ *
+ * And locks of engines (see Db::SharedLock/Db::ExclusiveLock):
+ * - lock__wait(mutex, exclusive)
+ * - lock__acquired(mutex, exclusive)
+ */
+
+#pragma once
+
+#include "config.h" /** HAVE_* */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(boostcache, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(boostcache, name, a, b, c)
+#else
+/**
+ * sizeof() does not evaluate arguments, only marks them as used
+ */
+#define PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
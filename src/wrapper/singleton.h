@@ -8,6 +8,8 @@
  * file that was distributed with this source code.
  */
 
+#pragma once
+
 /**
  * TODO: we need more right/transparent way to do this.
  * TODO: thread-safity.
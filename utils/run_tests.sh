@@ -8,7 +8,7 @@ SELF=${0%/*}
 if [ ! ${SELF:0:1} = "/" ]; then
     SELF="$PWD/$SELF/"
 fi
-BOOSTCACHED=${1:-"$SELF/../.cmake/boostcached"}
+export BOOSTCACHED=${1:-"$SELF/../.cmake/boostcached"}
 
 startServer()
 {
@@ -22,3 +22,4 @@ startServer()
 startServer
 
 $SELF/test-js.sh
+$SELF/test-commands.sh
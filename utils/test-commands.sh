@@ -0,0 +1,338 @@
+#!/usr/bin/env bash
+
+#
+# Do some checks for db commands.
+# But firstly you must start server.
+#
+
+set -e
+
+timeout=10000
+host=localhost
+port=9876
+
+function send()
+{
+    realnc=$(readlink -f $(which nc))
+    if [[ "$realnc" =~ ".traditional" ]]; then
+        nc -q$timeout -w$timeout $host $port
+    else # It's likely to be openbsd version of nc
+        nc -w$timeout $host $port
+    fi
+}
+function checkOkResponse() { grep -q $'^+OK\r$'; }
+function checkIntegerResponse() { grep -q '^:'$1$'\r$'; }
+function checkBulkResponse() { tr -d '\r' | tail -n1 | grep -qx -- "$1"; }
+function bulkRequest()
+{
+    local argc=$#
+    local crlf=$'\r\n'
+    local request='*'$argc$crlf
+
+    for arg; do
+        local argLen=${#arg}
+        request+='$'$argLen$crlf$arg$crlf
+    done
+
+    echo -n "$request"
+}
+function sendBulkRequest() { bulkRequest "$@" | send; }
+
+# Partial value operations
+for prefix in H AT; do
+    sendBulkRequest ${prefix}SET partial foo | checkOkResponse
+    sendBulkRequest ${prefix}APPEND partial bar | checkIntegerResponse 6
+    sendBulkRequest ${prefix}STRLEN partial | checkIntegerResponse 6
+    sendBulkRequest ${prefix}GETRANGE partial 1 -2 | checkBulkResponse ooba
+    sendBulkRequest ${prefix}SETRANGE partial 3 BAZ | checkIntegerResponse 6
+    sendBulkRequest ${prefix}GET partial | checkBulkResponse fooBAZ
+done
+
+# Values are limited to 512MB
+for prefix in H AT; do
+    sendBulkRequest ${prefix}SETRANGE toobig 536870912 x | grep -q $'^-ERR value is too big\r$'
+    sendBulkRequest ${prefix}SETRANGE toobig 536870911 x | checkIntegerResponse 536870912
+    sendBulkRequest ${prefix}APPEND toobig x | grep -q $'^-ERR value is too big\r$'
+    sendBulkRequest ${prefix}STRLEN toobig | checkIntegerResponse 536870912
+    sendBulkRequest ${prefix}DEL toobig | checkIntegerResponse 1
+done
+
+# Compare-and-swap
+for prefix in H AT; do
+    sendBulkRequest ${prefix}CAS cas 0 foo | checkIntegerResponse '[1-9][0-9]*'
+    version=$(sendBulkRequest ${prefix}GETV cas | tr -d '\r' | sed -n 2p | tr -d ':')
+    sendBulkRequest ${prefix}CAS cas 0 bar | checkIntegerResponse 0
+    sendBulkRequest ${prefix}CAS cas $version bar | checkIntegerResponse '[1-9][0-9]*'
+    sendBulkRequest ${prefix}CAS cas $version baz | checkIntegerResponse 0
+    sendBulkRequest ${prefix}GET cas | checkBulkResponse bar
+done
+
+# Key-spaces (selected per connection)
+sendBulkRequest HSET keyspace default | checkOkResponse
+(bulkRequest SELECT test; bulkRequest HSET keyspace test; bulkRequest HGET keyspace) \
+    | send | checkBulkResponse test
+sendBulkRequest HGET keyspace | checkBulkResponse default
+(bulkRequest SELECT test; bulkRequest FLUSHDB; bulkRequest HSTRLEN keyspace) \
+    | send | checkIntegerResponse 0
+sendBulkRequest HGET keyspace | checkBulkResponse default
+sendBulkRequest INFO keyspace | grep -q $'^test:hashtable_keys=0,avltree_keys=0,calls=4,writes=2\r$'
+
+# Transactions
+(bulkRequest MULTI; bulkRequest HSET multi foo; bulkRequest HAPPEND multi bar; bulkRequest EXEC) \
+    | send | checkIntegerResponse 6
+(bulkRequest WATCH multi; bulkRequest MULTI; bulkRequest HSET multi watched; bulkRequest EXEC) \
+    | send | checkOkResponse
+sendBulkRequest HGET multi | checkBulkResponse watched
+
+# Snapshots
+sendBulkRequest SAVE | checkOkResponse
+sendBulkRequest LASTSAVE | checkIntegerResponse '[1-9][0-9]*'
+sendBulkRequest BGSAVE | grep -q $'^+Background saving started\r$'
+sendBulkRequest BGREWRITEJOURNAL | grep -q -e $'^+Background journal rewriting started\r$' -e '^-ERR journal is disabled'
+
+# Replication (connection is taken over by PSYNC, if backlog is enabled)
+sendBulkRequest PSYNC '?' -1 | grep -q -e '^+FULLRESYNC ' -e '^-ERR replication is disabled'
+
+# Introspection
+sendBulkRequest INFO | grep -q $'^connected_clients:[1-9][0-9]*\r$'
+sendBulkRequest INFO commandstats | grep -q '^cmdstat_HGET:calls=[1-9][0-9]*,'
+sendBulkRequest SLOWLOG LEN | checkIntegerResponse '[0-9][0-9]*'
+sendBulkRequest SLOWLOG RESET | checkOkResponse
+sendBulkRequest HOTKEYS RESET | checkOkResponse
+sendBulkRequest CLIENT LIST | grep -q '^id=[0-9]* addr=.* cmd=[0-9]* '
+sendBulkRequest CLIENT KILL ID 999999999 | checkIntegerResponse 0
+
+#
+# Restarts, with own server (only if $BOOSTCACHED is set, see run_tests.sh)
+#
+if [ -z "$BOOSTCACHED" ]; then
+    exit 0
+fi
+
+dir=$(mktemp -d)
+trap "rm -rf $dir" EXIT
+port=9877
+
+function startServer()
+{
+    (cd $dir && exec $BOOSTCACHED -w2 -p $port -s $dir/boostcached-$port.sock "$@" &>> $dir/log) &
+    serverPid=$!
+    sleep 2
+}
+function stopServer()
+{
+    kill -INT $serverPid
+    wait $serverPid
+}
+
+# Datasets are not journaled, so attach works after restart too
+printf 'dataset\tread-only\nempty\t\n' | ${BOOSTCACHED%/*}/bc-dataset $dir/dataset
+for restart in 0 1; do
+    startServer --journal $dir/journal --dataset ds=$dir/dataset
+    (bulkRequest SELECT ds; bulkRequest HGET dataset) | send | checkBulkResponse read-only
+    (bulkRequest SELECT ds; bulkRequest HSTRLEN dataset) | send | checkIntegerResponse 9
+    (bulkRequest SELECT ds; bulkRequest HSET dataset foo) \
+        | send | grep -q $'^-ERR HSET is not allowed on read-only key-space\r$'
+    (bulkRequest SELECT ds; bulkRequest HGET dataset) | send | checkBulkResponse read-only
+    (bulkRequest SELECT ds; bulkRequest ATGET dataset) \
+        | send | grep -q $'^-ERR ATGET is not supported on read-only key-space\r$'
+    sendBulkRequest INFO keyspace | grep -q $'^ds:dataset_keys=2,calls=4,writes=0\r$'
+    [ $restart = 0 ] || sendBulkRequest HGET journaled | checkBulkResponse 0
+    sendBulkRequest HSET journaled $restart | checkOkResponse
+    stopServer
+done
+if grep -q "already exists" $dir/log; then
+    exit 1
+fi
+
+# Lookup in corrupted dataset without empty buckets (all of them point to
+# the first record, that follows the header) stops after all buckets
+cp $dir/dataset $dir/corrupted
+buckets=$(od -An -t u8 -j 16 -N 8 $dir/corrupted)
+indexOffset=$(od -An -t u8 -j 24 -N 8 $dir/corrupted)
+for ((i = 0; i < buckets; ++i)); do printf '\x20\0\0\0\0\0\0\0'; done \
+    | dd of=$dir/corrupted bs=1 seek=$((indexOffset)) conv=notrunc 2> /dev/null
+startServer --dataset ds=$dir/corrupted
+(bulkRequest SELECT ds; bulkRequest HGET dataset) | send | checkBulkResponse read-only
+(bulkRequest SELECT ds; bulkRequest HGET missing) | send | grep -qx $'\$-1\r'
+stopServer
+
+# With fsync on every write, replies are sent after records are synced
+startServer --journal $dir/always --journal-fsync always
+(bulkRequest HSET always foo; bulkRequest HAPPEND always bar; bulkRequest HGET always) \
+    | send | checkBulkResponse foobar
+(bulkRequest MULTI; bulkRequest HAPPEND always baz; bulkRequest EXEC) | send | checkIntegerResponse 9
+sendBulkRequest HGET always | checkBulkResponse foobarbaz
+stopServer
+startServer --journal $dir/always
+sendBulkRequest HGET always | checkBulkResponse foobarbaz
+stopServer
+
+# Warm restart: running process resumes, if it can't hand its state over
+startServer --handoff-socket $dir/handoff --handoff-directory $dir/missing
+runningPid=$serverPid
+sendBulkRequest HSET handoff running | checkOkResponse
+startServer --handoff-socket $dir/handoff --handoff-directory $dir
+if wait $serverPid; then
+    exit 1
+fi
+sendBulkRequest HGET handoff | checkBulkResponse running
+serverPid=$runningPid
+stopServer
+
+# And exits after new process took over its sockets and data
+startServer --handoff-socket $dir/handoff --handoff-directory $dir
+runningPid=$serverPid
+sendBulkRequest HSET handoff taken | checkOkResponse
+startServer --handoff-socket $dir/handoff --handoff-directory $dir
+wait $runningPid
+sendBulkRequest HGET handoff | checkBulkResponse taken
+stopServer
+
+# Clients of unix domain socket have own addresses, and are killed one by one
+function sendUnix() { nc -w$timeout -U $dir/boostcached-$port.sock; }
+startServer
+sleep 5 | sendUnix > /dev/null &
+idlePid=$!
+sleep 1
+clients=$(bulkRequest CLIENT LIST | sendUnix | grep -o ' addr=unix:[^ ]*')
+[ $(echo "$clients" | sort -u | wc -l) = 2 ]
+bulkRequest CLIENT KILL $(echo "$clients" | head -n1 | cut -d= -f2) | sendUnix | checkOkResponse
+wait $idlePid || true
+[ $(bulkRequest CLIENT LIST | sendUnix | grep -c ' addr=unix:') = 1 ]
+stopServer
+
+# Asynchronous log: records are dropped when ring is full (record of every
+# key, logged by script, does not fit into ring of two records), and the
+# rest is written on exit (only info level, since trace is compiled out of
+# release builds)
+startServer -vvv --logFile $dir/async.log --logAsync 2
+seq 1000 | sed 's/.*/HSET async& &\r/' | send | grep -c $'^+OK\r$' | grep -qx 1000
+sendBulkRequest HFOR '(function(key, value) { console.log("Key: " + key); return value; })' \
+    | grep -q $'^:1\r$'
+stopServer
+grep -q 'log records dropped (ring is full)$' $dir/async.log
+grep -q 'Server was stopped$' $dir/async.log
+
+# Snapshot is loaded by segments of 64K entries in parallel, so it must have
+# more than one segment for both engines
+startServer --snapshot $dir/big.snapshot
+seq 70000 | sed 's/.*/HSET snap& &\r\nATSET snap& &\r/' | send | grep -c $'^+OK\r$' | grep -qx 140000
+sendBulkRequest SAVE | checkOkResponse
+stopServer
+startServer --snapshot $dir/big.snapshot
+for i in 1 65536 65537 70000; do
+    sendBulkRequest HGET snap$i | checkBulkResponse $i
+    sendBulkRequest ATGET snap$i | checkBulkResponse $i
+done
+sendBulkRequest INFO keyspace | grep -q $'^0:hashtable_keys=70000,avltree_keys=70000,calls=8,writes=0\r$'
+stopServer
+
+# Cold values are spilled to extent file, and it is compacted after most of
+# them are deleted (extent file must be at least 64MB)
+mkdir $dir/tier
+startServer -vvv --tier-directory $dir/tier --tier-min-value-size 1024 --tier-idle 1
+for i in {1..70}; do bulkRequest HSET tier$i "$(printf '%-1048576s' $i)"; done \
+    | send | grep -c $'^+OK\r$' | grep -qx 70
+function spilledBytes() { sendBulkRequest INFO memory | grep -o 'hashtable_spilled_bytes=[0-9]*' | cut -d= -f2; }
+for i in {1..30}; do
+    [ $(spilledBytes) = $((70 << 20)) ] && break
+    sleep 1
+done
+[ $(spilledBytes) = $((70 << 20)) ]
+for i in {1..50}; do bulkRequest HDEL tier$i; done | send | grep -c $'^:1\r$' | grep -qx 50
+for i in {1..30}; do
+    grep -q 'Compacting extent file' $dir/log && break
+    sleep 1
+done
+grep -q 'Compacting extent file' $dir/log
+[ $(spilledBytes) = $((20 << 20)) ]
+for i in 51 60 70; do
+    sendBulkRequest HGET tier$i | tr -d ' ' | checkBulkResponse $i
+    sendBulkRequest HSTRLEN tier$i | checkIntegerResponse $((1 << 20))
+    sendBulkRequest HAPPEND tier$i tail | checkIntegerResponse $(((1 << 20) + 4))
+    sendBulkRequest HGET tier$i | tr -d ' ' | checkBulkResponse ${i}tail
+done
+# Values that can't be read (extent file is truncated) are reported and kept spilled
+for fd in /proc/$serverPid/fd/*; do
+    if [[ "$(readlink $fd)" = "$dir/tier/"* ]]; then
+        : > $fd
+    fi
+done
+function checkUnreadable() { grep -q $'^-ERR can\'t read spilled value\r$'; }
+sendBulkRequest HGET tier61 | checkUnreadable
+sendBulkRequest HAPPEND tier61 tail | checkUnreadable
+sendBulkRequest HGET tier61 | checkUnreadable
+sendBulkRequest SAVE | grep -q '^-ERR'
+stopServer
+
+# Journal is rewritten in background, records that are appended meanwhile
+# are copied to the rewritten one (large values make rewriting long enough
+# to be concurrent with writes)
+startServer -vvv --journal $dir/rewrite
+for i in {1..20}; do bulkRequest HSET big$i "$(printf '%1048576s' $i)"; done \
+    | send | grep -c $'^+OK\r$' | grep -qx 20
+seq 100000 | sed 's/.*/HSET rewrite &\r/' | send | grep -c $'^+OK\r$' | grep -qx 100000
+size=$(stat -c %s $dir/rewrite)
+function waitRewritten()
+{
+    for i in {1..300}; do
+        [ $(grep -c 'Background journal rewriting finished' $dir/log) = $1 ] && return
+        sleep 0.1
+    done
+    return 1
+}
+seq 1000000 | sed 's/.*/HSET concurrent &\r/' > $dir/concurrent.in
+send < $dir/concurrent.in | grep -c $'^+OK\r$' > $dir/concurrent &
+writerPid=$!
+while sendBulkRequest HSTRLEN concurrent | checkIntegerResponse 0; do
+    sleep 0.1
+done
+for rewrite in {1..5}; do
+    sendBulkRequest BGREWRITEJOURNAL | grep -q $'^+Background journal rewriting started\r$'
+    waitRewritten $rewrite
+done
+wait $writerPid
+[ $(cat $dir/concurrent) = 1000000 ]
+sendBulkRequest BGREWRITEJOURNAL | grep -q $'^+Background journal rewriting started\r$'
+waitRewritten 6
+stopServer
+startServer --journal $dir/rewrite
+sendBulkRequest HSTRLEN big20 | checkIntegerResponse 1048576
+sendBulkRequest HGET rewrite | checkBulkResponse 100000
+sendBulkRequest HGET concurrent | checkBulkResponse 1000000
+[ $(stat -c %s $dir/rewrite) -lt $size ]
+stopServer
+
+# Replica applies stream of primary and rejects modifications, and after
+# restart continues from its position (saved with snapshot on shutdown)
+function sendReplica() { local port=9878; send; }
+startServer -vvv --snapshot $dir/primary.snapshot --replication-backlog 1048576
+primaryPid=$serverPid
+port=9878 startServer -vvv --snapshot $dir/replica.snapshot --replica-of localhost:9877
+replicaPid=$serverPid
+sendBulkRequest HSET replicated foo | checkOkResponse
+sendBulkRequest ATSET replicated bar | checkOkResponse
+sleep 1
+bulkRequest HGET replicated | sendReplica | checkBulkResponse foo
+bulkRequest ATGET replicated | sendReplica | checkBulkResponse bar
+bulkRequest HSET replicated baz | sendReplica \
+    | grep -q $'^-ERR HSET is not allowed on read-only replica\r$'
+stopServer
+sendBulkRequest HSET replicated continued | checkOkResponse
+port=9878 startServer -vvv --snapshot $dir/replica.snapshot --replica-of localhost:9877
+sleep 1
+bulkRequest HGET replicated | sendReplica | checkBulkResponse continued
+bulkRequest ATGET replicated | sendReplica | checkBulkResponse bar
+stopServer
+serverPid=$primaryPid
+stopServer
+grep -q 'Replication from localhost:9877 continues from ' $dir/log
+[ $(grep -c 'Full resync from localhost:9877 finished' $dir/log) = 1 ]
+
+# With sampling of every access, the hammered key is the hottest one
+startServer --hotkeys-sample-rate 1
+(seq 100 | sed 's/.*/HSET cold& &\r/'; seq 1000 | sed 's/.*/HGET hot\r/') | send > /dev/null
+sendBulkRequest HOTKEYS | tr -d '\r' | sed -n '4p;6p' | paste -sd' ' | grep -qx 'hot hashtable'
+sendBulkRequest HOTKEYS 1 | tr -d '\r' | head -n1 | grep -qx '\*1'
+stopServer
@@ -33,6 +33,41 @@ IFS='' jsCheckUpdatedKeys=$(cat <<EOF
 })
 EOF
 )
+IFS='' jsIdentity=$(cat <<EOF
+(function(key, value) {
+    return value;
+})
+EOF
+)
+IFS='' jsCount=$(cat <<EOF
+(function(key, value, count) {
+    return count + 1;
+})
+EOF
+)
+IFS='' jsCountGlobal=$(cat <<EOF
+(function(key, value, count) {
+    calls = (typeof calls === "undefined") ? 1 : (calls + 1);
+    return calls;
+})
+EOF
+)
+IFS='' jsCheckNoGlobal=$(cat <<EOF
+(function(key, value) {
+    if (typeof calls !== "undefined") {
+        throw ("Global of previous script is visible");
+    }
+    return value;
+})
+EOF
+)
+IFS='' jsIncrBy=$(cat <<EOF
+(function(keys, values, args) {
+    values[0] = String(parseInt(values[0] || "0") + parseInt(args[0]));
+    return parseInt(values[0]);
+})
+EOF
+)
 
 function send()
 {
@@ -68,3 +103,43 @@ done
 sendBulkRequest HFOR "$jsForEach" | checkTrueResponse
 sendBulkRequest HFOR "$jsThrow" | checkErrorResponse
 sendBulkRequest HFOR "$jsCheckUpdatedKeys" | checkTrueResponse
+
+# Non-atomic (default) and atomic modes
+sendBulkRequest HFOR "$jsForEach" CHUNK 7 | checkTrueResponse
+sendBulkRequest HFOR "$jsThrow" CHUNK 7 | checkErrorResponse
+sendBulkRequest HFOR "$jsForEach" ATOMIC | checkTrueResponse
+sendBulkRequest HFOR "$jsCheckUpdatedKeys" CHUNK 1 | checkTrueResponse
+
+# Parallel
+sendBulkRequest HFOR "$jsForEach" THREADS 4 | checkTrueResponse
+sendBulkRequest HFOR "$jsThrow" ATOMIC THREADS 4 | checkErrorResponse
+sendBulkRequest HFOR "$jsCheckUpdatedKeys" CHUNK 100 THREADS 4 | checkTrueResponse
+
+# Unchanged values are not written (version is the same)
+sendBulkRequest HSET identity foo | checkOkResponse
+version=$(sendBulkRequest HGETV identity | sed -n 2p)
+sendBulkRequest HFOR "$jsIdentity" | checkTrueResponse
+[ "$(sendBulkRequest HGETV identity | sed -n 2p)" = "$version" ]
+
+# Read-only reduce
+sendBulkRequest HREDUCE "$jsCount" 0 | grep -q $'^:1001\r$'
+sendBulkRequest HREDUCE "$jsThrow" | checkErrorResponse
+
+# Every script has its own globals (context), even if isolate is reused
+sendBulkRequest HREDUCE "$jsCountGlobal" | grep -q $'^:1001\r$'
+sendBulkRequest HREDUCE "$jsCountGlobal" | grep -q $'^:1001\r$'
+sendBulkRequest HFOR "$jsCheckNoGlobal" | checkTrueResponse
+
+# Stored scripts
+sha=$(sendBulkRequest SCRIPT LOAD "$jsIncrBy" | sed -n 2p | tr -d '\r')
+sendBulkRequest HEVALSHA $sha 1 counter 5 | grep -q $'^:5\r$'
+sendBulkRequest HEVALSHA $sha 1 counter 5 | grep -q $'^:10\r$'
+sendBulkRequest HGET counter | grep -q $'^10\r$'
+sendBulkRequest HEVALSHA 0000000000000000000000000000000000000000 0 | grep -q '^-NOSCRIPT'
+
+# Filters
+sendBulkRequest HFOR "$jsForEach" PREFIX foo1 | checkTrueResponse
+sendBulkRequest HFOR "$jsForEach" MATCH 'foo*0' CHUNK 10 | checkTrueResponse
+sendBulkRequest ATSET foo bar | checkOkResponse
+sendBulkRequest ATFOR "$jsThrow" PREFIX bar | checkTrueResponse
+sendBulkRequest ATFOR "$jsForEach" RANGE a z | checkTrueResponse